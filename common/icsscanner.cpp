@@ -0,0 +1,326 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "icsscanner.h"
+
+#include <QString>
+#include <QRegExp>
+#include <QByteArrayMatcher>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define ICSSCANNER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define ICSSCANNER_NEON
+#endif
+
+namespace {
+#if defined(ICSSCANNER_NEON)
+    // Equivalent of SSE2 movemask, with 4 bits per byte.
+    inline quint64 neonMask(uint8x16_t matches)
+    {
+        const uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+    }
+#endif
+
+    inline bool isXmlSpecial(uchar c)
+    {
+        return c == '\n' || c == '&' || c == '"' || c == '\'' || c == '<' || c == '>'
+            || c == '\0' || c >= 0x80;
+    }
+
+    // Slow path of xmlSanitise(), for lines holding special characters.
+    QByteArray sanitiseLine(QByteArray line)
+    {
+        // First, hack to turn sanitised input into malformed input:
+        line.replace("&amp;",  "&");
+        line.replace("&quot;", "\"");
+        line.replace("&apos;", "'");
+        line.replace("&lt;",   "<");
+        line.replace("&gt;",   ">");
+        // Then, fix for malformed input:
+        QString lineStr(line);
+        // RegExp should avoid escaping & when this character is starting
+        // a valid numeric character reference (decimal or hexadecimal).
+        // Other HTLML entities like &nbsp; seems to make iCal parser
+        // fails, so we're encoding them.
+        lineStr.replace(QRegExp("&(?!#[0-9]+;|#x[0-9A-Fa-f]+;)"), "&amp;");
+        line = lineStr.toUtf8();
+        line.replace('"',  "&quot;");
+        line.replace('\'', "&apos;");
+        line.replace('<',  "&lt;");
+        line.replace('>',  "&gt;");
+        return line;
+    }
+
+    inline void flush(QByteArray *result, const char **copied, const char *upTo)
+    {
+        result->append(*copied, upTo - *copied);
+        *copied = upTo;
+    }
+
+    QByteArray normaliseLines(const QByteArray &data, bool relocateUid, bool *relocated)
+    {
+        QByteArray result;
+        result.reserve(data.size() + data.size() / 32 + 4);
+        const char *copied = data.constData();
+        const char *line = copied;
+        const char *end = copied + data.size();
+        bool checkUid = relocateUid;
+        bool inVEvent = false;
+        int eventCount = 0;
+        const char *trailer = "\r\n\r\n";
+        QByteArray storedUidLine;
+        while (line < end) {
+            const char *eol = IcsScanner::findByte(line, end, '\n');
+            const char *next = eol < end ? eol + 1 : end;
+            const bool missingCR = eol < end && (eol == line || eol[-1] != '\r');
+            if (checkUid) {
+                const QByteArray piece = QByteArray::fromRawData(line, eol - line);
+                if (piece.startsWith("UID") && !inVEvent) {
+                    // Do not copy the UID line yet.
+                    flush(&result, &copied, line);
+                    copied = next;
+                    storedUidLine = QByteArray(line, eol - line);
+                    storedUidLine.append(missingCR ? "\r\n" : "\n");
+                    if (eol == end) {
+                        // The line would be terminated by the trailing empty lines.
+                        trailer = "\r\n";
+                    }
+                    line = next;
+                    continue;
+                } else if (piece.startsWith("END:VEVENT")) {
+                    inVEvent = false;
+                } else if (piece.startsWith("BEGIN:VEVENT")) {
+                    ++eventCount;
+                    inVEvent = true;
+                    if (storedUidLine.isEmpty()) {
+                        // Use the original data if the VEVENT is reached without finding the UID.
+                        checkUid = false;
+                    } else if (eol == end) {
+                        // The line is terminated by the trailing empty lines.
+                        flush(&result, &copied, end);
+                        result.append("\r\n");
+                        result.append(storedUidLine);
+                        trailer = "\r\n";
+                    }
+                }
+            }
+            if (missingCR) {
+                flush(&result, &copied, eol);
+                result.append('\r');
+            }
+            if (checkUid && inVEvent && eol < end && !storedUidLine.isEmpty()
+                && QByteArray::fromRawData(line, eol - line).startsWith("BEGIN:VEVENT")) {
+                flush(&result, &copied, next);
+                result.append(storedUidLine);
+            }
+            line = next;
+        }
+        flush(&result, &copied, end);
+        result.append(trailer);
+
+        if (!storedUidLine.isEmpty() && eventCount != 1) {
+            // The UID could not be relocated, return the original data.
+            return normaliseLines(data, false, relocated);
+        }
+        if (relocated) {
+            *relocated = !storedUidLine.isEmpty();
+        }
+        return result;
+    }
+}
+
+const char *IcsScanner::findByte(const char *from, const char *end, char c)
+{
+#if defined(ICSSCANNER_SSE2)
+    const __m128i needle = _mm_set1_epi8(c);
+    while (end - from >= 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from));
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) {
+            return from + __builtin_ctz(mask);
+        }
+        from += 16;
+    }
+#elif defined(ICSSCANNER_NEON)
+    const uint8x16_t needle = vdupq_n_u8(uchar(c));
+    while (end - from >= 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(from));
+        const quint64 mask = neonMask(vceqq_u8(chunk, needle));
+        if (mask) {
+            return from + (__builtin_ctzll(mask) >> 2);
+        }
+        from += 16;
+    }
+#endif
+    while (from < end && *from != c) {
+        ++from;
+    }
+    return from;
+}
+
+const char *IcsScanner::findXmlSpecial(const char *from, const char *end)
+{
+#if defined(ICSSCANNER_SSE2)
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i apos = _mm_set1_epi8('\'');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i nul = _mm_setzero_si128();
+    while (end - from >= 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from));
+        __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, amp));
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, quot));
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, apos));
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, lt));
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, gt));
+        matches = _mm_or_si128(matches, _mm_cmpeq_epi8(chunk, nul));
+        // Non-ASCII bytes are the ones with the high bit set.
+        const int mask = _mm_movemask_epi8(matches) | _mm_movemask_epi8(chunk);
+        if (mask) {
+            return from + __builtin_ctz(mask);
+        }
+        from += 16;
+    }
+#elif defined(ICSSCANNER_NEON)
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    const uint8x16_t amp = vdupq_n_u8('&');
+    const uint8x16_t quot = vdupq_n_u8('"');
+    const uint8x16_t apos = vdupq_n_u8('\'');
+    const uint8x16_t lt = vdupq_n_u8('<');
+    const uint8x16_t gt = vdupq_n_u8('>');
+    const uint8x16_t nul = vdupq_n_u8(0);
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    while (end - from >= 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(from));
+        uint8x16_t matches = vorrq_u8(vceqq_u8(chunk, lf), vceqq_u8(chunk, amp));
+        matches = vorrq_u8(matches, vceqq_u8(chunk, quot));
+        matches = vorrq_u8(matches, vceqq_u8(chunk, apos));
+        matches = vorrq_u8(matches, vceqq_u8(chunk, lt));
+        matches = vorrq_u8(matches, vceqq_u8(chunk, gt));
+        matches = vorrq_u8(matches, vceqq_u8(chunk, nul));
+        matches = vorrq_u8(matches, vcgeq_u8(chunk, high));
+        const quint64 mask = neonMask(matches);
+        if (mask) {
+            return from + (__builtin_ctzll(mask) >> 2);
+        }
+        from += 16;
+    }
+#endif
+    while (from < end && !isXmlSpecial(uchar(*from))) {
+        ++from;
+    }
+    return from;
+}
+
+QByteArray IcsScanner::normalise(const QByteArray &data, bool *uidRelocated)
+{
+    return normaliseLines(data, true, uidRelocated);
+}
+
+QByteArray IcsScanner::insertICalVersion(const QByteArray &data)
+{
+    static const QByteArrayMatcher beginTag(QByteArrayLiteral("BEGIN:VCALENDAR"));
+
+    QByteArray result;
+    result.reserve(data.size() + 16);
+    const char *copied = data.constData();
+    const char *end = copied + data.size();
+    int at = beginTag.indexIn(data);
+    while (at >= 0) {
+        const char *line = data.constData() + at;
+        if (at > 0 && line[-1] != '\n') {
+            at = beginTag.indexIn(data, at + 1);
+            continue;
+        }
+        const char *eol = findByte(line, end, '\n');
+        if (eol == end) {
+            flush(&result, &copied, end);
+            result.append("\nVERSION:2.0\r");
+            break;
+        }
+        flush(&result, &copied, eol + 1);
+        result.append("VERSION:2.0\r\n");
+        at = beginTag.indexIn(data, eol + 1 - data.constData());
+    }
+    flush(&result, &copied, end);
+    return result;
+}
+
+QByteArray IcsScanner::xmlSanitise(const QByteArray &data)
+{
+    static const QByteArrayMatcher calendarTag(QByteArrayLiteral("VCALENDAR"));
+
+    QByteArray result;
+    result.reserve(data.size() + 1);
+    const char *begin = data.constData();
+    const char *end = begin + data.size();
+    const char *copied = begin;
+    const char *line = begin;
+    int nextTag = calendarTag.indexIn(data);
+    int depth = 0;
+    bool inCData = false;
+    while (true) {
+        bool sanitise = depth > 0 && !inCData;
+        bool clean = true;
+        const char *eol;
+        if (sanitise) {
+            eol = findXmlSpecial(line, end);
+            if (eol < end && *eol != '\n') {
+                clean = false;
+                eol = findByte(eol, end, '\n');
+            }
+        } else {
+            eol = findByte(line, end, '\n');
+        }
+        if (nextTag >= 0 && nextTag < eol - begin) {
+            const QByteArray piece = QByteArray::fromRawData(line, eol - line);
+            if (piece.contains("BEGIN:VCALENDAR")) {
+                depth += 1;
+                inCData = piece.contains("<![CDATA[");
+                sanitise = false;
+            } else if (piece.contains("END:VCALENDAR")) {
+                depth -= 1;
+                inCData = false;
+                sanitise = false;
+            }
+            nextTag = calendarTag.indexIn(data, eol - begin);
+        }
+        if (sanitise && !clean) {
+            // We're inside a VCALENDAR/ics block.
+            flush(&result, &copied, line);
+            result.append(sanitiseLine(QByteArray(line, eol - line)));
+            copied = eol;
+        }
+        if (eol == end) {
+            break;
+        }
+        line = eol + 1;
+    }
+    flush(&result, &copied, end);
+    result.append('\n');
+    return result;
+}
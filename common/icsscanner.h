@@ -0,0 +1,54 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef ICSSCANNER_H
+#define ICSSCANNER_H
+
+#include <QByteArray>
+
+// Byte scanning routines used to fix up the iCal data received from
+// servers. Each routine is a single pass over the buffer, looking for
+// the bytes of interest 16 at a time with SSE2 or NEON when available,
+// and copying the untouched spans in bulk.
+namespace IcsScanner {
+    // Returns the first position of c in [from, end), or end.
+    const char *findByte(const char *from, const char *end, char c);
+
+    // Returns the first position in [from, end) holding a line feed,
+    // an XML special character or a non-ASCII byte, or end.
+    const char *findXmlSpecial(const char *from, const char *end);
+
+    // Converts line endings to CRLF, terminates the data with an empty
+    // line and, for single-event data, moves a UID found before the
+    // VEVENT inside it. uidRelocated is set when the UID was moved.
+    QByteArray normalise(const QByteArray &data, bool *uidRelocated = nullptr);
+
+    // Adds a VERSION:2.0 line after each BEGIN:VCALENDAR line of
+    // CRLF-normalised data, to force iCal parsing.
+    QByteArray insertICalVersion(const QByteArray &data);
+
+    // Some servers don't XML-escape the ics content when they return it
+    // in the XML stream. Re-escapes the content of the VCALENDAR blocks
+    // of an XML document, except inside CDATA sections.
+    QByteArray xmlSanitise(const QByteArray &data);
+}
+
+#endif // ICSSCANNER_H
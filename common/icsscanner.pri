@@ -0,0 +1,7 @@
+# Byte scanning routines shared by the DAV library and the plugin,
+# compiled in each of them.
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/icsscanner.cpp
+
+HEADERS += $$PWD/icsscanner.h
@@ -41,6 +41,19 @@ namespace {
                                          request.errorData());
     }
 
+    QHash<QString, QString> etags(const Report &report, const QString &path)
+    {
+        QHash<QString, QString> etags;
+        for (const Buteo::Dav::Resource &resource : report.response()) {
+            if (!resource.href.contains(path)) {
+                qCWarning(lcDav) << "href does not contain server path:" << resource.href << ":" << path;
+            } else {
+                etags.insert(resource.href, resource.etag);
+            }
+        }
+        return etags;
+    }
+
     QString ensureRoot(const QString &path)
     {
         if (path.startsWith(QChar('/')))
@@ -384,7 +397,8 @@ QList<Buteo::Dav::CalendarInfo> Buteo::Dav::Client::calendars() const
   which occur within \param from and \param to.
 
   The list of etags for every found resource will be exposed in the
-  calendarEtagsFinished() signal, as a map between resource path and etag.
+  calendarEtagsFinished() and calendarEtagsResult() signals, as a map
+  between resource path and etag.
 */
 void Buteo::Dav::Client::getCalendarEtags(const QString &path,
                                    const QDateTime &from, const QDateTime &to)
@@ -394,25 +408,44 @@ void Buteo::Dav::Client::getCalendarEtags(const QString &path,
             [this, report] (const QString &uri) {
                 report->deleteLater();
 
-                QHash<QString, QString> etags;
-                for (const Buteo::Dav::Resource &resource : report->response()) {
-                    if (!resource.href.contains(uri)) {
-                        qCWarning(lcDav) << "href does not contain server path:" << resource.href << ":" << uri;
-                    } else {
-                        etags.insert(resource.href, resource.etag);
-                    }
-                }
-                emit calendarEtagsFinished(reply(*report, uri), etags);
+                const Reply result = reply(*report, uri);
+                const QHash<QString, QString> found = etags(*report, uri);
+                emit calendarEtagsFinished(result, found);
+                emit calendarEtagsResult(result, report->statusCode(), QStringList(), found);
             });
     report->getAllETags(path, from, to);
 }
 
+/*!
+  Request the etags of the calendar resources at \param path
+  listed in \param hrefs, without their data.
+
+  The etags will be exposed in the calendarEtagsFinished() and
+  calendarEtagsResult() signals, as a map between resource path and etag.
+  The calendarEtagsResult() signal gives back \param hrefs, to tell
+  several of these requests apart.
+*/
+void Buteo::Dav::Client::getCalendarEtags(const QString &path, const QStringList &hrefs)
+{
+    Report *report = new Report(d->m_networkManager, &d->m_settings);
+    connect(report, &Report::finished, this,
+            [this, report, hrefs] (const QString &uri) {
+                report->deleteLater();
+
+                const Reply result = reply(*report, uri);
+                const QHash<QString, QString> found = etags(*report, uri);
+                emit calendarEtagsFinished(result, found);
+                emit calendarEtagsResult(result, report->statusCode(), hrefs, found);
+            });
+    report->multiGetETags(path, hrefs);
+}
+
 /*!
   Request the list of any calendar resources available at \param path
   which occur within \param from and \param to.
 
   The list of found resources will be exposed in the calendarResourcesFinished()
-  signal.
+  and calendarResourcesResult() signals.
 */
 void Buteo::Dav::Client::getCalendarResources(const QString &path,
                                        const QDateTime &from, const QDateTime &to)
@@ -422,7 +455,10 @@ void Buteo::Dav::Client::getCalendarResources(const QString &path,
             [this, report] (const QString &uri) {
                 report->deleteLater();
 
-                emit calendarResourcesFinished(reply(*report, uri), report->response());
+                const Reply result = reply(*report, uri);
+                emit calendarResourcesFinished(result, report->response());
+                emit calendarResourcesResult(result, report->statusCode(), QStringList(),
+                                             report->response());
             });
     report->getAllEvents(path, from, to);
 }
@@ -432,16 +468,19 @@ void Buteo::Dav::Client::getCalendarResources(const QString &path,
   matching the provided \param uids.
 
   The list of found resources will be exposed in the calendarResourcesFinished()
-  signal.
+  and calendarResourcesResult() signals. The calendarResourcesResult()
+  signal gives back \param uids, to tell several of these requests apart.
 */
 void Buteo::Dav::Client::getCalendarResources(const QString &path, const QStringList &uids)
 {
     Report *report = new Report(d->m_networkManager, &d->m_settings);
     connect(report, &Report::finished, this,
-            [this, report] (const QString &uri) {
+            [this, report, uids] (const QString &uri) {
                 report->deleteLater();
 
-                emit calendarResourcesFinished(reply(*report, uri), report->response());
+                const Reply result = reply(*report, uri);
+                emit calendarResourcesFinished(result, report->response());
+                emit calendarResourcesResult(result, report->statusCode(), uids, report->response());
             });
     report->multiGetEvents(path, uids);
 }
@@ -452,19 +491,31 @@ void Buteo::Dav::Client::getCalendarResources(const QString &path, const QString
   When \param etag is not empty, the resource on the server must match the
   provided \param etag.
 
-  When the operation is complete, the sendCalendarFinished() signal will be
-  emitted. The \param etag of this signal is the new etag of the resource as
-  saved on the server. It may be empty is the server configuration don't reply
-  with the new etag.
+  When the operation is complete, the sendCalendarFinished() and
+  sendCalendarResult() signals will be emitted. The \param etag of these
+  signals is the new etag of the resource as saved on the server. It may be
+  empty is the server configuration don't reply with the new etag.
 */
 void Buteo::Dav::Client::sendCalendarResource(const QString &path, const QString &data, const QString &etag)
+{
+    sendCalendarResource(path, data.toUtf8(), etag);
+}
+
+/*!
+  Send the given UTF-8 encoded calendar \param data to the server at
+  \param path location. See the QString overload for the meaning of
+  \param etag.
+*/
+void Buteo::Dav::Client::sendCalendarResource(const QString &path, const QByteArray &data, const QString &etag)
 {
     Put *put = new Put(d->m_networkManager, &d->m_settings);
     connect(put, &Put::finished, this,
             [this, put] (const QString &uri) {
                 put->deleteLater();
 
-                emit sendCalendarFinished(reply(*put, uri), put->updatedETag(uri));
+                const Reply result = reply(*put, uri);
+                emit sendCalendarFinished(result, put->updatedETag(uri));
+                emit sendCalendarResult(result, put->statusCode(), put->updatedETag(uri));
             });
     put->sendIcalData(path, data, etag);
 }
@@ -473,13 +524,26 @@ void Buteo::Dav::Client::sendCalendarResource(const QString &path, const QString
   Delete the resource from the server at \param path.
 */
 void Buteo::Dav::Client::deleteResource(const QString &path)
+{
+    deleteResource(path, QString());
+}
+
+/*!
+  Delete the resource from the server at \param path.
+
+  When \param etag is not empty, the resource on the server must match the
+  provided \param etag.
+*/
+void Buteo::Dav::Client::deleteResource(const QString &path, const QString &etag)
 {
     Delete *del = new Delete(d->m_networkManager, &d->m_settings, this);
     connect(del, &Delete::finished, this,
             [this, del] (const QString &uri) {
                 del->deleteLater();
 
-                emit deleteFinished(reply(*del, uri));
+                const Reply result = reply(*del, uri);
+                emit deleteFinished(result);
+                emit deleteResult(result, del->statusCode());
             });
-    del->deleteEvent(path);
+    del->deleteEvent(path, etag);
 }
@@ -26,6 +26,7 @@
 #include <QDateTime>
 #include <QHash>
 #include <QNetworkReply>
+#include <QStringList>
 
 #include "davexport.h"
 #include "davtypes.h"
@@ -81,12 +82,15 @@ public:
 
     void getCalendarEtags(const QString &path,
                           const QDateTime &from, const QDateTime &to);
+    void getCalendarEtags(const QString &path, const QStringList &hrefs);
     void getCalendarResources(const QString &path,
                               const QDateTime &from, const QDateTime &to);
     void getCalendarResources(const QString &path, const QStringList &uids);
     void sendCalendarResource(const QString &path, const QString &data, const QString &etag = QString());
+    void sendCalendarResource(const QString &path, const QByteArray &data, const QString &etag = QString());
 
     void deleteResource(const QString &path);
+    void deleteResource(const QString &path, const QString &etag);
 
 signals:
     void dnsLookupFinished(const Reply &reply);
@@ -96,6 +100,15 @@ signals:
     void calendarResourcesFinished(const Reply &reply, const QList<Resource> &resources);
     void sendCalendarFinished(const Reply &reply, const QString &etag);
     void deleteFinished(const Reply &reply);
+    // Same as the signals above, with the HTTP status code of
+    // the response, or 0 when none was received, and the resources
+    // asked for by a multiget REPORT, empty otherwise.
+    void calendarEtagsResult(const Reply &reply, int statusCode, const QStringList &hrefs,
+                             const QHash<QString, QString> &etags);
+    void calendarResourcesResult(const Reply &reply, int statusCode, const QStringList &hrefs,
+                                 const QList<Resource> &resources);
+    void sendCalendarResult(const Reply &reply, int statusCode, const QString &etag);
+    void deleteResult(const Reply &reply, int statusCode);
 
 private:
     QScopedPointer<ClientPrivate> d;
@@ -37,9 +37,17 @@ Delete::Delete(QNetworkAccessManager *manager, Settings *settings, QObject *pare
 }
 
 void Delete::deleteEvent(const QString &href)
+{
+    deleteEvent(href, QString());
+}
+
+void Delete::deleteEvent(const QString &href, const QString &eTag)
 {
     QNetworkRequest request;
     prepareRequest(&request, href);
+    if (!eTag.isEmpty()) {
+        request.setRawHeader("If-Match", eTag.toLatin1());
+    }
     QNetworkReply *reply = mNAManager->sendCustomRequest(request, REQUEST_TYPE.toLatin1());
     reply->setProperty(PROP_INCIDENCE_URI, href);
     debugRequest(request, QString());
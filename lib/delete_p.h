@@ -41,6 +41,7 @@ public:
     Delete(QNetworkAccessManager *manager, Settings *settings, QObject *parent = 0);
 
     void deleteEvent(const QString &href);
+    void deleteEvent(const QString &href, const QString &eTag);
 
 protected:
     virtual void handleReply(QNetworkReply *reply);
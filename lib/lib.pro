@@ -4,6 +4,8 @@ QT -= gui
 QT += network
 CONFIG += qt hide_symbols create_prl create_pc no_install_prl
 
+include(../common/icsscanner.pri)
+
 SOURCES += report.cpp \
         head.cpp \
         put.cpp \
@@ -38,7 +38,7 @@ Put::Put(QNetworkAccessManager *manager, Settings *settings, QObject *parent)
 {
 }
 
-void Put::sendIcalData(const QString &uri, const QString &icalData, const QString &eTag)
+void Put::sendIcalData(const QString &uri, const QByteArray &data, const QString &eTag)
 {
     if (uri.isEmpty()) {
         finishedWithInternalError("no uri provided");
@@ -50,9 +50,8 @@ void Put::sendIcalData(const QString &uri, const QString &icalData, const QStrin
     }
 
     mLocalUriList.insert(uri);
-    QByteArray data = icalData.toUtf8();
     if (data.isEmpty()) {
-        finishedWithInternalError("no ical data provided or cannot convert data to UTF-8");
+        finishedWithInternalError("no ical data provided");
         return;
     }
 
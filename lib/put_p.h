@@ -41,7 +41,7 @@ class Put : public Request
 public:
     Put(QNetworkAccessManager *manager, Settings *settings, QObject *parent = 0);
 
-    void sendIcalData(const QString &uri, const QString &icalData,
+    void sendIcalData(const QString &uri, const QByteArray &data,
                       const QString &eTag = QString());
 
     QString updatedETag(const QString &uri) const;
@@ -23,62 +23,14 @@
 
 #include "reader_p.h"
 #include "logging_p.h"
+#include "icsscanner.h"
 
 #include <QDebug>
 #include <QUrl>
 #include <QList>
-#include <QRegExp>
 #include <QByteArray>
 #include <QXmlStreamReader>
 
-namespace {
-   /* Some servers don't XML-escape the ics content when they return it
-    * in the XML stream, so we need to fix any issues.
-    * Note that this can cause line-lengths to exceed the spec (due to
-    * & -> &amp; expansion etc) but our iCal parser is more robust than
-    * our XML parser, so this works. */
-    QByteArray xmlSanitiseIcsData(const QByteArray &data) {
-        QList<QByteArray> lines = data.split('\n');
-        int depth = 0;
-        bool inCData = false;
-        QByteArray retn;
-        retn.reserve(data.size());
-        for (QList<QByteArray>::const_iterator it = lines.constBegin(); it != lines.constEnd(); it++) {
-            QByteArray line = *it;
-            if (line.contains("BEGIN:VCALENDAR")) {
-                depth += 1;
-                inCData = line.contains("<![CDATA[");
-            } else if (line.contains("END:VCALENDAR")) {
-                depth -= 1;
-                inCData = false;
-            } else if (depth > 0 && !inCData) {
-                // We're inside a VCALENDAR/ics block.
-                // First, hack to turn sanitised input into malformed input:
-                line.replace("&amp;",  "&");
-                line.replace("&quot;", "\"");
-                line.replace("&apos;", "'");
-                line.replace("&lt;",   "<");
-                line.replace("&gt;",   ">");
-                // Then, fix for malformed input:
-                QString lineStr(line);
-                // RegExp should avoid escaping & when this character is starting
-                // a valid numeric character reference (decimal or hexadecimal).
-                // Other HTLML entities like &nbsp; seems to make iCal parser
-                // fails, so we're encoding them.
-                lineStr.replace(QRegExp("&(?!#[0-9]+;|#x[0-9A-Fa-f]+;)"), "&amp;");
-                line = lineStr.toUtf8();
-                line.replace('"',  "&quot;");
-                line.replace('\'', "&apos;");
-                line.replace('<',  "&lt;");
-                line.replace('>',  "&gt;");
-            }
-            retn.append(line);
-            retn.append('\n');
-        }
-        return retn;
-    }
-}
-
 Reader::Reader(QObject *parent)
     : QObject(parent)
 {
@@ -92,7 +44,7 @@ Reader::~Reader()
 void Reader::read(const QByteArray &data)
 {
     delete mReader;
-    mReader = new QXmlStreamReader(xmlSanitiseIcsData(data));
+    mReader = new QXmlStreamReader(IcsScanner::xmlSanitise(data));
     while (mReader->readNextStartElement()) {
         if (mReader->name() == "multistatus") {
             mValidResponse = true;
@@ -109,13 +109,29 @@ void Report::sendCalendarQuery(const QString &remoteCalendarPath,
 }
 
 void Report::multiGetEvents(const QString &remoteCalendarPath, const QStringList &eventHrefList)
+{
+    sendMultiGet(remoteCalendarPath, eventHrefList, true);
+}
+
+void Report::multiGetETags(const QString &remoteCalendarPath, const QStringList &eventHrefList)
+{
+    sendMultiGet(remoteCalendarPath, eventHrefList, false);
+}
+
+void Report::sendMultiGet(const QString &remoteCalendarPath,
+                          const QStringList &eventHrefList,
+                          bool getCalendarData)
 {
     if (eventHrefList.isEmpty()) {
         return;
     }
 
     QByteArray requestData = "<c:calendar-multiget xmlns:d=\"DAV:\" xmlns:c=\"urn:ietf:params:xml:ns:caldav\">" \
-                             "<d:prop><d:getetag /><c:calendar-data /></d:prop>";
+                             "<d:prop><d:getetag />";
+    if (getCalendarData) {
+        requestData += "<c:calendar-data />";
+    }
+    requestData += "</d:prop>";
     for (const QString &eventHref : eventHrefList) {
         requestData.append("<d:href>");
         requestData.append(eventHref.toUtf8());
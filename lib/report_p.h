@@ -47,6 +47,7 @@ public:
                      const QDateTime &fromDateTime = QDateTime(),
                      const QDateTime &toDateTime = QDateTime());
     void multiGetEvents(const QString &remoteCalendarPath, const QStringList &eventHrefList);
+    void multiGetETags(const QString &remoteCalendarPath, const QStringList &eventHrefList);
 
     const QList<Buteo::Dav::Resource>& response() const;
 
@@ -59,6 +60,9 @@ private:
                            const QDateTime &fromDateTime,
                            const QDateTime &toDateTime,
                            bool getCalendarData);
+    void sendMultiGet(const QString &remoteCalendarPath,
+                      const QStringList &eventHrefList,
+                      bool getCalendarData);
     QString mRemoteCalendarPath;
     QList<Buteo::Dav::Resource> mResponse;
 };
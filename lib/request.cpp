@@ -33,6 +33,7 @@ Request::Request(QNetworkAccessManager *manager,
     , REQUEST_TYPE(requestType)
     , mSettings(settings)
     , mNetworkError(QNetworkReply::NoError)
+    , mStatusCode(0)
 {
 }
 
@@ -56,6 +57,11 @@ QNetworkReply::NetworkError Request::networkError() const
     return mNetworkError;
 }
 
+int Request::statusCode() const
+{
+    return mStatusCode;
+}
+
 QString Request::command() const
 {
     return REQUEST_TYPE;
@@ -64,14 +70,14 @@ QString Request::command() const
 void Request::finishedWithReplyResult(const QString &uri, QNetworkReply *reply)
 {
     mNetworkError = reply->error();
+    mStatusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
     if (reply->error() == QNetworkReply::NoError) {
         debugReplyAndReadAll(reply);
         finishedWithSuccess(uri);
     } else {
-        int code = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
         qCWarning(lcDav) << "The" << command()
                          << "operation failed with error:" << reply->error()
-                         << ", HTTP code:" << code;
+                         << ", HTTP code:" << mStatusCode;
         const QByteArray data(reply->readAll());
         debugReply(*reply, data);
         finishedWithError(uri,
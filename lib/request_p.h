@@ -45,6 +45,7 @@ public:
     QString errorMessage() const;
     QByteArray errorData() const;
     QNetworkReply::NetworkError networkError() const;
+    int statusCode() const;
 
 Q_SIGNALS:
     void finished(const QString &uri);
@@ -76,6 +77,7 @@ protected:
     const QString REQUEST_TYPE;
     Settings* mSettings;
     QNetworkReply::NetworkError mNetworkError;
+    int mStatusCode;
     bool mErrorOccurred;
     QString mErrorMessage;
     QByteArray mErrorData;
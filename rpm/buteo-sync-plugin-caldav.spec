@@ -9,6 +9,7 @@ Requires(post): /sbin/ldconfig
 Requires(postun): /sbin/ldconfig
 BuildRequires:  pkgconfig(Qt5Core)
 BuildRequires:  pkgconfig(Qt5DBus)
+BuildRequires:  pkgconfig(Qt5Concurrent)
 BuildRequires:  pkgconfig(Qt5Network)
 BuildRequires:  pkgconfig(Qt5Test)
 BuildRequires:  pkgconfig(libsignon-qt5)
@@ -80,6 +81,7 @@ This package contains unit tests for the CalDAV Buteo sync plugin.
 /opt/tests/buteo/plugins/caldav/tst_notebooksyncagent
 /opt/tests/buteo/plugins/caldav/tst_propfind
 /opt/tests/buteo/plugins/caldav/tst_caldavclient
+/opt/tests/buteo/plugins/caldav/tst_icsscanner
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_insert_exdate.xml
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_insert_and_update.xml
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_recurring.xml
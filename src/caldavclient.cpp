@@ -34,6 +34,7 @@
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QtGlobal>
 #include <QStandardPaths>
 
@@ -53,6 +54,20 @@ const QString cleanSyncMarkersFile = cleanSyncMarkersFileDir + QStringLiteral("/
 
 const char * const SYNC_PREV_PERIOD_KEY = "Sync Previous Months Span";
 const char * const SYNC_NEXT_PERIOD_KEY = "Sync Next Months Span";
+const char * const SYNC_COMMIT_STRATEGY_KEY = "Sync Commit Strategy";
+const char * const SYNC_COMMIT_BATCH_SIZE_KEY = "Sync Commit Batch Size";
+const char * const SYNC_PIPELINED_APPLY_KEY = "Sync Pipelined Apply";
+const char * const SYNC_STAGING_THRESHOLD_KEY = "Sync Staging Threshold";
+const char * const SYNC_UPLOAD_WINDOW_KEY = "Sync Upload Window";
+const char * const SYNC_PUSH_WINDOW_KEY = "Sync Push Window";
+const char * const SYNC_FUTURE_REFRESH_KEY = "Sync Future Refresh Interval";
+const char * const SYNC_PAST_REFRESH_KEY = "Sync Past Refresh Interval";
+const char * const SYNC_PROGRESSIVE_KEY = "Sync Progressive Initial Sync";
+const char * const SYNC_TWO_PHASE_KEY = "Sync Two Phase Initial Sync";
+const char * const SYNC_EVICTION_MARGIN_KEY = "Sync Eviction Margin";
+const char * const SYNC_MAX_STALENESS_KEY = "Sync Max Staleness";
+
+const int DEFAULT_COMMIT_BATCH_SIZE = 500;
 
 }
 
@@ -68,10 +83,14 @@ CalDavClient::CalDavClient(const QString& aPluginName,
                            const Buteo::SyncProfile& aProfile,
                            Buteo::PluginCbInterface *aCbInterface)
     : ClientPlugin(aPluginName, aProfile, aCbInterface)
+    , mHasDatabaseErrors(false)
+    , mPipelinedApply(false)
     , mManager(0)
     , mAuth(0)
     , mCalendar(0)
     , mStorage(0)
+    , mCommitStrategy(NotebookSyncAgent::CommitPerNotebook)
+    , mCommitBatchSize(DEFAULT_COMMIT_BATCH_SIZE)
     , mDAV(0)
 {
     FUNCTION_CALL_TRACE(lcCalDavTrace);
@@ -177,6 +196,47 @@ void CalDavClient::deleteNotebooksForAccount(int accountId, mKCal::ExtendedCalen
     }
 }
 
+// Prepares a clean sync of the notebooks of the account, keeping the
+// local incidences that match the server ones. Notebooks that cannot
+// be matched to a server calendar anymore are deleted. Returns false
+// when some notebooks are left unreconciled for now, because of local
+// changes not sent yet.
+bool CalDavClient::reconcileNotebooksForAccount(int accountId)
+{
+    FUNCTION_CALL_TRACE(lcCalDavTrace);
+
+    const QString accountIdStr = QString::number(accountId);
+    const mKCal::Notebook::List notebookList = mStorage->notebooks();
+    int reconciledCount = 0;
+    int deferredCount = 0;
+    int deletedCount = 0;
+    for (mKCal::Notebook::Ptr notebook : notebookList) {
+        if (notebook->account() == accountIdStr) {
+            switch (NotebookSyncAgent::prepareCleanSync(mStorage, notebook)) {
+            case NotebookSyncAgent::CleanSyncPrepared:
+                reconciledCount++;
+                break;
+            case NotebookSyncAgent::CleanSyncDeferred:
+                deferredCount++;
+                break;
+            case NotebookSyncAgent::CleanSyncUnmatched:
+                if (mStorage->deleteNotebook(notebook)) {
+                    deletedCount++;
+                }
+                break;
+            }
+        } else if (notebook->account().startsWith(accountIdStr + "-")) {
+            // for historical reasons, cannot be matched anymore.
+            if (mStorage->deleteNotebook(notebook)) {
+                deletedCount++;
+            }
+        }
+    }
+    qCDebug(lcCalDav) << "Reconciling" << reconciledCount << "notebooks, deferred" << deferredCount
+                      << "notebooks, deleted" << deletedCount << "notebooks";
+    return deferredCount == 0;
+}
+
 bool CalDavClient::cleanSyncRequired()
 {
     static const QByteArray iniFileDir = cleanSyncMarkersFileDir.toUtf8();
@@ -197,10 +257,12 @@ bool CalDavClient::cleanSyncRequired()
     free(cleaned_value);
 
     if (!alreadyClean) {
-        // first, delete any data associated with this account, so this sync will be a clean sync.
-        qCWarning(lcCalDav) << "Deleting caldav notebooks associated with this account:" << mService->account()->id()
+        // first, reset the sync state of the data associated with this account,
+        // so this sync will be a clean sync. Local data matching the server
+        // are kept, the rest is downloaded again.
+        qCWarning(lcCalDav) << "Reconciling caldav notebooks associated with this account:" << mService->account()->id()
                             << "due to clean sync";
-        deleteNotebooksForAccount(mService->account()->id(), mCalendar, mStorage);
+        const bool reconciled = reconcileNotebooksForAccount(mService->account()->id());
         // now delete notebooks for non-existent accounts.
         qCWarning(lcCalDav) << "Deleting caldav notebooks associated with nonexistent accounts due to clean sync";
         // a) find out which accounts are associated with each of our notebooks.
@@ -238,8 +300,12 @@ bool CalDavClient::cleanSyncRequired()
             }
         }
 
-        // mark this account as having been cleaned.
-        if (SailfishKeyProvider_ini_write(
+        // mark this account as having been cleaned, unless some notebooks
+        // are still to be reconciled once their local changes are sent.
+        if (!reconciled) {
+            qCWarning(lcCalDav) << "Some notebooks have pending local changes, the clean sync of account"
+                                << mService->account()->id() << "will be completed at the next sync";
+        } else if (SailfishKeyProvider_ini_write(
                 iniFileDir.constData(),
                 iniFile.constData(),
                 "General",
@@ -263,7 +329,28 @@ void CalDavClient::connectivityStateChanged(Sync::ConnectivityType aType, bool a
     FUNCTION_CALL_TRACE(lcCalDavTrace);
     qCDebug(lcCalDav) << "Received connectivity change event:" << aType << " changed to " << aState;
     if (aType == Sync::CONNECTIVITY_INTERNET && !aState) {
-        // we lost connectivity during sync.
+        // we lost connectivity during sync, keep what was
+        // exchanged so far, for the next sync to resume from it,
+        // with a single save of the storage.
+        QList<NotebookSyncAgent*> checkpoints;
+        for (NotebookSyncAgent *agent: mNotebookSyncAgents) {
+            if (mAppliedAgents.contains(agent)) {
+                continue;
+            } else if (agent->checkpoint()) {
+                checkpoints << agent;
+            } else {
+                qCWarning(lcCalDav) << "Unable to store the sync checkpoint of notebook:" << agent->path();
+            }
+        }
+        if (!checkpoints.isEmpty() && !mStorage->save(mKCal::ExtendedStorage::PurgeDeleted)) {
+            qCWarning(lcCalDav) << "Unable to save the sync checkpoints of account" << mService->account()->id();
+        } else {
+            for (NotebookSyncAgent *agent: const_cast<const QList<NotebookSyncAgent*>&>(checkpoints)) {
+                if (!agent->commitCheckpoint()) {
+                    qCWarning(lcCalDav) << "Unable to store the sync checkpoint of notebook:" << agent->path();
+                }
+            }
+        }
         abortSync(Sync::SYNC_CONNECTION_ERROR);
     }
 }
@@ -353,20 +440,36 @@ public:
         // For backward compatibility reasons, remote paths are always saved
         // encoded. Previously, they were decoded in the NotebookSyncAgent constructor.
         QStringList encoded;
+        bool modified = false;
         account->selectService(srv);
         for (const QString &path : paths)
             encoded << QString::fromUtf8(QUrl::toPercentEncoding(path, "/"));
-        account->setValue("calendars", encoded);
+        modified = setValue(account, "calendars", encoded) || modified;
         encoded.clear();
         for (const QString &path : enabled)
             encoded << QString::fromUtf8(QUrl::toPercentEncoding(path, "/"));
-        account->setValue("enabled_calendars", enabled);
-        account->setValue("calendar_display_names", displayNames);
-        account->setValue("calendar_colors", colors);
+        modified = setValue(account, "enabled_calendars", enabled) || modified;
+        modified = setValue(account, "calendar_display_names", displayNames) || modified;
+        modified = setValue(account, "calendar_colors", colors) || modified;
         account->selectService(Accounts::Service());
-        account->syncAndBlock();
+        // Syncing blocks until the account database is written, skip it
+        // when the stored values are already the right ones.
+        if (modified) {
+            account->syncAndBlock();
+        } else {
+            qCDebug(lcCalDav) << "Calendar settings are unchanged for account" << account->id();
+        }
     }
 private:
+    static bool setValue(Accounts::Account *account, const char *key, const QStringList &value)
+    {
+        if (account->value(QLatin1String(key)).toStringList() == value) {
+            return false;
+        }
+        account->setValue(QLatin1String(key), value);
+        return true;
+    }
+
     QStringList paths;
     QStringList displayNames;
     QStringList colors;
@@ -561,6 +664,29 @@ void CalDavClient::getSyncDateRange(const QDateTime &sourceDate, QDateTime *from
     *toDateTime = sourceDate.addMonths((valid) ? int(qMin(nextPeriod, uint(120))) : 12);
 }
 
+void CalDavClient::getCommitStrategy(NotebookSyncAgent::CommitStrategy *strategy, int *batchSize)
+{
+    if (!strategy || !batchSize) {
+        qCWarning(lcCalDav) << "strategy or batchSize is invalid";
+        return;
+    }
+    const Buteo::Profile* client = iProfile.clientProfile();
+    const QString value = client ? client->key(SYNC_COMMIT_STRATEGY_KEY) : QString();
+    if (value == QStringLiteral("account")) {
+        *strategy = NotebookSyncAgent::CommitPerAccount;
+    } else if (value == QStringLiteral("batch")) {
+        *strategy = NotebookSyncAgent::CommitPerBatch;
+    } else {
+        if (!value.isEmpty() && value != QStringLiteral("notebook")) {
+            qCWarning(lcCalDav) << "Unknown commit strategy" << value << ", committing per notebook.";
+        }
+        *strategy = NotebookSyncAgent::CommitPerNotebook;
+    }
+    bool valid = (client != 0);
+    uint size = (valid) ? client->key(SYNC_COMMIT_BATCH_SIZE_KEY).toUInt(&valid) : 0;
+    *batchSize = (valid && size > 0) ? int(size) : DEFAULT_COMMIT_BATCH_SIZE;
+}
+
 void CalDavClient::start()
 {
     FUNCTION_CALL_TRACE(lcCalDavTrace);
@@ -632,6 +758,35 @@ void CalDavClient::syncCalendars(const QList<Buteo::Dav::CalendarInfo> &allCalen
     QDateTime fromDateTime;
     QDateTime toDateTime;
     getSyncDateRange(QDateTime::currentDateTime().toUTC(), &fromDateTime, &toDateTime);
+    getCommitStrategy(&mCommitStrategy, &mCommitBatchSize);
+    const Buteo::Profile* client = iProfile.clientProfile();
+    mPipelinedApply = client && client->boolKey(SYNC_PIPELINED_APPLY_KEY, false);
+    if (mPipelinedApply && mCommitStrategy == NotebookSyncAgent::CommitPerAccount) {
+        qCWarning(lcCalDav) << "Cannot commit once per account when applying notebooks as soon as they are finished,"
+                            << "committing per notebook.";
+        mCommitStrategy = NotebookSyncAgent::CommitPerNotebook;
+    }
+    bool valid = (client != 0);
+    const uint stagingThreshold = (valid) ? client->key(SYNC_STAGING_THRESHOLD_KEY).toUInt(&valid) : 0;
+    bool validWindow = (client != 0);
+    const uint uploadWindow = (validWindow) ? client->key(SYNC_UPLOAD_WINDOW_KEY).toUInt(&validWindow) : 0;
+    // Given in minutes in the profile, 0 meaning that local changes
+    // are always sent within a quick sync.
+    const int pushWindow = (client) ? client->key(SYNC_PUSH_WINDOW_KEY).toInt() : 0;
+    // Given in minutes too, 0 meaning that the etags of the whole
+    // period are listed at every quick sync.
+    const int futureRefresh = (client) ? client->key(SYNC_FUTURE_REFRESH_KEY).toInt() : 0;
+    const int pastRefresh = (client) ? client->key(SYNC_PAST_REFRESH_KEY).toInt() : 0;
+    const bool progressive = client && client->boolKey(SYNC_PROGRESSIVE_KEY, false);
+    // Also used when the server fails to send the whole window at once.
+    const bool twoPhase = client && client->boolKey(SYNC_TWO_PHASE_KEY, false);
+    // Given in days, 0 meaning that incidences outside the window are kept.
+    const int evictionMargin = (client) ? client->key(SYNC_EVICTION_MARGIN_KEY).toInt() : 0;
+    // Given in minutes, 0 meaning that all calendars are listed at every sync.
+    const int maxStaleness = (client) ? client->key(SYNC_MAX_STALENESS_KEY).toInt() : 0;
+    mAppliedAgents.clear();
+    mDeletedNotebooks.clear();
+    mHasDatabaseErrors = false;
 
     // for each calendar path we need to sync:
     //  - if it is mapped to a known notebook, we need to perform quick sync
@@ -654,8 +809,23 @@ void CalDavClient::syncCalendars(const QList<Buteo::Dav::CalendarInfo> &allCalen
                          QLatin1String("unable to load calendar storage"));
             return;
         }
+        agent->setCommitStrategy(mCommitStrategy, mCommitBatchSize);
+        // Threshold is given in KiB in the profile, 0 meaning no staging.
+        agent->setStagingThreshold((valid) ? qint64(stagingThreshold) * 1024 : 0);
+        if (validWindow && uploadWindow > 0) {
+            agent->setUploadWindow(uploadWindow);
+        }
+        agent->setConflictResolutionPolicy(mConflictResPolicy);
+        agent->setPushWindow(pushWindow * 60);
+        agent->setRefreshIntervals(futureRefresh * 60, pastRefresh * 60);
+        agent->setProgressiveSlowSync(progressive);
+        agent->setTwoPhaseSlowSync(twoPhase);
+        agent->setEvictionMargin(evictionMargin);
+        agent->setMaxStaleness(maxStaleness * 60);
         connect(agent, &NotebookSyncAgent::finished,
                 this, &CalDavClient::notebookSyncFinished);
+        connect(agent, &NotebookSyncAgent::chunkCommitted,
+                this, &CalDavClient::notebookChunkCommitted);
         mNotebookSyncAgents.append(agent);
 
         agent->startSync(fromDateTime, toDateTime,
@@ -676,6 +846,32 @@ void CalDavClient::clearAgents()
         mNotebookSyncAgents[i]->deleteLater();
     }
     mNotebookSyncAgents.clear();
+    mAppliedAgents.clear();
+}
+
+void CalDavClient::applyNotebookChanges(NotebookSyncAgent *agent)
+{
+    if (!agent->applyRemoteChanges()) {
+        qCWarning(lcCalDav) << "Unable to write notebook changes for notebook:" << agent->path();
+        mHasDatabaseErrors = true;
+    }
+    if (agent->isDeleted()) {
+        mDeletedNotebooks += agent->path();
+    }
+    mAppliedAgents.insert(agent);
+    if (mCommitStrategy != NotebookSyncAgent::CommitPerAccount) {
+        reportNotebookResults(agent);
+    }
+}
+
+// In per-account mode, the results are only known once
+// the changes of all notebooks have been saved.
+void CalDavClient::reportNotebookResults(NotebookSyncAgent *agent)
+{
+    if (!agent->isDeleted()) {
+        mResults.addTargetResults(agent->result());
+    }
+    agent->finalize();
 }
 
 void CalDavClient::notebookSyncFinished()
@@ -691,6 +887,12 @@ void CalDavClient::notebookSyncFinished()
     }
     agent->disconnect(this);
 
+    if (mPipelinedApply) {
+        // Write this notebook changes without waiting for the other ones,
+        // the sync is not all-or-nothing anymore for the account.
+        applyNotebookChanges(agent);
+    }
+
     bool finished = true;
     for (int i=0; i<mNotebookSyncAgents.count(); i++) {
         if (!mNotebookSyncAgents[i]->isFinished()) {
@@ -700,42 +902,115 @@ void CalDavClient::notebookSyncFinished()
     }
     if (finished) {
         bool hasFatalError = false;
-        bool hasDatabaseErrors = false;
         bool hasDownloadErrors = false;
         bool hasUploadErrors = false;
-        QStringList deletedNotebooks;
         for (int i=0; i<mNotebookSyncAgents.count(); i++) {
             hasFatalError = hasFatalError || !mNotebookSyncAgents[i]->isCompleted();
             hasDownloadErrors = hasDownloadErrors || mNotebookSyncAgents[i]->hasDownloadErrors();
             hasUploadErrors = hasUploadErrors || mNotebookSyncAgents[i]->hasUploadErrors();
-            if (!mNotebookSyncAgents[i]->applyRemoteChanges()) {
-                qCWarning(lcCalDav) << "Unable to write notebook changes for notebook at index:" << i;
-                hasDatabaseErrors = true;
+            if (!mAppliedAgents.contains(mNotebookSyncAgents[i])) {
+                applyNotebookChanges(mNotebookSyncAgents[i]);
             }
-            if (mNotebookSyncAgents[i]->isDeleted()) {
-                deletedNotebooks += mNotebookSyncAgents[i]->path();
-            } else {
-                mResults.addTargetResults(mNotebookSyncAgents[i]->result());
+        }
+        int commitCount = 0;
+        qint64 commitDuration = 0;
+        if (mCommitStrategy == NotebookSyncAgent::CommitPerAccount) {
+            QElapsedTimer timer;
+            timer.start();
+            const bool saved = mStorage->save(mKCal::ExtendedStorage::PurgeDeleted);
+            if (!saved) {
+                qCWarning(lcCalDav) << "Unable to save notebook changes for account" << mService->account()->id();
+                mHasDatabaseErrors = true;
+            }
+            commitCount += 1;
+            commitDuration += timer.elapsed();
+            for (int i=0; i<mNotebookSyncAgents.count(); i++) {
+                // The sync date of a failed or unsaved sync is kept,
+                // so its changes are exchanged again next time.
+                if (!saved) {
+                    mNotebookSyncAgents[i]->setCommitFailed();
+                } else if (!mNotebookSyncAgents[i]->isDeleted()
+                           && mNotebookSyncAgents[i]->isCompleted()
+                           && !mNotebookSyncAgents[i]->storeNotebook()) {
+                    qCWarning(lcCalDav) << "Unable to store notebook at index:" << i;
+                    mHasDatabaseErrors = true;
+                }
+                reportNotebookResults(mNotebookSyncAgents[i]);
             }
-            mNotebookSyncAgents[i]->finalize();
         }
-        removeAccountCalendars(deletedNotebooks);
+        int skippedUploadCount = 0;
+        QStringList skippedCalendars;
+        int pastUnlistedCount = 0, futureUnlistedCount = 0;
+        QStringList pastUnlistedCalendars, futureUnlistedCalendars;
+        for (int i=0; i<mNotebookSyncAgents.count(); i++) {
+            commitCount += mNotebookSyncAgents[i]->commitCount();
+            commitDuration += mNotebookSyncAgents[i]->commitDuration();
+            skippedUploadCount += mNotebookSyncAgents[i]->skippedUploadCount();
+            if (mNotebookSyncAgents[i]->isListingSkipped()) {
+                skippedCalendars << mNotebookSyncAgents[i]->path();
+            }
+            if (mNotebookSyncAgents[i]->pastUnlistedCount() >= 0) {
+                pastUnlistedCount += mNotebookSyncAgents[i]->pastUnlistedCount();
+                pastUnlistedCalendars << mNotebookSyncAgents[i]->path();
+            }
+            if (mNotebookSyncAgents[i]->futureUnlistedCount() >= 0) {
+                futureUnlistedCount += mNotebookSyncAgents[i]->futureUnlistedCount();
+                futureUnlistedCalendars << mNotebookSyncAgents[i]->path();
+            }
+        }
+        qCInfo(lcCalDav) << "Saved remote changes in" << commitCount << "transaction(s), in"
+                         << commitDuration << "ms.";
+        if (skippedUploadCount) {
+            qCInfo(lcCalDav) << "Skipped" << skippedUploadCount << "uploads of unchanged local modifications.";
+        }
+        if (!skippedCalendars.isEmpty()) {
+            qCInfo(lcCalDav) << "Skipped the remote changes of low-churn calendars:" << skippedCalendars;
+        }
+        if (!pastUnlistedCalendars.isEmpty()) {
+            qCInfo(lcCalDav) << "Skipped the etag listing of" << pastUnlistedCount
+                             << "past resources in" << pastUnlistedCalendars;
+        }
+        if (!futureUnlistedCalendars.isEmpty()) {
+            qCInfo(lcCalDav) << "Skipped the etag listing of" << futureUnlistedCount
+                             << "far future resources in" << futureUnlistedCalendars;
+        }
+        removeAccountCalendars(mDeletedNotebooks);
+        Buteo::SyncResults::MinorCode minorCode = Buteo::SyncResults::NO_ERROR;
+        QString message;
         if (hasFatalError) {
-            syncFinished(Buteo::SyncResults::CONNECTION_ERROR,
-                         QLatin1String("unable to complete the sync process"));
+            minorCode = Buteo::SyncResults::CONNECTION_ERROR;
+            message = QLatin1String("unable to complete the sync process");
         } else if (hasDownloadErrors) {
-            syncFinished(Buteo::SyncResults::ITEM_FAILURES,
-                         QLatin1String("unable to fetch all upstream changes"));
+            minorCode = Buteo::SyncResults::ITEM_FAILURES;
+            message = QLatin1String("unable to fetch all upstream changes");
         } else if (hasUploadErrors) {
-            syncFinished(Buteo::SyncResults::ITEM_FAILURES,
-                         QLatin1String("unable to upsync all local changes"));
-        } else if (hasDatabaseErrors) {
-            syncFinished(Buteo::SyncResults::ITEM_FAILURES,
-                         QLatin1String("unable to apply all remote changes"));
+            minorCode = Buteo::SyncResults::ITEM_FAILURES;
+            message = QLatin1String("unable to upsync all local changes");
+        } else if (mHasDatabaseErrors) {
+            minorCode = Buteo::SyncResults::ITEM_FAILURES;
+            message = QLatin1String("unable to apply all remote changes");
         } else {
             qCDebug(lcCalDav) << "Calendar storage saved successfully after writing notebook changes!";
-            syncFinished(Buteo::SyncResults::NO_ERROR);
         }
+        // The skipped calendars are not up to date, whatever the result.
+        if (!skippedCalendars.isEmpty()) {
+            const QString skipped = QStringLiteral("skipped %1 rarely changing calendar(s): %2")
+                .arg(skippedCalendars.count()).arg(skippedCalendars.join(QStringLiteral(", ")));
+            message = message.isEmpty() ? skipped : message + QStringLiteral("; ") + skipped;
+        }
+        syncFinished(minorCode, message);
+    }
+}
+
+// Incidences of a progressive slow sync written before the end of the sync.
+void CalDavClient::notebookChunkCommitted(int incidenceCount, int remainingChunks)
+{
+    NotebookSyncAgent *agent = qobject_cast<NotebookSyncAgent*>(sender());
+    qCInfo(lcCalDav) << "Committed" << incidenceCount << "incidences of" << (agent ? agent->path() : QString())
+                     << "," << remainingChunks << "chunks left.";
+    if (incidenceCount > 0) {
+        emit transferProgress(getProfileName(), Sync::LOCAL_DATABASE, Sync::ITEM_ADDED,
+                              QStringLiteral("text/calendar"), incidenceCount);
     }
 }
 
@@ -143,15 +143,20 @@ private Q_SLOTS:
     void start();
     void authenticationError();
     void notebookSyncFinished();
+    void notebookChunkCommitted(int incidenceCount, int remainingChunks);
 
 private:
     bool initConfig();
     void closeConfig();
     void syncFinished(Buteo::SyncResults::MinorCode minorErrorCode, const QString &message = QString());
     void clearAgents();
+    void applyNotebookChanges(NotebookSyncAgent *agent);
+    void reportNotebookResults(NotebookSyncAgent *agent);
     void deleteNotebooksForAccount(int accountId, mKCal::ExtendedCalendar::Ptr calendar, mKCal::ExtendedStorage::Ptr storage);
+    bool reconcileNotebooksForAccount(int accountId);
     bool cleanSyncRequired();
     void getSyncDateRange(const QDateTime &sourceDate, QDateTime *fromDateTime, QDateTime *toDateTime);
+    void getCommitStrategy(NotebookSyncAgent::CommitStrategy *strategy, int *batchSize);
     QList<Buteo::Dav::CalendarInfo> loadAccountCalendars() const;
     QList<Buteo::Dav::CalendarInfo> mergeAccountCalendars(const QList<Buteo::Dav::CalendarInfo> &calendars) const;
     void removeAccountCalendars(const QStringList &paths);
@@ -165,6 +170,10 @@ private:
 
     mutable QScopedPointer<Sailfish::KeyProvider::ProcessMutex> mProcessMutex;
     QList<NotebookSyncAgent *> mNotebookSyncAgents;
+    QSet<NotebookSyncAgent *> mAppliedAgents;
+    QStringList mDeletedNotebooks;
+    bool mHasDatabaseErrors;
+    bool mPipelinedApply;
     Accounts::Manager* mManager;
     QSharedPointer<Accounts::AccountService> mService;
     AuthHandler* mAuth;
@@ -174,6 +183,8 @@ private:
     Sync::SyncStatus mSyncStatus;
     Buteo::SyncProfile::SyncDirection mSyncDirection;
     Buteo::SyncProfile::ConflictResolutionPolicy mConflictResPolicy;
+    NotebookSyncAgent::CommitStrategy mCommitStrategy;
+    int mCommitBatchSize;
     Buteo::Dav::Client* mDAV;
 
     friend class tst_CalDavClient;
@@ -0,0 +1,248 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "icsparser.h"
+
+#include "logging.h"
+#include "icsscanner.h"
+
+#include <KCalendarCore/ICalFormat>
+#include <KCalendarCore/VCalFormat>
+#include <KCalendarCore/Exceptions>
+#include <KCalendarCore/MemoryCalendar>
+
+#include <QByteArrayMatcher>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <QTimeZone>
+
+namespace {
+    bool isLineStart(const QByteArray &data, int index)
+    {
+        return index == 0 || data.at(index - 1) == '\n';
+    }
+
+    QByteArray replaceTimeZoneId(const QByteArray &data, const QByteArray &from, const QByteArray &to)
+    {
+        QByteArray result = data;
+        result.replace(";TZID=" + from + ':', ";TZID=" + to + ':');
+        result.replace(";TZID=" + from + ';', ";TZID=" + to + ';');
+        result.replace(";TZID=\"" + from + '"', ";TZID=" + to);
+        return result;
+    }
+}
+
+IcsParser::IcsParser()
+    : mSkippedTimeZones(0)
+{
+}
+
+IcsParser::~IcsParser()
+{
+}
+
+int IcsParser::timeZoneCount() const
+{
+    QMutexLocker locker(&mMutex);
+    return mTimeZones.count();
+}
+
+int IcsParser::skippedTimeZoneCount() const
+{
+    QMutexLocker locker(&mMutex);
+    return mSkippedTimeZones;
+}
+
+QByteArray IcsParser::stripKnownTimeZones(const QByteArray &data, QList<TimeZoneKey> *unknown)
+{
+    static const QByteArrayMatcher begin(QByteArrayLiteral("BEGIN:VTIMEZONE"));
+    static const QByteArrayMatcher end(QByteArrayLiteral("END:VTIMEZONE"));
+    const QByteArray tzidTag = QByteArrayLiteral("\r\nTZID:");
+
+    QByteArray stripped;
+    QHash<QByteArray, QByteArray> renamed;
+    int copied = 0;
+    int from = begin.indexIn(data);
+    while (from >= 0) {
+        int to = end.indexIn(data, from);
+        if (to < 0) {
+            break;
+        }
+        to = data.indexOf('\n', to);
+        to = to < 0 ? data.length() : to + 1;
+        if (!isLineStart(data, from)) {
+            from = begin.indexIn(data, to);
+            continue;
+        }
+
+        const QByteArray block = QByteArray::fromRawData(data.constData() + from, to - from);
+        const int tzidAt = block.indexOf(tzidTag);
+        const int tzidEnd = tzidAt < 0 ? -1 : block.indexOf("\r\n", tzidAt + tzidTag.length());
+        if (tzidEnd < 0 || (tzidEnd + 2 < block.size() && block.at(tzidEnd + 2) == ' ')) {
+            // No TZID or a folded one, let KCalendarCore handle it.
+            from = begin.indexIn(data, to);
+            continue;
+        }
+        const QByteArray tzid = block.mid(tzidAt + tzidTag.length(),
+                                          tzidEnd - tzidAt - tzidTag.length());
+        const TimeZoneKey key(QString::fromUtf8(tzid),
+                              QCryptographicHash::hash(block, QCryptographicHash::Sha1));
+
+        QByteArray ianaId;
+        {
+            QMutexLocker locker(&mMutex);
+            QHash<TimeZoneKey, QByteArray>::ConstIterator it = mTimeZones.constFind(key);
+            if (it != mTimeZones.constEnd()) {
+                ianaId = it.value();
+            } else if (QTimeZone::isTimeZoneIdAvailable(tzid)) {
+                // KCalendarCore uses the system zone for known IANA ids,
+                // whatever the VTIMEZONE definition.
+                ianaId = tzid;
+                mTimeZones.insert(key, ianaId);
+            } else {
+                unknown->append(key);
+            }
+            if (!ianaId.isEmpty()) {
+                mSkippedTimeZones += 1;
+            }
+        }
+
+        if (!ianaId.isEmpty()) {
+            stripped.append(data.constData() + copied, from - copied);
+            copied = to;
+            if (ianaId != tzid) {
+                renamed.insert(tzid, ianaId);
+            }
+        }
+        from = begin.indexIn(data, to);
+    }
+    if (!copied) {
+        return data;
+    }
+    stripped.append(data.constData() + copied, data.length() - copied);
+
+    for (QHash<QByteArray, QByteArray>::ConstIterator it = renamed.constBegin();
+         it != renamed.constEnd(); ++it) {
+        stripped = replaceTimeZoneId(stripped, it.key(), it.value());
+    }
+    return stripped;
+}
+
+void IcsParser::resolveTimeZones(const QByteArray &data,
+                                 const QList<TimeZoneKey> &unknown,
+                                 const KCalendarCore::Incidence::List &incidences)
+{
+    // Only data referencing a single custom time zone are used
+    // to learn the zone KCalendarCore resolved the definition to.
+    QByteArray ianaId;
+    if (unknown.count() == 1
+        && data.count(";TZID=")
+           == data.count(";TZID=" + unknown.first().first.toUtf8())
+           + data.count(";TZID=\"" + unknown.first().first.toUtf8() + '"')) {
+        for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+            const QDateTime dtStart = incidence->dtStart();
+            if (dtStart.isValid() && dtStart.timeSpec() == Qt::TimeZone) {
+                ianaId = dtStart.timeZone().id();
+                break;
+            }
+        }
+        if (!QTimeZone::isTimeZoneIdAvailable(ianaId)) {
+            ianaId.clear();
+        }
+    }
+
+    QMutexLocker locker(&mMutex);
+    for (const TimeZoneKey &key : unknown) {
+        mTimeZones.insert(key, ianaId);
+    }
+}
+
+KCalendarCore::Incidence::List IcsParser::parse(const QString &data)
+{
+    bool parsed = true;
+    QList<TimeZoneKey> unknownTimeZones;
+    bool uidRelocated = false;
+    QByteArray icsData = IcsScanner::normalise(data.toUtf8(), &uidRelocated);
+    if (uidRelocated) {
+        qCDebug(lcCalDav) << "The UID was before VEVENT data! Report a bug to the application that generated this file.";
+    }
+    icsData = stripKnownTimeZones(icsData, &unknownTimeZones);
+    KCalendarCore::ICalFormat iCalFormat;
+    KCalendarCore::MemoryCalendar::Ptr cal(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+    KCalendarCore::Incidence::List results;
+    if (!iCalFormat.fromRawString(cal, icsData)) {
+        if (iCalFormat.exception() && iCalFormat.exception()->code()
+            == KCalendarCore::Exception::CalVersion1) {
+            KCalendarCore::VCalFormat vCalFormat;
+            if (!vCalFormat.fromRawString(cal, icsData)) {
+                qCWarning(lcCalDav) << "unable to parse vCal data";
+                parsed = false;
+            }
+        } else if (iCalFormat.exception()
+                   && (iCalFormat.exception()->code()
+                       == KCalendarCore::Exception::CalVersionUnknown
+                       || iCalFormat.exception()->code()
+                       == KCalendarCore::Exception::VersionPropertyMissing)) {
+            iCalFormat.setException(0);
+            qCWarning(lcCalDav) << "unknown or missing version, trying iCal 2.0";
+            icsData = IcsScanner::insertICalVersion(icsData);
+            if (!iCalFormat.fromRawString(cal, icsData)) {
+                qCWarning(lcCalDav) << "unable to parse iCal data, returning"
+                                    << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1);
+                parsed = false;
+            }
+        } else {
+            qCWarning(lcCalDav) << "unable to parse iCal data, returning"
+                                << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1);
+            parsed = false;
+        }
+    }
+    if (parsed) {
+        const KCalendarCore::Incidence::List incidences = cal->incidences();
+        qCDebug(lcCalDav) << "iCal data contains" << incidences.count() << " incidences";
+        if (incidences.count()) {
+            QString uid = incidences.first()->uid();
+            // In case of more than one incidence, it contains some
+            // recurring event information, with exception / RECURRENCE-ID defined.
+            for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+                if (incidence->uid() != uid) {
+                    qCWarning(lcCalDav) << "iCal data contains invalid incidences with conflicting uids";
+                    uid.clear();
+                    break;
+                }
+            }
+            if (!uid.isEmpty()) {
+                for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+                    if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent
+                        || incidence->type() == KCalendarCore::IncidenceBase::TypeTodo)
+                        results.append(incidence);
+                }
+            }
+            qCDebug(lcCalDav) << "parsed" << results.count() << "events or todos from the iCal data";
+        } else {
+            qCWarning(lcCalDav) << "iCal data doesn't contain a valid incidence";
+        }
+    }
+    if (!unknownTimeZones.isEmpty()) {
+        resolveTimeZones(icsData, unknownTimeZones, results);
+    }
+    return results;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#ifndef ICSPARSER_H
+#define ICSPARSER_H
+
+#include <KCalendarCore/Incidence>
+
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+
+// Parses the iCal data of received resources. One parser is meant to
+// be shared by all the resources of a notebook: servers repeat the
+// same VTIMEZONE definitions in every resource, so the parser remembers
+// the zones it has already resolved, keyed by TZID and definition
+// content, and drops these definitions before handing the data to
+// KCalendarCore. The parser can be used from several threads at once.
+class IcsParser
+{
+public:
+    IcsParser();
+    ~IcsParser();
+
+    KCalendarCore::Incidence::List parse(const QString &data);
+
+    int timeZoneCount() const;
+    int skippedTimeZoneCount() const;
+
+private:
+    // TZID and SHA-1 of the VTIMEZONE definition.
+    typedef QPair<QString, QByteArray> TimeZoneKey;
+
+    QByteArray stripKnownTimeZones(const QByteArray &data, QList<TimeZoneKey> *unknown);
+    void resolveTimeZones(const QByteArray &data,
+                          const QList<TimeZoneKey> &unknown,
+                          const KCalendarCore::Incidence::List &incidences);
+
+    mutable QMutex mMutex;
+    // IANA id to use for a given VTIMEZONE, or an empty string
+    // if the definition cannot be skipped.
+    QHash<TimeZoneKey, QByteArray> mTimeZones;
+    int mSkippedTimeZones;
+};
+
+#endif // ICSPARSER_H
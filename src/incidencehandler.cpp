@@ -22,8 +22,15 @@
  */
 
 #include "incidencehandler.h"
+#include "icsscanner.h"
 
 #include <QDebug>
+#include <QMap>
+#include <QMutex>
+#include <QSet>
+#include <QCryptographicHash>
+
+#include <algorithm>
 
 #include "logging.h"
 
@@ -32,6 +39,241 @@
 
 #define PROP_DTEND_ADDED_USING_DTSTART "dtend-added-as-dtstart"
 
+namespace {
+    // Properties and comments stored in incidences for sync purposes,
+    // they are not uploaded.
+    const char * const SYNC_PROPERTIES[] = {
+        "X-KDE-buteo-uri",
+        "X-KDE-buteo-etag",
+        "X-KDE-buteo-dtstart-date_only",
+        "X-KDE-buteo-dtend-date_only",
+        "X-KDE-buteo-" PROP_DTEND_ADDED_USING_DTSTART
+    };
+    const char * const SYNC_COMMENTS[] = {
+        "COMMENT:buteo:caldav:uri:",
+        "COMMENT:buteo:caldav:detached-and-synced",
+        "COMMENT:buteo:caldav:etag:",
+        "COMMENT:buteo:caldav:hash:"
+    };
+    // Properties rewritten at each serialisation or when storing
+    // received incidences, they are not part of the content hash.
+    const char * const VOLATILE_PROPERTIES[] = {
+        "CREATED",
+        "DTSTAMP",
+        "LAST-MODIFIED",
+        "PRODID"
+    };
+    const int MAX_LINE_LENGTH = 75;
+
+    // VTIMEZONE blocks already generated, keyed by zone id and by the
+    // year they start from. They are shared by all uploads.
+    struct TimeZoneCache
+    {
+        QMutex mutex;
+        QHash<QPair<QByteArray, int>, QByteArray> blocks;
+    };
+    Q_GLOBAL_STATIC(TimeZoneCache, timeZoneCache)
+
+    QByteArray timeZoneBlock(const QByteArray &id, int year)
+    {
+        const QPair<QByteArray, int> key(id, year);
+        QMutexLocker locker(&timeZoneCache()->mutex);
+        QHash<QPair<QByteArray, int>, QByteArray>::ConstIterator it = timeZoneCache()->blocks.constFind(key);
+        if (it != timeZoneCache()->blocks.constEnd()) {
+            return it.value();
+        }
+
+        // Let KCalendarCore write the definition for a dummy event
+        // starting at the beginning of the year.
+        KCalendarCore::MemoryCalendar::Ptr calendar(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setDtStart(QDateTime(QDate(year, 1, 1), QTime(0, 0), QTimeZone(id)));
+        calendar->addEvent(event);
+        KCalendarCore::ICalFormat icalFormat;
+        const QByteArray ics = icalFormat.toString(calendar, QString(), false).toUtf8();
+        const int begin = ics.indexOf("BEGIN:VTIMEZONE");
+        const int end = begin < 0 ? -1 : ics.indexOf("END:VTIMEZONE", begin);
+        QByteArray block;
+        if (end > begin) {
+            block = ics.mid(begin, end + int(qstrlen("END:VTIMEZONE")) - begin) + "\r\n";
+        } else {
+            qCWarning(lcCalDav) << "Cannot generate time zone definition for" << id;
+        }
+        timeZoneCache()->blocks.insert(key, block);
+        return block;
+    }
+
+    // Records the zone of dt, with the earliest year it is used in.
+    void addTimeZone(QMap<QByteArray, int> *zones, const QDateTime &dt)
+    {
+        if (!dt.isValid() || dt.timeSpec() != Qt::TimeZone || dt.timeZone() == QTimeZone::utc()) {
+            return;
+        }
+        const QByteArray id = dt.timeZone().id();
+        const int year = dt.date().year();
+        QMap<QByteArray, int>::Iterator it = zones->find(id);
+        if (it == zones->end()) {
+            zones->insert(id, year);
+        } else if (year < it.value()) {
+            it.value() = year;
+        }
+    }
+
+    void addTimeZones(QMap<QByteArray, int> *zones, const KCalendarCore::Incidence::Ptr &incidence)
+    {
+        addTimeZone(zones, incidence->dtStart());
+        addTimeZone(zones, incidence->recurrenceId());
+        if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent) {
+            addTimeZone(zones, incidence.staticCast<KCalendarCore::Event>()->dtEnd());
+        } else if (incidence->type() == KCalendarCore::IncidenceBase::TypeTodo) {
+            KCalendarCore::Todo::Ptr todo = incidence.staticCast<KCalendarCore::Todo>();
+            if (todo->hasDueDate()) {
+                addTimeZone(zones, todo->dtDue(true));
+            }
+        }
+        if (incidence->recurs()) {
+            const KCalendarCore::Recurrence *recurrence = incidence->recurrence();
+            for (const QDateTime &dt : recurrence->rDateTimes()) {
+                addTimeZone(zones, dt);
+            }
+            for (const QDateTime &dt : recurrence->exDateTimes()) {
+                addTimeZone(zones, dt);
+            }
+        }
+    }
+
+    // Tells if the incidence cannot be serialised as is, and needs
+    // to be copied and modified by incidenceToExport() first.
+    bool needsExportCopy(const KCalendarCore::Incidence::Ptr &incidence,
+                         const KCalendarCore::Incidence::List &instances)
+    {
+        if (incidence->recurs() && !instances.isEmpty()) {
+            const KCalendarCore::DateTimeList exDateTimes = incidence->recurrence()->exDateTimes();
+            if (!exDateTimes.isEmpty()) {
+                const QSet<QDateTime> exceptions = QSet<QDateTime>::fromList(exDateTimes);
+                for (const KCalendarCore::Incidence::Ptr &instance : instances) {
+                    if (exceptions.contains(instance->recurrenceId())) {
+                        return true;
+                    }
+                }
+            }
+        }
+        if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent) {
+            KCalendarCore::Event::Ptr event = incidence.staticCast<KCalendarCore::Event>();
+            return event->allDay()
+                && !event->customProperty("buteo", PROP_DTEND_ADDED_USING_DTSTART).isEmpty()
+                && event->dtStart() == event->dtEnd();
+        }
+        return false;
+    }
+
+    inline const char *nextLine(const char *from, const char *end)
+    {
+        const char *lf = IcsScanner::findByte(from, end, '\n');
+        return lf < end ? lf + 1 : end;
+    }
+
+    inline bool startsWith(const char *line, const char *lineEnd, const char *prefix)
+    {
+        const int length = qstrlen(prefix);
+        return lineEnd - line >= length && !qstrncmp(line, prefix, length);
+    }
+
+    bool isVolatileProperty(const char *line, const char *lineEnd)
+    {
+        for (const char *name : VOLATILE_PROPERTIES) {
+            const int length = qstrlen(name);
+            if (lineEnd - line > length && !qstrncmp(line, name, length)
+                && (line[length] == ':' || line[length] == ';')) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool isSyncProperty(const char *line, const char *lineEnd)
+    {
+        if (*line == 'C') {
+            for (const char *comment : SYNC_COMMENTS) {
+                if (startsWith(line, lineEnd, comment)) {
+                    return true;
+                }
+            }
+        } else if (*line == 'X' || *line == 'x') {
+            for (const char *name : SYNC_PROPERTIES) {
+                const int length = qstrlen(name);
+                if (lineEnd - line > length && !qstrnicmp(line, name, length)
+                    && (line[length] == ':' || line[length] == ';')) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Returns the content of the folded line [from, to) on a single line,
+    // without the line ending.
+    QByteArray unfold(const char *from, const char *to)
+    {
+        QByteArray content;
+        while (from < to) {
+            const char *lf = IcsScanner::findByte(from, to, '\n');
+            content.append(from, (lf > from && lf[-1] == '\r' ? lf - 1 : lf) - from);
+            // Skip the line feed and the folding white space.
+            from = lf + 2;
+        }
+        return content;
+    }
+
+    void appendFolded(QByteArray *out, const QByteArray &line)
+    {
+        int from = 0;
+        int length = MAX_LINE_LENGTH;
+        while (line.size() - from > length) {
+            int cut = from + length;
+            // Don't split UTF-8 sequences.
+            while (cut > from + 1 && (uchar(line.at(cut)) & 0xC0) == 0x80) {
+                --cut;
+            }
+            out->append(line.constData() + from, cut - from);
+            out->append("\r\n ");
+            from = cut;
+            length = MAX_LINE_LENGTH - 1;
+        }
+        out->append(line.constData() + from, line.size() - from);
+        out->append("\r\n");
+    }
+
+    // Copies the serialised component to out, dropping the properties
+    // used for sync purposes and the notebook prefix of the UID.
+    void appendExportable(QByteArray *out, const QByteArray &component)
+    {
+        const char *copied = component.constData();
+        const char *end = copied + component.size();
+        const char *line = copied;
+        while (line < end) {
+            const char *next = nextLine(line, end);
+            const char *logicalEnd = next;
+            while (logicalEnd < end && (*logicalEnd == ' ' || *logicalEnd == '\t')) {
+                logicalEnd = nextLine(logicalEnd, end);
+            }
+            if (isSyncProperty(line, next)) {
+                out->append(copied, line - copied);
+                copied = logicalEnd;
+            } else if (startsWith(line, next, "UID:NBUID:")) {
+                out->append(copied, line - copied);
+                // UID is of the special form NBUID:NotebookUid:EventUid, trim it.
+                const QByteArray uid = unfold(line, logicalEnd);
+                const int separator = uid.indexOf(':', 10);
+                appendFolded(out, separator < 0 ? uid : "UID:" + uid.mid(separator + 1));
+                copied = logicalEnd;
+            }
+            line = logicalEnd;
+        }
+        out->append(copied, end - copied);
+    }
+}
+
 IncidenceHandler::IncidenceHandler()
 {
 }
@@ -45,35 +287,89 @@ IncidenceHandler::~IncidenceHandler()
 // Since the incidence may be an occurrence or recurring series incidence,
 // we cannot simply convert the incidence to iCal data, but instead we have to
 // upsync an .ics containing the whole recurring series.
-QString IncidenceHandler::toIcs(const KCalendarCore::Incidence::Ptr incidence,
-                                const KCalendarCore::Incidence::List instances)
+// Each incidence is serialised on its own and written in its exportable
+// form straight into the UTF-8 output, the incidence is only copied when
+// its content needs to be changed (see incidenceToExport()).
+QByteArray IncidenceHandler::toIcs(const KCalendarCore::Incidence::Ptr incidence,
+                                   const KCalendarCore::Incidence::List instances)
 {
-    // create an in-memory calendar
-    // add to it the required incidences (ie, check if has recurrenceId -> load parent and all instances; etc)
-    // for each of those, we need to do the IncidenceToExport() modifications first
-    // then, export from that calendar to .ics file.
-    KCalendarCore::MemoryCalendar::Ptr memoryCalendar(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+    KCalendarCore::ICalFormat icalFormat;
+    // Zones are written sorted by TZID, so the same incidence
+    // always gives the same data.
+    QMap<QByteArray, int> zones;
+    QList<QByteArray> components;
 
-    KCalendarCore::Incidence::Ptr exportableIncidence = IncidenceHandler::incidenceToExport(incidence, instances);
-    // store the base recurring event into the in-memory calendar
-    if (!memoryCalendar->addIncidence(exportableIncidence)) {
-        qCWarning(lcCalDav) << "Unable to add base series event to in-memory calendar for incidence:"
-                    << incidence->uid() << ":" << incidence->recurrenceId().toString();
-        return QString();
+    addTimeZones(&zones, incidence);
+    components << icalFormat.toString(needsExportCopy(incidence, instances)
+                                      ? IncidenceHandler::incidenceToExport(incidence, instances)
+                                      : incidence).toUtf8();
+    // Write the occurrences in a stable order, so the same series
+    // always gives the same data.
+    KCalendarCore::Incidence::List sortedInstances(instances);
+    std::sort(sortedInstances.begin(), sortedInstances.end(),
+              [] (const KCalendarCore::Incidence::Ptr &a, const KCalendarCore::Incidence::Ptr &b) {
+                  return a->recurrenceId() < b->recurrenceId();
+              });
+    for (const KCalendarCore::Incidence::Ptr &instance : const_cast<const KCalendarCore::Incidence::List&>(sortedInstances)) {
+        addTimeZones(&zones, instance);
+        components << icalFormat.toString(needsExportCopy(instance, KCalendarCore::Incidence::List())
+                                          ? IncidenceHandler::incidenceToExport(instance)
+                                          : instance).toUtf8();
     }
-    // now create the persistent occurrences in the in-memory calendar
-    for (KCalendarCore::Incidence::Ptr instance : instances) {
-        KCalendarCore::Incidence::Ptr exportableOccurrence = IncidenceHandler::incidenceToExport(instance);
 
-        if (!memoryCalendar->addIncidence(exportableOccurrence)) {
-            qCWarning(lcCalDav) << "Unable to add this incidence to in-memory calendar for export:"
-                        << instance->uid() << instance->recurrenceId().toString();
-            return QString();
+    int size = 0;
+    QList<QByteArray> timeZones;
+    for (QMap<QByteArray, int>::ConstIterator it = zones.constBegin(); it != zones.constEnd(); ++it) {
+        timeZones << timeZoneBlock(it.key(), it.value());
+        size += timeZones.last().size();
+    }
+    for (const QByteArray &component : const_cast<const QList<QByteArray>&>(components)) {
+        if (component.isEmpty()) {
+            qCWarning(lcCalDav) << "Unable to serialise incidence for export:"
+                                << incidence->uid() << ":" << incidence->recurrenceId().toString();
+            return QByteArray();
         }
+        size += component.size();
     }
 
-    KCalendarCore::ICalFormat icalFormat;
-    return icalFormat.toString(memoryCalendar, QString(), false);
+    QByteArray ics;
+    ics.reserve(size + 128);
+    ics.append("BEGIN:VCALENDAR\r\n");
+    appendFolded(&ics, "PRODID:" + KCalendarCore::CalFormat::productId().toUtf8());
+    ics.append("VERSION:2.0\r\n");
+    for (const QByteArray &block : const_cast<const QList<QByteArray>&>(timeZones)) {
+        ics.append(block);
+    }
+    for (const QByteArray &component : const_cast<const QList<QByteArray>&>(components)) {
+        appendExportable(&ics, component);
+    }
+    ics.append("END:VCALENDAR\r\n");
+    return ics;
+}
+
+// Hash of the data produced by toIcs(), ignoring the properties that
+// change each time the data is produced. Two serialisations of the
+// same content give the same hash.
+QString IncidenceHandler::contentHash(const QByteArray &icsData)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    const char *copied = icsData.constData();
+    const char *end = copied + icsData.size();
+    const char *line = copied;
+    while (line < end) {
+        const char *next = nextLine(line, end);
+        const char *logicalEnd = next;
+        while (logicalEnd < end && (*logicalEnd == ' ' || *logicalEnd == '\t')) {
+            logicalEnd = nextLine(logicalEnd, end);
+        }
+        if (isVolatileProperty(line, next)) {
+            hash.addData(copied, line - copied);
+            copied = logicalEnd;
+        }
+        line = logicalEnd;
+    }
+    hash.addData(copied, end - copied);
+    return QString::fromLatin1(hash.result().toHex());
 }
 
 KCalendarCore::Incidence::Ptr IncidenceHandler::incidenceToExport(KCalendarCore::Incidence::Ptr sourceIncidence,
@@ -32,8 +32,9 @@
 class IncidenceHandler
 {
 public:
-    static QString toIcs(const KCalendarCore::Incidence::Ptr incidence,
-                         const KCalendarCore::Incidence::List instances = KCalendarCore::Incidence::List());
+    static QByteArray toIcs(const KCalendarCore::Incidence::Ptr incidence,
+                            const KCalendarCore::Incidence::List instances = KCalendarCore::Incidence::List());
+    static QString contentHash(const QByteArray &icsData);
 
 private:
     IncidenceHandler();
@@ -30,139 +30,48 @@
 
 #include <KCalendarCore/Incidence>
 
-#include <KCalendarCore/ICalFormat>
-#include <KCalendarCore/VCalFormat>
-#include <KCalendarCore/Exceptions>
-#include <KCalendarCore/MemoryCalendar>
-
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QtConcurrent>
 
 #define NOTEBOOK_FUNCTION_CALL_TRACE qCDebug(lcCalDavTrace) << Q_FUNC_INFO << (mNotebook ? mNotebook->account() : "")
 
 namespace {
-    QString ensureUidInVEvent(const QString &data) {
-        // Ensure UID is in VEVENT section for single-event VCALENDAR blobs.
-        int eventCount = 0; // a value of 1 specifies that we should use the fixed data.
-        QStringList fixed;
-        QString storedUidLine;
-        const char separator = '\n';
-        QStringList original = data.split(separator);
-        bool inVEventSection = false;
-        for (QStringList::const_iterator it = original.constBegin(); it != original.constEnd(); it++) {
-            const QString &line(*it);
-            if (line.startsWith("END:VEVENT")) {
-                inVEventSection = false;
-            } else if (line.startsWith("BEGIN:VEVENT")) {
-                ++eventCount;
-                inVEventSection = true;
-                fixed.append(line);
-                if (!storedUidLine.isEmpty()) {
-                    fixed.append(storedUidLine);
-                    qCDebug(lcCalDav) << "The UID was before VEVENT data! Report a bug to the application that generated this file.";
-                    continue; // BEGIN:VEVENT line already appended
-                }
-                eventCount = -1;
-                break; // use original iCalData if got to VEVENT without finding UID
-            } else if (line.startsWith("UID")) {
-                if (!inVEventSection) {
-                    storedUidLine = line;
-                    continue; // do not append UID line yet
-                }
-            }
-            fixed.append(line);
-        }
-        // if we found exactly one event and were able to set its UID, return the fixed data.
-        // otherwise, return the original data.
-        return eventCount == 1 ? fixed.join(separator) : data;
-    }
-
-    QString ensureICalVersion(const QString &data) {
-        // Add VERSION:2.0 after the VCALENDAR tag to force iCal parsing.
-        const char separator = '\n';
-        QStringList original = data.split(separator);
-        QStringList fixed;
-    
-        for (QStringList::const_iterator it = original.constBegin(); it != original.constEnd(); it++) {
-            const QString &line(*it);
-        
-            fixed.append(line);
-            if (line.startsWith("BEGIN:VCALENDAR")) {
-                fixed.append(QStringLiteral("VERSION:2.0\r"));
-            }
-        }
-        return fixed.join(separator);
-    }
+    // Number of staged resources parsed and applied at once.
+    const int STAGING_CHUNK_SIZE = 50;
 
-    QString preprocessIcsData(const QString &data) {
-        QString temp = data;
-        temp.replace(QStringLiteral("\r\n"), QStringLiteral("\n"));
-        temp.replace(QStringLiteral("\n"), QStringLiteral("\r\n"));
-        temp = temp.append(QStringLiteral("\r\n\r\n"));
-        temp = ensureUidInVEvent(temp);
-        return temp;
-    }
+    // Default number of PUT and DELETE requests waiting for a reply at once.
+    const int DEFAULT_UPLOAD_WINDOW = 6;
+    // Uploads failing with a transient error are tried this number of
+    // times, waiting twice as long before each new try.
+    const int MAX_UPLOAD_ATTEMPTS = 3;
+    const int UPLOAD_RETRY_DELAY = 1000; // in ms.
 
-    KCalendarCore::Incidence::List parseICSData(const QString &data)
+    bool isTransientError(QNetworkReply::NetworkError error)
     {
-        bool parsed = true;
-        QString icsData = preprocessIcsData(data);
-        KCalendarCore::ICalFormat iCalFormat;
-        KCalendarCore::MemoryCalendar::Ptr cal(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
-        KCalendarCore::Incidence::List results;
-        if (!iCalFormat.fromString(cal, icsData)) {
-            if (iCalFormat.exception() && iCalFormat.exception()->code()
-                == KCalendarCore::Exception::CalVersion1) {
-                KCalendarCore::VCalFormat vCalFormat;
-                if (!vCalFormat.fromString(cal, icsData)) {
-                    qCWarning(lcCalDav) << "unable to parse vCal data";
-                    parsed = false;
-                }
-            } else if (iCalFormat.exception()
-                       && (iCalFormat.exception()->code()
-                           == KCalendarCore::Exception::CalVersionUnknown
-                           || iCalFormat.exception()->code()
-                           == KCalendarCore::Exception::VersionPropertyMissing)) {
-                iCalFormat.setException(0);
-                qCWarning(lcCalDav) << "unknown or missing version, trying iCal 2.0";
-                icsData = ensureICalVersion(icsData);
-                if (!iCalFormat.fromString(cal, icsData)) {
-                    qCWarning(lcCalDav) << "unable to parse iCal data, returning"
-                                        << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1);
-                    parsed = false;
-                }
-            } else {
-                qCWarning(lcCalDav) << "unable to parse iCal data, returning"
-                                    << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1);
-                parsed = false;
-            }
+        switch (error) {
+        case QNetworkReply::RemoteHostClosedError:
+        case QNetworkReply::TimeoutError:
+        case QNetworkReply::TemporaryNetworkFailureError:
+        case QNetworkReply::NetworkSessionFailedError:
+        case QNetworkReply::ProxyTimeoutError:
+        case QNetworkReply::ServiceUnavailableError:
+        case QNetworkReply::UnknownNetworkError:
+            return true;
+        default:
+            return false;
         }
-        if (parsed) {
-            const KCalendarCore::Incidence::List incidences = cal->incidences();
-            qCDebug(lcCalDav) << "iCal data contains" << incidences.count() << " incidences";
-            if (incidences.count()) {
-                QString uid = incidences.first()->uid();
-                // In case of more than one incidence, it contains some
-                // recurring event information, with exception / RECURRENCE-ID defined.
-                for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
-                    if (incidence->uid() != uid) {
-                        qCWarning(lcCalDav) << "iCal data contains invalid incidences with conflicting uids";
-                        uid.clear();
-                        break;
-                    }
-                }
-                if (!uid.isEmpty()) {
-                    for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
-                        if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent
-                            || incidence->type() == KCalendarCore::IncidenceBase::TypeTodo)
-                            results.append(incidence);
-                    }
-                }
-                qCDebug(lcCalDav) << "parsed" << results.count() << "events or todos from the iCal data";
-            } else {
-                qCWarning(lcCalDav) << "iCal data doesn't contain a valid incidence";
+    }
+
+    bool hasBaseIncidence(const KCalendarCore::Incidence::List &incidences)
+    {
+        for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+            if (!incidence->hasRecurrenceId()) {
+                return true;
             }
         }
-        return results;
+        return false;
     }
 
     // mKCal deleted custom properties of deleted incidences.
@@ -244,8 +153,35 @@ namespace {
         incidence->addComment(QStringLiteral("buteo:caldav:etag:%1").arg(etag));
     }
 
+    // Hash of the content last uploaded or downloaded for the incidence,
+    // see IncidenceHandler::contentHash().
+    QString incidenceContentHash(KCalendarCore::Incidence::Ptr incidence)
+    {
+        const QStringList &comments(incidence->comments());
+        for (const QString &comment : comments) {
+            if (comment.startsWith("buteo:caldav:hash:")) {
+                return comment.mid(18);
+            }
+        }
+        return QString();
+    }
+    void setIncidenceContentHash(KCalendarCore::Incidence::Ptr incidence, const QString &hash)
+    {
+        const QStringList &comments(incidence->comments());
+        for (const QString &comment : comments) {
+            if (comment.startsWith("buteo:caldav:hash:")
+                && incidence->removeComment(comment)) {
+                break;
+            }
+        }
+        if (!hash.isEmpty()) {
+            incidence->addComment(QStringLiteral("buteo:caldav:hash:%1").arg(hash));
+        }
+    }
+
     void updateIncidenceHrefEtag(KCalendarCore::Incidence::Ptr incidence,
-                                 const QString &href, const QString &etag)
+                                 const QString &href, const QString &etag,
+                                 const QString &hash = QString())
     {
         // Set the URI and the ETAG property to the required values.
         qCDebug(lcCalDav) << "Adding URI and ETAG to incidence:" << incidence->uid()
@@ -254,6 +190,8 @@ namespace {
             setIncidenceHrefUri(incidence, href);
         if (!etag.isEmpty())
             setIncidenceETag(incidence, etag);
+        // An unknown hash means that the content changed in an unknown way.
+        setIncidenceContentHash(incidence, hash);
         if (incidence->recurrenceId().isValid()) {
             // Add a flag to distinguish persistent exceptions that have
             // been detached during the sync process (with the flag)
@@ -318,29 +256,109 @@ namespace {
         }
     }
 
+    KCalendarCore::Incidence::List withoutHrefs(const KCalendarCore::Incidence::List &incidences,
+                                                const QSet<QString> &hrefs,
+                                                const QString &remotePath)
+    {
+        if (hrefs.isEmpty()) {
+            return incidences;
+        }
+        KCalendarCore::Incidence::List kept;
+        for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+            const QString href = storedIncidenceHrefUri(incidence);
+            if (!hrefs.contains(href.isEmpty() ? createIncidenceHrefUri(incidence, remotePath) : href)) {
+                kept.append(incidence);
+            }
+        }
+        return kept;
+    }
+
     const QByteArray APP = QByteArrayLiteral("VOLATILE");
     const QByteArray NAME = QByteArrayLiteral("SYNC-FAILURE");
     const QByteArray RESOLUTION = QByteArrayLiteral("SYNC-FAILURE-RESOLUTION");
+    const QByteArray ATTEMPTS = QByteArrayLiteral("SYNC-FAILURE-ATTEMPTS");
+    const QByteArray LAST_ATTEMPT = QByteArrayLiteral("SYNC-FAILURE-LAST-ATTEMPT");
+    const QByteArray KIND = QByteArrayLiteral("SYNC-FAILURE-KIND");
+    // Delays in seconds before retrying a failing upload, doubled after each
+    // new failure up to the maximum. Uploads rejected by the server for their
+    // content are unlikely to succeed later, so they are retried less often.
+    const qint64 TRANSIENT_RETRY_DELAY = 15 * 60;
+    const qint64 TRANSIENT_MAX_RETRY_DELAY = 24 * 3600;
+    const qint64 PERMANENT_RETRY_DELAY = 6 * 3600;
+    const qint64 PERMANENT_MAX_RETRY_DELAY = 30 * 24 * 3600;
+    bool isPermanentUploadError(int statusCode)
+    {
+        switch (statusCode) {
+        case 400: // Bad Request
+        case 403: // Forbidden
+        case 405: // Method Not Allowed
+        case 411: // Length Required
+        case 413: // Payload Too Large
+        case 414: // URI Too Long
+        case 415: // Unsupported Media Type
+        case 422: // Unprocessable Entity
+        case 501: // Not Implemented
+        case 507: // Insufficient Storage
+            return true;
+        default:
+            return false;
+        }
+    }
+    // Responses of a server unable to process a request this large.
+    bool isServerOverloaded(const Buteo::Dav::Client::Reply &reply, int statusCode)
+    {
+        switch (statusCode) {
+        case 413: // Payload Too Large
+        case 503: // Service Unavailable
+        case 504: // Gateway Timeout
+        case 507: // Insufficient Storage
+            return true;
+        default:
+            return reply.networkError == QNetworkReply::TimeoutError
+                || reply.networkError == QNetworkReply::RemoteHostClosedError;
+        }
+    }
+    void clearFailure(const KCalendarCore::Incidence::Ptr &incidence)
+    {
+        incidence->removeCustomProperty(APP, NAME);
+        incidence->removeCustomProperty(APP, RESOLUTION);
+        incidence->removeCustomProperty(APP, ATTEMPTS);
+        incidence->removeCustomProperty(APP, LAST_ATTEMPT);
+        incidence->removeCustomProperty(APP, KIND);
+    }
+    void flagUploadAttempt(const KCalendarCore::Incidence::Ptr &incidence,
+                           const QString &failure, bool permanent)
+    {
+        const int attempts = incidence->customProperty(APP, ATTEMPTS).toInt();
+        incidence->setCustomProperty(APP, NAME, failure);
+        incidence->setCustomProperty(APP, ATTEMPTS, QString::number(attempts + 1));
+        incidence->setCustomProperty(APP, LAST_ATTEMPT,
+                                     QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+        incidence->setCustomProperty(APP, KIND, permanent
+                                     ? QStringLiteral("permanent") : QStringLiteral("transient"));
+    }
     void flagUploadFailure(const QHash<QString, QByteArray> &failingHrefs,
+                           const QSet<QString> &permanentHrefs,
                            const KCalendarCore::Incidence::List &incidences,
                            const QString &remotePath = QString())
     {
         for (int i = 0; i < incidences.size(); i++) {
-            const QString href = storedIncidenceHrefUri(incidences[i]);
-            if (href.isEmpty() && failingHrefs.contains(createIncidenceHrefUri(incidences[i], remotePath))) {
-                incidences[i]->setCustomProperty(APP, NAME, QStringLiteral("upload-new"));
-            } else if (!href.isEmpty() && failingHrefs.contains(href)) {
-                incidences[i]->setCustomProperty(APP, NAME, QStringLiteral("upload"));
+            QString href = storedIncidenceHrefUri(incidences[i]);
+            const bool isNew = href.isEmpty();
+            if (isNew) {
+                href = createIncidenceHrefUri(incidences[i], remotePath);
+            }
+            if (failingHrefs.contains(href)) {
+                flagUploadAttempt(incidences[i], isNew ? QStringLiteral("upload-new") : QStringLiteral("upload"),
+                                  permanentHrefs.contains(href));
             } else {
-                incidences[i]->removeCustomProperty(APP, NAME);
-                incidences[i]->removeCustomProperty(APP, RESOLUTION);
+                clearFailure(incidences[i]);
             }
         }
     }
     void flagUpdateSuccess(const KCalendarCore::Incidence::Ptr &incidence)
     {
-        incidence->removeCustomProperty(APP, NAME);
-        incidence->removeCustomProperty(APP, RESOLUTION);
+        clearFailure(incidence);
     }
     void flagUpdateFailure(const KCalendarCore::Incidence::Ptr &incidence)
     {
@@ -354,10 +372,34 @@ namespace {
     {
         return !incidence->customProperty(APP, NAME).isEmpty();
     }
+    bool uploadRetryDue(const KCalendarCore::Incidence::Ptr &incidence)
+    {
+        const int attempts = incidence->customProperty(APP, ATTEMPTS).toInt();
+        const QDateTime lastAttempt = QDateTime::fromString(incidence->customProperty(APP, LAST_ATTEMPT),
+                                                            Qt::ISODate);
+        if (attempts <= 0 || !lastAttempt.isValid()) {
+            // Flagged before attempts were recorded.
+            return true;
+        }
+        const bool permanent = incidence->customProperty(APP, KIND) == QStringLiteral("permanent");
+        const qint64 maxDelay = permanent ? PERMANENT_MAX_RETRY_DELAY : TRANSIENT_MAX_RETRY_DELAY;
+        qint64 delay = permanent ? PERMANENT_RETRY_DELAY : TRANSIENT_RETRY_DELAY;
+        for (int i = 1; i < attempts && delay < maxDelay; i++) {
+            delay *= 2;
+        }
+        const QDateTime nextAttempt = lastAttempt.addSecs(qMin(delay, maxDelay));
+        if (nextAttempt > QDateTime::currentDateTimeUtc()) {
+            qCDebug(lcCalDav) << "delaying retry of failing upload" << incidence->instanceIdentifier()
+                              << "after" << attempts << "attempts, until" << nextAttempt.toString(Qt::ISODate);
+            return false;
+        }
+        return true;
+    }
     bool retryUploadFailure(const KCalendarCore::Incidence::Ptr &incidence)
     {
         return incidence->customProperty(APP, NAME).startsWith(QStringLiteral("upload"))
-            && incidence->customProperty(APP, RESOLUTION).isEmpty();
+            && incidence->customProperty(APP, RESOLUTION).isEmpty()
+            && uploadRetryDue(incidence);
     }
     bool retryUpdateFailure(const KCalendarCore::Incidence::Ptr &incidence)
     {
@@ -400,16 +442,50 @@ NotebookSyncAgent::NotebookSyncAgent(mKCal::ExtendedCalendar::Ptr calendar,
     , mNotebook(0)
     , mRemoteCalendarPath(remotePath)
     , mSyncMode(NoSyncMode)
+    , mWindowFetched(false)
     , mRetriedReport(false)
     , mNotebookNeedsDeletion(false)
+    , mNotebookModified(false)
+    , mFetchSentResources(false)
+    , mPushFallback(false)
+    , mPushWindow(0)
+    , mFutureRefreshInterval(0)
+    , mPastRefreshInterval(0)
+    , mPastUnlisted(-1)
+    , mFutureUnlisted(-1)
+    , mProgressiveSlowSync(false)
+    , mChunkCommitFailed(false)
+    , mTwoPhaseSlowSync(false)
+    , mMultigetSize(0)
+    , mEvictionMargin(0)
+    , mMaxStaleness(0)
+    , mListingSkipped(false)
     , mEnableUpsync(true)
     , mEnableDownsync(true)
     , mReadOnlyFlag(readOnlyFlag)
+    , mCommitStrategy(CommitPerNotebook)
+    , mConflictPolicy(Buteo::SyncProfile::CR_PREFER_REMOTE_CHANGES)
+    , mCommitBatchSize(0)
+    , mUncommittedChanges(0)
+    , mCommitCount(0)
+    , mCommitDuration(0)
+    , mCommitFailed(false)
+    , mSkippedUploadCount(0)
+    , mUploadWindow(DEFAULT_UPLOAD_WINDOW)
+    , mRetryingUploads(0)
+    , mUploadedCount(0)
+    , mUploadedBytes(0)
+    , mStagedIncidenceCount(0)
+    , mChunkIncidenceCount(0)
+    , mIcsParser(new IcsParser)
 {
     // Yahoo! seems to double-percent-encode for some reason
     if (mDAV->serverAddress().contains(QStringLiteral("caldav.calendar.yahoo.com"))) {
         mRemoteCalendarPath = QUrl::fromPercentEncoding(mRemoteCalendarPath.toUtf8());
     }
+    // Google rewrites the uploaded data (organizer, attendees...),
+    // so the uploaded resources are downloaded back, not only their etags.
+    mFetchSentResources = mDAV->serverAddress().contains(QStringLiteral("googleusercontent.com"));
 }
 
 NotebookSyncAgent::~NotebookSyncAgent()
@@ -417,18 +493,135 @@ NotebookSyncAgent::~NotebookSyncAgent()
     NOTEBOOK_FUNCTION_CALL_TRACE;
 }
 
+void NotebookSyncAgent::setCommitStrategy(CommitStrategy strategy, int batchSize)
+{
+    mCommitStrategy = strategy;
+    mCommitBatchSize = batchSize;
+}
+
+void NotebookSyncAgent::setStagingThreshold(qint64 bytes)
+{
+    mStaging.setThreshold(bytes);
+}
+
+void NotebookSyncAgent::setUploadWindow(int window)
+{
+    mUploadWindow = qMax(1, window);
+}
+
+void NotebookSyncAgent::setConflictResolutionPolicy(Buteo::SyncProfile::ConflictResolutionPolicy policy)
+{
+    mConflictPolicy = policy;
+}
+
+void NotebookSyncAgent::setPushWindow(int seconds)
+{
+    mPushWindow = qMax(0, seconds);
+}
+
+// The etags of the past and of the future beyond the next days are
+// only listed every given number of seconds, or at every sync for 0.
+// Local changes in these tiers are still sent, conditional on their
+// stored etag.
+void NotebookSyncAgent::setRefreshIntervals(int futureSeconds, int pastSeconds)
+{
+    mFutureRefreshInterval = qMax(0, futureSeconds);
+    mPastRefreshInterval = qMax(0, pastSeconds);
+}
+
+void NotebookSyncAgent::setProgressiveSlowSync(bool enabled)
+{
+    mProgressiveSlowSync = enabled;
+}
+
+void NotebookSyncAgent::setTwoPhaseSlowSync(bool enabled)
+{
+    mTwoPhaseSlowSync = enabled;
+}
+
+void NotebookSyncAgent::setEvictionMargin(int days)
+{
+    mEvictionMargin = qMax(0, days);
+}
+
+// Calendars whose server copy rarely changes, like holiday or birthday
+// subscriptions, are not listed at every sync, but at least every
+// given number of seconds. Local changes are still pushed.
+void NotebookSyncAgent::setMaxStaleness(int seconds)
+{
+    mMaxStaleness = qMax(0, seconds);
+}
+
+// The changes applied by applyRemoteChanges() were not saved by the
+// caller, see CommitPerAccount, they are reported as failed.
+void NotebookSyncAgent::setCommitFailed()
+{
+    mCommitFailed = true;
+}
+
 void NotebookSyncAgent::abort()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
     disconnect(mDAV, 0, this, 0);
 
+    // Pending parsing results are not needed anymore.
+    for (QFutureWatcher<CalendarResource> *watcher : const_cast<const QList<QFutureWatcher<CalendarResource> *>&>(mParsingJobs)) {
+        watcher->disconnect(this);
+        watcher->cancel();
+        watcher->deleteLater();
+        mPendingActions -= 1;
+    }
+    mParsingJobs.clear();
+
+    // Don't send anything more, including the uploads waiting for a retry.
+    mUploadQueue.clear();
+    mSlowSyncChunks.clear();
+    mETagSlices.clear();
+    mMultigetQueue.clear();
+    mUploadWindow = 0;
+    mConflicts.clear();
+    mETagRequests.clear();
+    mSentResourcesRequest.clear();
+
     emit finished();
 }
 
 static const QByteArray PATH_PROPERTY = QByteArrayLiteral("remoteCalendarPath");
 static const QByteArray EMAIL_PROPERTY = QByteArrayLiteral("userPrincipalEmail");
 static const QByteArray SERVER_COLOR_PROPERTY = QByteArrayLiteral("serverColor");
+static const QByteArray FULL_SYNC_PROPERTY = QByteArrayLiteral("lastFullSyncDate");
+static const QByteArray WINDOW_FROM_PROPERTY = QByteArrayLiteral("syncWindowFrom");
+static const QByteArray WINDOW_TO_PROPERTY = QByteArrayLiteral("syncWindowTo");
+// Moves of the synced window smaller than this, in s, are only
+// stored along other notebook changes.
+static const qint64 WINDOW_MOVE_THRESHOLD = 24 * 3600;
+static const QByteArray PAST_REFRESH_PROPERTY = QByteArrayLiteral("pastRefreshDate");
+static const QByteArray FUTURE_REFRESH_PROPERTY = QByteArrayLiteral("futureRefreshDate");
+// Set while the notebook holds the incidences of an unfinished slow sync.
+static const QByteArray CHECKPOINT_PROPERTY = QByteArrayLiteral("slowSyncCheckpoint");
+// Average number of remote changes per etag listing, and date of the
+// last listing, see canSkipListing().
+static const QByteArray CHANGE_RATE_PROPERTY = QByteArrayLiteral("remoteChangeRate");
+static const QByteArray LISTING_DATE_PROPERTY = QByteArrayLiteral("lastListingDate");
+// Weight of the last listing in the moving average of the change rate.
+static const double CHANGE_RATE_WEIGHT = 0.25;
+// Calendars changing less than this per listing can skip listings.
+static const double LOW_CHANGE_RATE = 0.1;
+// Days after now whose etags are listed at every quick sync,
+// see setRefreshIntervals(), and downloaded first in a progressive
+// slow sync.
+static const int NEAR_FUTURE_DAYS = 14;
+// Length in days of the next chunks of a progressive slow sync.
+static const int SLOW_SYNC_CHUNK_DAYS = 90;
+// Initial number of resources per multiget, and number of multigets
+// sent at once, in a two-phase slow sync.
+static const int MULTIGET_SIZE = 100;
+static const int MAX_SENDING_MULTIGETS = 3;
+// Attempts of a multiget failing for other reasons than overload.
+static const int MULTIGET_ATTEMPTS = 3;
+// Etag listings are not split below this length, in s.
+static const qint64 MIN_SLICE_LENGTH = 24 * 3600;
 
 bool NotebookSyncAgent::setNotebookFromInfo(const Buteo::Dav::CalendarInfo &info,
                                             const QString &userEmail,
@@ -446,6 +639,18 @@ bool NotebookSyncAgent::setNotebookFromInfo(const Buteo::Dav::CalendarInfo &info
             qCDebug(lcCalDav) << "found notebook:" << notebook->uid()
                               << "for remote calendar:" << mRemoteCalendarPath;
             mNotebook = notebook;
+            // mNotebook is shared with the storage, remember if it
+            // needs to be written back.
+            mNotebookModified = notebook->name() != info.displayName
+                || notebook->description() != info.description
+                || notebook->syncProfile() != syncProfile
+                || notebook->customProperty(EMAIL_PROPERTY) != userEmail
+                || notebook->pluginName() != pluginName
+                || notebook->eventsAllowed() != info.allowEvents
+                || notebook->todosAllowed() != info.allowTodos
+                || notebook->journalsAllowed() != info.allowJournals
+                || (!info.color.isEmpty()
+                    && notebook->customProperty(SERVER_COLOR_PROPERTY) != info.color);
             if (!info.color.isEmpty()
                 && notebook->customProperty(SERVER_COLOR_PROPERTY) != info.color) {
                 if (!notebook->customProperty(SERVER_COLOR_PROPERTY).isEmpty()) {
@@ -469,6 +674,7 @@ bool NotebookSyncAgent::setNotebookFromInfo(const Buteo::Dav::CalendarInfo &info
     qCDebug(lcCalDav) << "no notebook exists for" << mRemoteCalendarPath;
     // or create a new one
     mNotebook = mKCal::Notebook::Ptr(new mKCal::Notebook(info.displayName, QString()));
+    mNotebookModified = true;
     mNotebook->setAccount(accountId);
     mNotebook->setDescription(info.description);
     mNotebook->setPluginName(pluginName);
@@ -497,10 +703,10 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
     }
 
     disconnect(mDAV, 0, this, 0);
-    connect(mDAV, &Buteo::Dav::Client::calendarEtagsFinished, this, &NotebookSyncAgent::processETags);
-    connect(mDAV, &Buteo::Dav::Client::calendarResourcesFinished, this, &NotebookSyncAgent::reportRequestFinished);
-    connect(mDAV, &Buteo::Dav::Client::sendCalendarFinished, this, &NotebookSyncAgent::resourceSent);
-    connect(mDAV, &Buteo::Dav::Client::deleteFinished, this, &NotebookSyncAgent::resourceDeleted);
+    connect(mDAV, &Buteo::Dav::Client::calendarEtagsResult, this, &NotebookSyncAgent::processETags);
+    connect(mDAV, &Buteo::Dav::Client::calendarResourcesResult, this, &NotebookSyncAgent::reportRequestFinished);
+    connect(mDAV, &Buteo::Dav::Client::sendCalendarResult, this, &NotebookSyncAgent::resourceSent);
+    connect(mDAV, &Buteo::Dav::Client::deleteResult, this, &NotebookSyncAgent::resourceDeleted);
 
     // Store sync time before sync is completed to avoid loosing events
     // that may be inserted server side between now and the termination
@@ -508,6 +714,19 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
     mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
     mFromDateTime = fromDateTime;
     mToDateTime = toDateTime;
+    mWindowFrom = fromDateTime;
+    mWindowTo = toDateTime;
+    mWindowFetched = true;
+    mPastTierFrom = QDateTime();
+    mFutureTierTo = QDateTime();
+    mPastUnlisted = -1;
+    mFutureUnlisted = -1;
+    mExposedSlices.clear();
+    mExposedLocalChanges.clear();
+    mMultigetSize = MULTIGET_SIZE;
+    mListedHrefs.clear();
+    mRemotelyChanged.clear();
+    mListingSkipped = false;
     mEnableUpsync = withUpsync;
     mEnableDownsync = withDownsync;
     mPendingActions = 0;
@@ -525,9 +744,55 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
                           << "between" << fromDateTime << "to" << toDateTime;
         mSyncMode = SlowSync;
 
+        if (!mNotebook->customProperty(CHECKPOINT_PROPERTY).isEmpty()) {
+            loadCheckpoint();
+        }
         // Even if down sync is disabled in profile, we down sync the
         // remote calendar the first time, by design.
-        sendReportRequest();
+        if (mProgressiveSlowSync) {
+            planSlowSyncChunks();
+        }
+        if (!mSlowSyncChunks.isEmpty()) {
+            sendNextChunk();
+        } else {
+            fetchSlowSyncRange();
+        }
+    } else if (withUpsync && !mReadOnlyFlag
+               && (!withDownsync || canPush() || canSkipListing())) {
+/*
+    Push sync mode:
+
+    1) Get the local changes since the last sync from mKCal
+    2) Send them to the server using Put and Delete requests, conditional
+       on the stored etags
+    3) Continue with a quick sync if a local change has no stored etag,
+       or if the server copy was modified since the last sync.
+
+    This is also the mode of upload-only syncs, which don't need the
+    server etags, except to resolve conflicts.
+ */
+        qCDebug(lcCalDav) << "Start push sync for notebook:" << mNotebook->uid()
+                          << ", push changes since" << mNotebook->syncDate();
+        mSyncMode = PushSync;
+        mListingSkipped = withDownsync && !canPush();
+        if (!calculatePushDelta(&mLocalAdditions, &mLocalModifications, &mLocalDeletions)) {
+            fallBackToQuickSync();
+            return;
+        }
+        // The sync is not finished before the caller is ready,
+        // even when there is nothing to send.
+        mPendingActions += 1;
+        sendLocalChanges();
+        QTimer::singleShot(0, this, &NotebookSyncAgent::requestFinished);
+    } else if (withDownsync && canSkipListing()) {
+        // Nothing to push for a read-only calendar or a download-only
+        // profile, the sync of this low-churn calendar is skipped.
+        qCDebug(lcCalDav) << "Skip sync of low-churn notebook:" << mNotebook->uid()
+                          << ", last listed on" << mNotebook->customProperty(LISTING_DATE_PROPERTY);
+        mSyncMode = SkippedSync;
+        mListingSkipped = true;
+        mPendingActions += 1;
+        QTimer::singleShot(0, this, &NotebookSyncAgent::requestFinished);
     } else {
 /*
     Quick sync mode:
@@ -546,7 +811,7 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
                   << ", sync changes since" << mNotebook->syncDate();
         mSyncMode = QuickSync;
 
-        fetchRemoteChanges();
+        fetchWindowChanges();
     }
 }
 
@@ -561,6 +826,496 @@ void NotebookSyncAgent::sendReportRequest(const QStringList &remoteUris)
     }
 }
 
+// Local changes are pushed alone when the server etags were listed
+// recently enough, see setPushWindow().
+bool NotebookSyncAgent::canPush() const
+{
+    if (mPushWindow <= 0) {
+        return false;
+    }
+    const QDateTime fullSync = QDateTime::fromString(mNotebook->customProperty(FULL_SYNC_PROPERTY),
+                                                     Qt::ISODate);
+    return fullSync.isValid()
+        && fullSync.addSecs(mPushWindow) > QDateTime::currentDateTimeUtc();
+}
+
+bool NotebookSyncAgent::refreshDue(const QByteArray &property, int interval) const
+{
+    if (interval <= 0) {
+        return true;
+    }
+    const QDateTime refresh = QDateTime::fromString(mNotebook->customProperty(property),
+                                                    Qt::ISODate);
+    return !refresh.isValid()
+        || refresh.addSecs(interval) <= mNotebookSyncedDateTime;
+}
+
+// Incidences of a tier whose etags were not listed in this sync,
+// see fetchWindowChanges().
+bool NotebookSyncAgent::inSkippedTier(KCalendarCore::Incidence::Ptr incidence) const
+{
+    return (mPastTierFrom.isValid() && incidenceWithin(incidence, mPastTierFrom, mFromDateTime))
+        || (mFutureTierTo.isValid() && incidenceWithin(incidence, mToDateTime, mFutureTierTo));
+}
+
+// Incidences of a part of the window downloaded without listing
+// its etags, see fetchWindowChanges().
+bool NotebookSyncAgent::inExposedSlice(KCalendarCore::Incidence::Ptr incidence) const
+{
+    for (const QPair<QDateTime, QDateTime> &slice : mExposedSlices) {
+        if (incidenceWithin(incidence, slice.first, slice.second)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The listing of the server etags is skipped when the calendar changed
+// less than LOW_CHANGE_RATE times per listing on average. The lower the
+// rate, the longer the listing is skipped, up to the maximum staleness.
+bool NotebookSyncAgent::canSkipListing() const
+{
+    if (mMaxStaleness <= 0) {
+        return false;
+    }
+    bool valid = false;
+    const double rate = mNotebook->customProperty(CHANGE_RATE_PROPERTY).toDouble(&valid);
+    const QDateTime listing = QDateTime::fromString(mNotebook->customProperty(LISTING_DATE_PROPERTY),
+                                                    Qt::ISODate);
+    if (!valid || rate >= LOW_CHANGE_RATE || !listing.isValid()) {
+        return false;
+    }
+    const qint64 staleness = qint64(mMaxStaleness * (1. - rate / LOW_CHANGE_RATE));
+    return listing.addSecs(staleness) > mNotebookSyncedDateTime;
+}
+
+void NotebookSyncAgent::fallBackToQuickSync()
+{
+    qCDebug(lcCalDav) << "Cannot only push the local changes of" << mRemoteCalendarPath
+                      << ", starting a quick sync.";
+    mSyncMode = QuickSync;
+    mPushFallback = false;
+    mListingSkipped = false;
+    // The delta is computed again against the server etags,
+    // the changes already pushed are seen as unchanged.
+    mLocalAdditions.clear();
+    mLocalModifications.clear();
+    mLocalDeletions.clear();
+    mPurgeList.clear();
+    fetchWindowChanges();
+}
+
+void NotebookSyncAgent::sendReportRequest(const QDateTime &fromDateTime, const QDateTime &toDateTime)
+{
+    mPendingActions += 1;
+    mDAV->getCalendarResources(mRemoteCalendarPath, fromDateTime, toDateTime);
+}
+
+// The etags are only listed over the part of the window that was
+// synced before. The parts newly exposed by the sliding of the window,
+// or by a change of the sync period, are downloaded entirely. Local
+// changes in these parts are still sent, see calculateDelta().
+void NotebookSyncAgent::fetchWindowChanges()
+{
+    const QDateTime syncedFrom = QDateTime::fromString(mNotebook->customProperty(WINDOW_FROM_PROPERTY),
+                                                       Qt::ISODate);
+    const QDateTime syncedTo = QDateTime::fromString(mNotebook->customProperty(WINDOW_TO_PROPERTY),
+                                                     Qt::ISODate);
+    mExposedSlices.clear();
+    if (syncedFrom.isValid() && syncedTo.isValid()
+        && syncedFrom < mWindowTo && syncedTo > mWindowFrom) {
+        if (mWindowFrom < syncedFrom) {
+            mExposedSlices.append(qMakePair(mWindowFrom, syncedFrom));
+        }
+        if (syncedTo < mWindowTo) {
+            mExposedSlices.append(qMakePair(syncedTo, mWindowTo));
+        }
+        mFromDateTime = qMax(mWindowFrom, syncedFrom);
+        mToDateTime = qMin(mWindowTo, syncedTo);
+    }
+
+    // The near future is listed at every sync, the rest of the future
+    // and the past only when their refresh interval has elapsed.
+    const QDateTime now = mNotebookSyncedDateTime;
+    const QDateTime nearFuture = now.addDays(NEAR_FUTURE_DAYS);
+    if (!refreshDue(PAST_REFRESH_PROPERTY, mPastRefreshInterval)
+        && mFromDateTime < now && now < mToDateTime) {
+        qCDebug(lcCalDav) << "Not listing the past etags before" << now << "for" << mRemoteCalendarPath;
+        mPastTierFrom = mFromDateTime;
+        mFromDateTime = now;
+        mPastUnlisted = 0;
+    }
+    if (!refreshDue(FUTURE_REFRESH_PROPERTY, mFutureRefreshInterval)
+        && mFromDateTime < nearFuture && nearFuture < mToDateTime) {
+        qCDebug(lcCalDav) << "Not listing the future etags after" << nearFuture << "for" << mRemoteCalendarPath;
+        mFutureTierTo = mToDateTime;
+        mToDateTime = nearFuture;
+        mFutureUnlisted = 0;
+    }
+
+    fetchRemoteChanges();
+    for (const QPair<QDateTime, QDateTime> &slice : const_cast<const QList<QPair<QDateTime, QDateTime> >&>(mExposedSlices)) {
+        qCDebug(lcCalDav) << "Downloading newly exposed window slice from" << slice.first
+                          << "to" << slice.second << "for" << mRemoteCalendarPath;
+        sendReportRequest(slice.first, slice.second);
+    }
+}
+
+// A progressive slow sync downloads the near future first, then the
+// rest of the future and the past, most recent first. Each chunk but
+// the last one is written to storage as soon as it is received, see
+// requestFinished(), the last one is applied as usual.
+void NotebookSyncAgent::planSlowSyncChunks()
+{
+    mSlowSyncChunks.clear();
+    const QDateTime now = qBound(mWindowFrom, mNotebookSyncedDateTime, mWindowTo);
+    QDateTime start = now;
+    QDateTime end = qMin(now.addDays(NEAR_FUTURE_DAYS), mWindowTo);
+    while (start < mWindowTo) {
+        mSlowSyncChunks.append(qMakePair(start, end));
+        start = end;
+        end = qMin(end.addDays(SLOW_SYNC_CHUNK_DAYS), mWindowTo);
+    }
+    end = now;
+    while (end > mWindowFrom) {
+        start = qMax(end.addDays(-SLOW_SYNC_CHUNK_DAYS), mWindowFrom);
+        mSlowSyncChunks.append(qMakePair(start, end));
+        end = start;
+    }
+    qCDebug(lcCalDav) << "Downloading" << mRemoteCalendarPath << "in"
+                      << mSlowSyncChunks.count() << "chunks";
+}
+
+void NotebookSyncAgent::sendNextChunk()
+{
+    const QPair<QDateTime, QDateTime> chunk = mSlowSyncChunks.takeFirst();
+    // Kept as the report range, for the retry in reportRequestFinished().
+    mFromDateTime = chunk.first;
+    mToDateTime = chunk.second;
+    fetchSlowSyncRange();
+}
+
+void NotebookSyncAgent::fetchSlowSyncRange()
+{
+    if (mTwoPhaseSlowSync) {
+        fetchInTwoPhases(mFromDateTime, mToDateTime);
+    } else {
+        sendReportRequest();
+    }
+}
+
+// Two-phase slow sync: the etags are listed first, then the data
+// are downloaded by bounded multigets, a few at a time. A listing
+// or a multiget too large for the server is split in two and sent
+// again, the other failing multigets are retried on their own.
+void NotebookSyncAgent::fetchInTwoPhases(const QDateTime &fromDateTime, const QDateTime &toDateTime)
+{
+    qCDebug(lcCalDav) << "Listing the etags of" << mRemoteCalendarPath
+                      << "between" << fromDateTime << "and" << toDateTime << "before downloading";
+    mETagSlices.append(qMakePair(fromDateTime, toDateTime));
+    if (mETagSlices.count() == 1 && !mListedSlice.first.isValid()) {
+        listNextSlice();
+    }
+}
+
+// Slices are listed one after the other, while the data of
+// the previous ones are downloaded.
+void NotebookSyncAgent::listNextSlice()
+{
+    mListedSlice = mETagSlices.takeFirst();
+    mPendingActions += 1;
+    mDAV->getCalendarEtags(mRemoteCalendarPath, mListedSlice.first, mListedSlice.second);
+}
+
+void NotebookSyncAgent::slowSyncETagsReceived(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                                              const QHash<QString, QString> &etags)
+{
+    const QPair<QDateTime, QDateTime> slice = mListedSlice;
+    mListedSlice = QPair<QDateTime, QDateTime>();
+    if (!reply.hasError()) {
+        QStringList hrefs;
+        for (QHash<QString, QString>::ConstIterator it = etags.constBegin(); it != etags.constEnd(); ++it) {
+            if (!mListedHrefs.contains(it.key())) {
+                mListedHrefs.insert(it.key());
+                // Already stored by an interrupted sync.
+                if (mCheckpointETags.value(it.key()) != it.value() || it.value().isEmpty()) {
+                    hrefs.append(it.key());
+                }
+            }
+        }
+        qCDebug(lcCalDav) << "Listed" << etags.count() << "etags of" << mRemoteCalendarPath
+                          << "between" << slice.first << "and" << slice.second;
+        queueMultigets(hrefs);
+    } else if (isServerOverloaded(reply, statusCode)
+               && slice.first.secsTo(slice.second) > MIN_SLICE_LENGTH) {
+        const QDateTime middle = slice.first.addSecs(slice.first.secsTo(slice.second) / 2);
+        qCWarning(lcCalDav) << "Server overloaded listing the etags of" << mRemoteCalendarPath
+                            << "between" << slice.first << "and" << slice.second << ", splitting.";
+        mETagSlices.prepend(qMakePair(middle, slice.second));
+        mETagSlices.prepend(qMakePair(slice.first, middle));
+    } else {
+        setFatal(reply.uri, reply.errorData);
+        return;
+    }
+
+    if (!mETagSlices.isEmpty()) {
+        listNextSlice();
+    }
+    sendMultigets();
+    requestFinished();
+}
+
+void NotebookSyncAgent::queueMultigets(const QStringList &hrefs)
+{
+    for (int i = 0; i < hrefs.count(); i += mMultigetSize) {
+        const Multiget multiget = {hrefs.mid(i, mMultigetSize), 0};
+        mMultigetQueue.append(multiget);
+    }
+}
+
+void NotebookSyncAgent::sendMultigets()
+{
+    while (mSendingMultigets.count() < MAX_SENDING_MULTIGETS && !mMultigetQueue.isEmpty()) {
+        const Multiget multiget = mMultigetQueue.takeFirst();
+        mSendingMultigets.append(multiget);
+        mPendingActions += 1;
+        mDAV->getCalendarResources(mRemoteCalendarPath, multiget.hrefs);
+    }
+}
+
+void NotebookSyncAgent::multigetFinished(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                                         const QStringList &hrefs,
+                                         const QList<Buteo::Dav::Resource> &resources)
+{
+    int index = 0;
+    while (index < mSendingMultigets.count() && mSendingMultigets[index].hrefs != hrefs) {
+        index += 1;
+    }
+    if (index == mSendingMultigets.count()) {
+        return;
+    }
+    Multiget multiget = mSendingMultigets.takeAt(index);
+    if (!reply.hasError()) {
+        receiveResources(resources);
+    } else if (isServerOverloaded(reply, statusCode) && multiget.hrefs.count() > 1) {
+        // Smaller multigets from now on, including the queued ones.
+        mMultigetSize = qMax(1, multiget.hrefs.count() / 2);
+        QStringList hrefs = multiget.hrefs;
+        for (const Multiget &queued : const_cast<const QList<Multiget>&>(mMultigetQueue)) {
+            hrefs += queued.hrefs;
+        }
+        mMultigetQueue.clear();
+        qCWarning(lcCalDav) << "Server overloaded downloading" << mRemoteCalendarPath
+                            << ", downloading" << mMultigetSize << "resources at a time.";
+        queueMultigets(hrefs);
+    } else if (multiget.attempts + 1 < MULTIGET_ATTEMPTS) {
+        qCWarning(lcCalDav) << "Retrying download of" << multiget.hrefs.count()
+                            << "resources of" << mRemoteCalendarPath << ":" << reply.errorMessage;
+        multiget.attempts += 1;
+        mMultigetQueue.append(multiget);
+    } else {
+        setFatal(reply.uri, reply.errorData);
+        return;
+    }
+
+    sendMultigets();
+    requestFinished();
+}
+
+bool NotebookSyncAgent::commitChunk()
+{
+    QElapsedTimer timer;
+    timer.start();
+    bool success = ensureNotebook();
+    if (success) {
+        if (!updateIncidences(mReceivedCalendarResources)) {
+            success = false;
+        }
+        if (!applyStagedResources()) {
+            success = false;
+        }
+        if (!saveChanges()) {
+            success = false;
+        }
+    }
+    int count = 0;
+    for (const CalendarResource &resource : const_cast<const QList<CalendarResource>&>(mReceivedCalendarResources)) {
+        if (!mFailingUpdates.contains(resource.href)) {
+            count += resource.incidences.count();
+        }
+    }
+    mChunkIncidenceCount += count;
+    mReceivedCalendarResources.clear();
+    mChunkCommitFailed = mChunkCommitFailed || !success;
+    if (success && !storeCheckpoint()) {
+        mChunkCommitFailed = true;
+    }
+    qCDebug(lcCalDav) << "Committed" << count << "incidences of" << mRemoteCalendarPath
+                      << "between" << mFromDateTime << "and" << mToDateTime
+                      << "in" << timer.elapsed() << "ms," << mSlowSyncChunks.count() << "chunks left";
+    emit chunkCommitted(count, mSlowSyncChunks.count());
+    return success;
+}
+
+// Keeps what was received or acknowledged so far, when the sync cannot
+// complete. The received incidences are written in memory, the caller
+// then saves the storage once for all notebooks and calls
+// commitCheckpoint(). The sync date is not updated, so the local
+// changes not sent yet are found again next time. For a slow sync, the
+// notebook is marked so the next slow sync only downloads the resources
+// missing or changed since, see loadCheckpoint(). abort() is to be
+// called next.
+bool NotebookSyncAgent::checkpoint()
+{
+    if (!mNotebook || mSyncMode == NoSyncMode || mNotebookNeedsDeletion) {
+        return true;
+    }
+    if (!ensureNotebook()) {
+        return false;
+    }
+    // The resources still being parsed are not waited for,
+    // they are downloaded again by the next sync.
+    for (QFutureWatcher<CalendarResource> *watcher : const_cast<const QList<QFutureWatcher<CalendarResource> *>&>(mParsingJobs)) {
+        watcher->disconnect(this);
+        watcher->cancel();
+        watcher->deleteLater();
+        mPendingActions -= 1;
+    }
+    mParsingJobs.clear();
+    bool success = true;
+    if (mEnableDownsync || mSyncMode == SlowSync) {
+        if (!updateIncidences(mReceivedCalendarResources)) {
+            success = false;
+        }
+        if (!applyStagedResources()) {
+            success = false;
+        }
+    }
+    mReceivedCalendarResources.clear();
+    return success;
+}
+
+// Once the storage is saved by the caller, the checkpoint is marked
+// on the notebook, without any other change of its properties.
+bool NotebookSyncAgent::commitCheckpoint()
+{
+    if (!mNotebook || mSyncMode == NoSyncMode || mNotebookNeedsDeletion) {
+        return true;
+    }
+    // The etags of acknowledged uploads are already set, see resourceSent(),
+    // purge the incidences whose deletion was acknowledged too.
+    KCalendarCore::Incidence::List deleted;
+    for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(mPurgeList)) {
+        const QString href = storedIncidenceHrefUri(incidence);
+        bool pending = mSendingUploads.contains(href) || mConflicts.contains(href);
+        for (int i = 0; !pending && i < mUploadQueue.count(); i++) {
+            pending = mUploadQueue[i].href == href;
+        }
+        if (!pending) {
+            deleted.append(incidence);
+        }
+    }
+    if (!deleted.isEmpty() && !mStorage->purgeDeletedIncidences(deleted, mNotebook->uid())) {
+        qCWarning(lcCalDav) << "Cannot purge from database the marked as deleted incidences.";
+    }
+    return mSyncMode != SlowSync || storeCheckpoint();
+}
+
+// A clean sync of a notebook is a slow sync resumed from the local
+// incidences as they are, see loadCheckpoint(): the ones with the same
+// etag as on the server are kept, the others are downloaded again or
+// deleted. Returns CleanSyncUnmatched when the notebook cannot be
+// matched to a server calendar anymore, and should be deleted instead.
+NotebookSyncAgent::CleanSyncPreparation NotebookSyncAgent::prepareCleanSync(mKCal::ExtendedStorage::Ptr storage, mKCal::Notebook::Ptr notebook)
+{
+    if (notebook->customProperty(PATH_PROPERTY).isEmpty()) {
+        return CleanSyncUnmatched;
+    }
+    // The slow sync doesn't send the local changes, and the new sync
+    // date would hide them from the next syncs. A notebook with pending
+    // local changes keeps its sync state, its next quick sync sends
+    // them, and the clean sync is prepared again afterwards.
+    if (notebook->syncDate().isValid()) {
+        const QDateTime syncDateTime = notebook->syncDate().addSecs(1);
+        KCalendarCore::Incidence::List inserted, modified, deleted;
+        if (!storage->insertedIncidences(&inserted, syncDateTime, notebook->uid())
+            || !storage->modifiedIncidences(&modified, syncDateTime, notebook->uid())
+            || !storage->deletedIncidences(&deleted, QDateTime(), notebook->uid())) {
+            qCWarning(lcCalDav) << "Unable to list the local changes of notebook:" << notebook->uid()
+                                << ", not reconciling it.";
+            return CleanSyncDeferred;
+        }
+        bool pending = !modified.isEmpty() || !deleted.isEmpty();
+        for (int i = 0; !pending && i < inserted.count(); i++) {
+            // Otherwise, it was received during the previous sync.
+            pending = storedIncidenceHrefUri(inserted[i]).isEmpty()
+                || isCopiedDetachedIncidence(inserted[i]);
+        }
+        if (pending) {
+            qCDebug(lcCalDav) << "Not reconciling notebook with pending local changes:" << notebook->uid();
+            return CleanSyncDeferred;
+        }
+    }
+    notebook->setSyncDate(QDateTime());
+    notebook->setCustomProperty(CHECKPOINT_PROPERTY,
+                                QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    notebook->setCustomProperty(FULL_SYNC_PROPERTY, QString());
+    notebook->setCustomProperty(WINDOW_FROM_PROPERTY, QString());
+    notebook->setCustomProperty(WINDOW_TO_PROPERTY, QString());
+    notebook->setCustomProperty(PAST_REFRESH_PROPERTY, QString());
+    notebook->setCustomProperty(FUTURE_REFRESH_PROPERTY, QString());
+    return storage->updateNotebook(notebook) ? CleanSyncPrepared : CleanSyncDeferred;
+}
+
+bool NotebookSyncAgent::storeCheckpoint()
+{
+    mKCal::Notebook::Ptr notebook(mStorage->notebook(mNotebook->uid()));
+    if (!notebook) {
+        return false;
+    }
+    notebook->setCustomProperty(CHECKPOINT_PROPERTY, mNotebookSyncedDateTime.toString(Qt::ISODate));
+    if (!mStorage->updateNotebook(notebook)) {
+        qCWarning(lcCalDav) << "Cannot store the checkpoint of" << notebook->name() << "in storage.";
+        return false;
+    }
+    return true;
+}
+
+// Resumes an interrupted slow sync: the etags are listed first, and
+// only the resources not stored yet with the same etag are downloaded.
+// The stored ones not listed anymore are deleted at the end.
+void NotebookSyncAgent::loadCheckpoint()
+{
+    qCDebug(lcCalDav) << "Resuming the slow sync of" << mRemoteCalendarPath << "interrupted on"
+                      << mNotebook->customProperty(CHECKPOINT_PROPERTY);
+    mCheckpointETags.clear();
+    if (!loadLocalState(false)) {
+        return;
+    }
+    mCheckpointState = mLocalState;
+    mLocalState = LocalState();
+    for (const LocalIncidence &local : const_cast<const QVector<LocalIncidence>&>(mCheckpointState.incidences)) {
+        if (!local.href.isEmpty()) {
+            mCheckpointETags.insert(local.href, local.etag);
+        }
+    }
+    mTwoPhaseSlowSync = true;
+}
+
+void NotebookSyncAgent::findCheckpointDeletions()
+{
+    for (const LocalIncidence &local : const_cast<const QVector<LocalIncidence>&>(mCheckpointState.incidences)) {
+        if (!local.href.isEmpty() && !mListedHrefs.contains(local.href)
+            && incidenceWithin(local.incidence, mWindowFrom, mWindowTo)) {
+            qCDebug(lcCalDav) << "have remote deletion since the checkpoint:" << local.incidence->uid()
+                              << local.incidence->recurrenceId().toString();
+            mRemoteDeletions.append(local.incidence);
+        }
+    }
+    mCheckpointState = LocalState();
+    mCheckpointETags.clear();
+}
+
 void NotebookSyncAgent::fetchRemoteChanges()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
@@ -568,14 +1323,101 @@ void NotebookSyncAgent::fetchRemoteChanges()
     // must be m_syncMode = QuickSync.
     mPendingActions += 1;
     mDAV->getCalendarEtags(mRemoteCalendarPath, mFromDateTime, mToDateTime);
+    // Load the local incidences while the server answers. This is done
+    // from the event loop, once the request has actually been started.
+    mLocalState = LocalState();
+    mLocalState.requested = true;
+    QTimer::singleShot(0, this, &NotebookSyncAgent::prefetchLocalState);
 }
 
-NotebookSyncAgent::CalendarResource::CalendarResource(const Buteo::Dav::Resource &dav)
-    : href(dav.href), etag(dav.etag), incidences(parseICSData(dav.data))
+void NotebookSyncAgent::prefetchLocalState()
 {
+    // Nothing to do if the etags were already processed.
+    if (mLocalState.requested && !mLocalState.loaded) {
+        loadLocalState(!mReadOnlyFlag && mEnableUpsync);
+    }
 }
 
-void NotebookSyncAgent::reportRequestFinished(const Buteo::Dav::Client::Reply &reply,
+// Loads the local incidences of the notebook, with their stored href
+// and etag, and the local deletions when needed. The delta computation
+// then only matches them with the received etags.
+bool NotebookSyncAgent::loadLocalState(bool withDeletions)
+{
+    QElapsedTimer timer;
+    timer.start();
+    mLocalState = LocalState();
+    KCalendarCore::Incidence::List incidences;
+    if (!mStorage->allIncidences(&incidences, mNotebook->uid())) {
+        qCWarning(lcCalDav) << "Unable to load notebook incidences, aborting sync of notebook:" << mRemoteCalendarPath
+                            << ":" << mNotebook->uid();
+        return false;
+    }
+    if (withDeletions && !mStorage->deletedIncidences(&mLocalState.deletions, QDateTime(), mNotebook->uid())) {
+        qCWarning(lcCalDav) << "mKCal::ExtendedStorage::deletedIncidences() failed";
+        return false;
+    }
+    mLocalState.incidences.reserve(incidences.count());
+    for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(incidences)) {
+        const LocalIncidence local = {incidence, storedIncidenceHrefUri(incidence), incidenceETag(incidence)};
+        mLocalState.incidences.append(local);
+    }
+    mLocalState.loaded = true;
+    mLocalState.withDeletions = withDeletions;
+    qCDebug(lcCalDav) << "Loaded" << incidences.count() << "local incidences in" << timer.elapsed()
+                      << "ms for" << mRemoteCalendarPath;
+    return true;
+}
+
+NotebookSyncAgent::CalendarResource::CalendarResource(const Buteo::Dav::Resource &dav, IcsParser *parser)
+    : href(dav.href), etag(dav.etag)
+    , incidences(parser ? parser->parse(dav.data) : IcsParser().parse(dav.data))
+{
+    // Hash the content as it would be uploaded back, so a later upload
+    // of the same content can be detected.
+    if (!incidences.isEmpty()) {
+        KCalendarCore::Incidence::Ptr base = incidences.first();
+        KCalendarCore::Incidence::List instances;
+        for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(incidences)) {
+            if (!incidence->hasRecurrenceId()) {
+                base = incidence;
+            }
+        }
+        for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(incidences)) {
+            if (incidence != base) {
+                instances.append(incidence);
+            }
+        }
+        hash = IncidenceHandler::contentHash(IncidenceHandler::toIcs(base, instances));
+    }
+}
+
+void NotebookSyncAgent::parseResources(const QList<Buteo::Dav::Resource> &resources)
+{
+    // ICS parsing is done in the global thread pool, the parsed
+    // resources are given back to this agent in parsingFinished().
+    // The parsing job is tracked as any other pending action.
+    QFutureWatcher<CalendarResource> *watcher = new QFutureWatcher<CalendarResource>(this);
+    connect(watcher, &QFutureWatcherBase::finished, this, &NotebookSyncAgent::parsingFinished);
+    mPendingActions += 1;
+    mParsingJobs.append(watcher);
+    watcher->setFuture(QtConcurrent::mapped(resources, ResourceParser(mIcsParser)));
+}
+
+void NotebookSyncAgent::parsingFinished()
+{
+    // Parsing jobs may finish in any order, but received resources
+    // are appended in the order of the replies, so the result of
+    // applying them stays deterministic.
+    while (!mParsingJobs.isEmpty() && mParsingJobs.first()->isFinished()) {
+        QFutureWatcher<CalendarResource> *watcher = mParsingJobs.takeFirst();
+        mReceivedCalendarResources += watcher->future().results();
+        watcher->deleteLater();
+        requestFinished();
+    }
+}
+
+void NotebookSyncAgent::reportRequestFinished(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                                              const QStringList &hrefs,
                                               const QList<Buteo::Dav::Resource> &resources)
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
@@ -585,22 +1427,14 @@ void NotebookSyncAgent::reportRequestFinished(const Buteo::Dav::Client::Reply &r
 
     qCDebug(lcCalDav) << "report request finished with result:" << reply.hasError() << reply.errorMessage;
 
+    const bool sentResources = !hrefs.isEmpty() && hrefs == mSentResourcesRequest;
+    if (mSyncMode == SlowSync && !hrefs.isEmpty()) {
+        multigetFinished(reply, statusCode, hrefs, resources);
+        return;
+    }
+
     if (!reply.hasError()) {
-        // NOTE: we don't store the remote artifacts yet
-        // Instead, we just emit finished (for this notebook)
-        // Once ALL notebooks are finished, then we apply the remote changes.
-        // This prevents the worst partial-sync issues.
-        for (const Buteo::Dav::Resource &resource : resources) {
-            if (!resource.data.isEmpty()) {
-                mReceivedCalendarResources.append(CalendarResource(resource));
-                if (mSentUids.contains(resource.href) && resource.etag.isEmpty()) {
-                    // Asked for a resource etag but didn't get it.
-                    mFailingUploads.insert(resource.href, QByteArray("Unable to retrieve etag."));
-                }
-            }
-        }
-        qCDebug(lcCalDav) << "Report request finished: received:"
-                  << resources.length() << "iCal blobs";
+        receiveResources(resources);
     } else if (mSyncMode == SlowSync
                && reply.networkError == QNetworkReply::AuthenticationRequiredError
                && !mRetriedReport) {
@@ -608,6 +1442,10 @@ void NotebookSyncAgent::reportRequestFinished(const Buteo::Dav::Client::Reply &r
         qCWarning(lcCalDav) << "Retrying REPORT after request failed with QNetworkReply::AuthenticationRequiredError";
         mRetriedReport = true;
         sendReportRequest();
+    } else if (mSyncMode == SlowSync && isServerOverloaded(reply, statusCode)) {
+        qCWarning(lcCalDav) << "Server overloaded downloading" << mRemoteCalendarPath
+                            << "at once, listing the etags first.";
+        fetchInTwoPhases(mFromDateTime, mToDateTime);
     } else if (mSyncMode == SlowSync
                && reply.networkError == QNetworkReply::ContentNotFoundError) {
         // The remote calendar resource was removed after we created the account but before first sync.
@@ -619,34 +1457,96 @@ void NotebookSyncAgent::reportRequestFinished(const Buteo::Dav::Client::Reply &r
     } else if (mSyncMode == SlowSync) {
         setFatal(reply.uri, reply.errorData);
         return;
-    } else {
+    } else if (sentResources) {
         for (const QString &href : mSentUids.keys()) {
             mFailingUpdates.insert(href, reply.errorData);
         }
+    } else {
+        // Don't consider the window as synced, the missing
+        // parts will be downloaded again on next sync.
+        mWindowFetched = false;
     }
 
-    mSentUids.clear();
+    if (sentResources) {
+        // Other reports, for remote changes or window slices,
+        // may finish while uploads are still in flight.
+        mSentResourcesRequest.clear();
+        mSentUids.clear();
+    }
     requestFinished();
 }
 
-void NotebookSyncAgent::processETags(const Buteo::Dav::Client::Reply &reply, const QHash<QString, QString> &etags)
+void NotebookSyncAgent::receiveResources(const QList<Buteo::Dav::Resource> &resources)
+{
+    // NOTE: we don't store the remote artifacts yet
+    // Instead, we just emit finished (for this notebook)
+    // Once ALL notebooks are finished, then we apply the remote changes.
+    // This prevents the worst partial-sync issues.
+    QList<Buteo::Dav::Resource> parsedResources;
+    for (const Buteo::Dav::Resource &resource : resources) {
+        if (!resource.data.isEmpty()) {
+            if (mStaging.keepInMemory(resource) || !mStaging.stage(resource)) {
+                parsedResources.append(resource);
+            }
+            if (mSentUids.contains(resource.href) && resource.etag.isEmpty()) {
+                // Asked for a resource etag but didn't get it.
+                mFailingUploads.insert(resource.href, QByteArray("Unable to retrieve etag."));
+            }
+        }
+    }
+    if (!parsedResources.isEmpty()) {
+        parseResources(parsedResources);
+    }
+    qCDebug(lcCalDav) << "Report request finished: received:"
+              << resources.length() << "iCal blobs";
+}
+
+void NotebookSyncAgent::processETags(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                                     const QStringList &hrefs, const QHash<QString, QString> &etags)
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
     if (reply.uri != mRemoteCalendarPath)
         return;
 
+    if (!hrefs.isEmpty()) {
+        // Etags of given resources, see requestETags().
+        for (int i = 0; i < mETagRequests.count(); i++) {
+            if (mETagRequests[i].first == hrefs) {
+                if (mETagRequests.takeAt(i).second == SentETags) {
+                    // The delta was computed before sending any local change.
+                    sentETagsReceived(reply, hrefs, etags);
+                } else {
+                    conflictETagsReceived(reply, hrefs, etags);
+                }
+                return;
+            }
+        }
+        qCWarning(lcCalDav) << "Ignoring unexpected etags of" << hrefs.count()
+                            << "resources of" << mRemoteCalendarPath;
+        return;
+    }
+    if (mSyncMode == SlowSync) {
+        // Listing of a two-phase slow sync, see fetchInTwoPhases().
+        slowSyncETagsReceived(reply, statusCode, etags);
+        return;
+    }
+
     qCDebug(lcCalDav) << "fetch etags finished with result:" << reply.hasError() << reply.errorMessage;
 
     if (!reply.hasError()) {
         qCDebug(lcCalDav) << "Process tags for server path" << reply.uri;
-        // calculate the local and remote delta.
-        if (!calculateDelta(etags,
-                            &mLocalAdditions,
-                            &mLocalModifications,
-                            &mLocalDeletions,
-                            &mRemoteChanges,
-                            &mRemoteDeletions)) {
+        // calculate the local and remote delta, local changes
+        // are not needed when they cannot be sent.
+        const bool downloadOnly = mReadOnlyFlag || !mEnableUpsync;
+        if (!(downloadOnly
+              ? calculateRemoteDelta(etags, &mRemoteChanges, &mRemoteDeletions)
+              : calculateDelta(etags,
+                               &mLocalAdditions,
+                               &mLocalModifications,
+                               &mLocalDeletions,
+                               &mRemoteChanges,
+                               &mRemoteDeletions))) {
             qCWarning(lcCalDav) << "unable to calculate the sync delta for:" << mRemoteCalendarPath;
             setFatal(reply.uri, "Unable to calculate the sync delta.");
             return;
@@ -678,11 +1578,35 @@ void NotebookSyncAgent::processETags(const Buteo::Dav::Client::Reply &reply, con
     requestFinished();
 }
 
+void NotebookSyncAgent::sentETagsReceived(const Buteo::Dav::Client::Reply &reply,
+                                          const QStringList &hrefs,
+                                          const QHash<QString, QString> &etags)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    qCDebug(lcCalDav) << "fetch etags of sent resources finished with result:" << reply.hasError() << reply.errorMessage;
+
+    for (const QString &href : hrefs) {
+        const QString uid = mSentUids.take(href);
+        if (reply.hasError()) {
+            mFailingUpdates.insert(href, reply.errorData);
+        } else if (etags.value(href).isEmpty()) {
+            // Asked for a resource etag but didn't get it.
+            mFailingUploads.insert(href, QByteArray("Unable to retrieve etag."));
+        } else {
+            updateHrefETag(uid, href, etags.value(href), mSentHashes.value(href));
+        }
+    }
+
+    requestFinished();
+}
+
 void NotebookSyncAgent::sendLocalChanges()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
     mFailingUploads.clear();
+    mPermanentUploadFailures.clear();
 
     if (!mLocalAdditions.count() && !mLocalModifications.count() && !mLocalDeletions.count()) {
         // no local changes to upsync.
@@ -706,9 +1630,11 @@ void NotebookSyncAgent::sendLocalChanges()
     // Hence, we first need to find out if any deletion is a lone-persistent-exception deletion.
     QMultiHash<QString, QDateTime> uidToRecurrenceIdDeletions;
     QHash<QString, QString> uidToUri;  // we cannot look up custom properties of deleted incidences, so cache them here.
+    QHash<QString, QString> uidToETag;
     for (KCalendarCore::Incidence::Ptr localDeletion : const_cast<const KCalendarCore::Incidence::List&>(mLocalDeletions)) {
         uidToRecurrenceIdDeletions.insert(localDeletion->uid(), localDeletion->recurrenceId());
         uidToUri.insert(localDeletion->uid(), storedIncidenceHrefUri(localDeletion));
+        uidToETag.insert(localDeletion->uid(), incidenceETag(localDeletion));
     }
 
     // now send DELETEs as required, and PUTs as required.
@@ -730,24 +1656,26 @@ void NotebookSyncAgent::sendLocalChanges()
         // the whole series is being deleted; can DELETE.
         const QString remoteUri = uidToUri.value(uid);
         qCDebug(lcCalDav) << "deleting whole series:" << remoteUri << "with uid:" << uid;
-        mDAV->deleteResource(remoteUri);
-        mPendingActions += 1;
+        queueDeletion(remoteUri, uidToETag.value(uid));
     }
     // Incidence will be actually purged only if all operations succeed.
     mPurgeList += mLocalDeletions;
 
     mSentUids.clear();
+    mSentHashes.clear();
+    mSkippedUploads.clear();
     KCalendarCore::Incidence::List toUpload(mLocalAdditions + mLocalModifications);
     for (int i = 0; i < toUpload.count(); i++) {
         QString href = storedIncidenceHrefUri(toUpload[i]);
         if (href.isEmpty())
             href = createIncidenceHrefUri(toUpload[i], mRemoteCalendarPath);
-        if (mSentUids.contains(href)) {
+        if (mSentUids.contains(href) || mSkippedUploads.contains(href)) {
             qCDebug(lcCalDav) << "Already handled upload" << i << "via series update";
             continue; // already handled this one, as a result of a previous update of another occurrence in the series.
         }
         QString etag = incidenceETag(toUpload[i]);
-        QString icsData;
+        QString storedHash = incidenceContentHash(toUpload[i]);
+        QByteArray icsData;
         if (toUpload[i]->recurs() || toUpload[i]->hasRecurrenceId()) {
             if (mStorage->load(toUpload[i]->uid())) {
                 KCalendarCore::Incidence::Ptr recurringIncidence(toUpload[i]->recurs()
@@ -755,11 +1683,13 @@ void NotebookSyncAgent::sendLocalChanges()
                                                                  : mCalendar->incidence(toUpload[i]->uid()));
                 if (recurringIncidence) {
                     etag = incidenceETag(recurringIncidence);
+                    storedHash = incidenceContentHash(recurringIncidence);
                     icsData = IncidenceHandler::toIcs(recurringIncidence,
                                                       mCalendar->instances(recurringIncidence));
                 } else {
                     qCWarning(lcCalDav) << "Cannot find parent of " << toUpload[i]->uid() << "for upload of series.";
                     mFailingUploads.insert(href, "This is an exception occurrence without recurring parent.");
+                    mPermanentUploadFailures.insert(href);
                     continue;
                 }
             } else {
@@ -770,40 +1700,235 @@ void NotebookSyncAgent::sendLocalChanges()
         } else {
             icsData = IncidenceHandler::toIcs(toUpload[i]);
         }
-        if (icsData.isEmpty()) {
-            qCDebug(lcCalDav) << "Skipping upload of broken incidence:" << i << ":" << toUpload[i]->uid();
-            mFailingUploads.insert(href, QByteArray("Cannot generate ICS data."));
+        if (icsData.isEmpty()) {
+            qCDebug(lcCalDav) << "Skipping upload of broken incidence:" << i << ":" << toUpload[i]->uid();
+            mFailingUploads.insert(href, QByteArray("Cannot generate ICS data."));
+            mPermanentUploadFailures.insert(href);
+            continue;
+        }
+        const QString hash = IncidenceHandler::contentHash(icsData);
+        if (!etag.isEmpty() && hash == storedHash) {
+            // Only the modification date or some volatile data were changed,
+            // the server already holds this content.
+            qCDebug(lcCalDav) << "Skipping upload of unchanged incidence:" << i << ":" << toUpload[i]->uid();
+            mSkippedUploads.insert(href);
+            mSkippedUploadCount += 1;
+        } else {
+            qCDebug(lcCalDav) << "Uploading incidence" << i << "via PUT for uid:" << toUpload[i]->uid();
+            queueUpload(href, icsData, etag);
+            mSentUids.insert(href, toUpload[i]->uid());
+            mSentHashes.insert(href, hash);
+        }
+    }
+    if (!mSkippedUploads.isEmpty()) {
+        qCDebug(lcCalDav) << "Skipped" << mSkippedUploads.count() << "uploads of unchanged content for" << mRemoteCalendarPath;
+    }
+
+    sendUploads();
+}
+
+// Uploads are queued and sent a few at a time, so a large number of
+// local changes doesn't flood the connections to the server.
+// Each queued upload counts as a pending action until its final reply.
+void NotebookSyncAgent::queueUpload(const QString &href, const QByteArray &data, const QString &etag)
+{
+    const Upload upload = {href, data, etag, false, 0};
+    mUploadQueue.append(upload);
+    mPendingActions += 1;
+}
+
+void NotebookSyncAgent::queueDeletion(const QString &href, const QString &etag)
+{
+    const Upload upload = {href, QByteArray(), etag, true, 0};
+    mUploadQueue.append(upload);
+    mPendingActions += 1;
+}
+
+void NotebookSyncAgent::sendUploads()
+{
+    if (!mUploadTimer.isValid()) {
+        mUploadTimer.start();
+    }
+    // Uploads are sent in the order of the queue, but an upload is
+    // not sent while another one for the same href waits for its reply.
+    QList<Upload>::Iterator it = mUploadQueue.begin();
+    while (mSendingUploads.count() < mUploadWindow && it != mUploadQueue.end()) {
+        if (mSendingUploads.contains(it->href)) {
+            ++it;
+            continue;
+        }
+        Upload upload = *it;
+        it = mUploadQueue.erase(it);
+        upload.attempts += 1;
+        mSendingUploads.insert(upload.href, upload);
+        if (upload.deletion) {
+            mDAV->deleteResource(upload.href, upload.etag);
+        } else {
+            mDAV->sendCalendarResource(upload.href, upload.data, upload.etag);
+        }
+    }
+}
+
+// Returns true when the upload failed and will be tried again.
+bool NotebookSyncAgent::uploadFinished(const Buteo::Dav::Client::Reply &reply, int statusCode)
+{
+    QHash<QString, Upload>::Iterator it = mSendingUploads.find(reply.uri);
+    if (it == mSendingUploads.end()) {
+        return false;
+    }
+    const Upload upload = it.value();
+    mSendingUploads.erase(it);
+
+    if (reply.hasError() && isTransientError(reply.networkError)
+        && upload.attempts < MAX_UPLOAD_ATTEMPTS) {
+        const int delay = UPLOAD_RETRY_DELAY << (upload.attempts - 1);
+        qCWarning(lcCalDav) << "Upload of" << upload.href << "failed with" << reply.networkError
+                            << ", retrying in" << delay << "ms.";
+        mRetryingUploads += 1;
+        QTimer::singleShot(delay, this, [this, upload] () {
+            mRetryingUploads -= 1;
+            mUploadQueue.prepend(upload);
+            sendUploads();
+        });
+        sendUploads();
+        return true;
+    }
+
+    if (reply.hasError() && statusCode == 412 && mSyncMode == PushSync && mEnableDownsync) {
+        // The server copy changed since the last sync, the local
+        // changes cannot be pushed alone, see requestFinished().
+        mPushFallback = true;
+    } else if (reply.hasError() && statusCode == 412
+               && !mResolvedConflicts.contains(upload.href)) {
+        // The server copy changed since the last sync, see resolveConflicts().
+        mConflicts[upload.href].upload = upload;
+    }
+    if (!reply.hasError()) {
+        mUploadedCount += 1;
+        mUploadedBytes += upload.data.size();
+    }
+    sendUploads();
+    if (mSendingUploads.isEmpty() && mUploadQueue.isEmpty() && !mRetryingUploads) {
+        const qint64 elapsed = qMax(qint64(1), mUploadTimer.elapsed());
+        qCDebug(lcCalDav) << "Uploaded" << mUploadedCount << "resources," << mUploadedBytes / 1024
+                          << "KiB, in" << elapsed << "ms:" << mUploadedCount * 1000 / elapsed
+                          << "resources/s for" << mRemoteCalendarPath;
+    }
+    return false;
+}
+
+// Uploads rejected with 412 Precondition Failed were modified on the
+// server since the last sync. They are resolved within the same sync,
+// once all other uploads are done, following the conflict resolution
+// policy of the profile: either the server copy is downloaded over the
+// local one, or the local one is sent again over the server copy.
+// Without down sync, the server copy is kept and the local change is
+// not sent.
+void NotebookSyncAgent::resolveConflicts()
+{
+    const QStringList hrefs = mConflicts.keys();
+    for (const QString &href : hrefs) {
+        mResolvedConflicts.insert(href);
+    }
+    if (mConflictPolicy == Buteo::SyncProfile::CR_PREFER_LOCAL_CHANGES) {
+        qCDebug(lcCalDav) << "Overwriting" << hrefs.count() << "conflicting resources for" << mRemoteCalendarPath;
+        requestETags(hrefs, ConflictETags);
+    } else if (!mEnableDownsync) {
+        qCDebug(lcCalDav) << "Dropping" << hrefs.count() << "local changes conflicting with the server for"
+                          << mRemoteCalendarPath;
+        mConflicts.clear();
+        for (const QString &href : hrefs) {
+            mSkippedUploads.insert(href);
+        }
+    } else {
+        qCDebug(lcCalDav) << "Downloading" << hrefs.count() << "conflicting resources for" << mRemoteCalendarPath;
+        mConflicts.clear();
+        for (const QString &href : hrefs) {
+            mRemoteChanges.insert(href);
+        }
+        sendReportRequest(hrefs);
+    }
+}
+
+// Etags of given resources are requested for different purposes, and
+// several requests may be pending at once, while the etags of the sync
+// window are listed. Each reply is dispatched on the hrefs it was
+// asked for, see processETags().
+void NotebookSyncAgent::requestETags(const QStringList &hrefs, ETagRequest purpose)
+{
+    mETagRequests.append(qMakePair(hrefs, purpose));
+    mPendingActions += 1;
+    mDAV->getCalendarEtags(mRemoteCalendarPath, hrefs);
+}
+
+void NotebookSyncAgent::conflictETagsReceived(const Buteo::Dav::Client::Reply &reply,
+                                              const QStringList &hrefs,
+                                              const QHash<QString, QString> &etags)
+{
+    for (const QString &href : hrefs) {
+        const Conflict conflict = mConflicts.take(href);
+        if (reply.hasError()) {
+            mFailingUploads.insert(href, reply.errorData);
+        } else if (conflict.upload.deletion) {
+            // A missing etag means that the server copy was
+            // deleted already, there is nothing more to do.
+            if (!etags.value(href).isEmpty()) {
+                queueDeletion(href, etags.value(href));
+            }
         } else {
-            qCDebug(lcCalDav) << "Uploading incidence" << i << "via PUT for uid:" << toUpload[i]->uid();
-            mDAV->sendCalendarResource(href, icsData, etag);
-            mPendingActions += 1;
-            mSentUids.insert(href, toUpload[i]->uid());
+            // A missing etag means that the server copy was deleted,
+            // the upload then creates it again.
+            mSentUids.insert(href, conflict.uid);
+            queueUpload(href, conflict.upload.data, etags.value(href));
         }
     }
+    sendUploads();
+    requestFinished();
 }
 
-void NotebookSyncAgent::resourceSent(const Buteo::Dav::Client::Reply &reply, const QString &etag)
+void NotebookSyncAgent::resourceSent(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                                     const QString &etag)
 {
     if (mSentUids.contains(reply.uri)) {
-        if (reply.hasError()) {
+        if (uploadFinished(reply, statusCode)) {
+            return;
+        }
+        if (reply.hasError() && mConflicts.contains(reply.uri)) {
+            qCDebug(lcCalDav) << "Upload of" << reply.uri << "conflicts with a modified server copy.";
+            mConflicts[reply.uri].uid = mSentUids.take(reply.uri);
+        } else if (reply.hasError()) {
             mFailingUploads.insert(reply.uri, reply.errorData);
+            if (isPermanentUploadError(statusCode)) {
+                mPermanentUploadFailures.insert(reply.uri);
+            }
             // Don't try to get etag later for a failed upload.
             mSentUids.remove(reply.uri);
         } else if (!etag.isEmpty()) {
             // Apply Etag and Href changes immediately since incidences are now
             // for sure on server.
-            updateHrefETag(mSentUids.take(reply.uri), reply.uri, etag);
+            updateHrefETag(mSentUids.take(reply.uri), reply.uri, etag, mSentHashes.value(reply.uri));
         }
 
         requestFinished();
     }
 }
 
-void NotebookSyncAgent::resourceDeleted(const Buteo::Dav::Client::Reply &reply)
+void NotebookSyncAgent::resourceDeleted(const Buteo::Dav::Client::Reply &reply, int statusCode)
 {
     if (reply.uri.startsWith(mRemoteCalendarPath)) {
-        if (reply.hasError()) {
+        if (uploadFinished(reply, statusCode)) {
+            return;
+        }
+        if (reply.hasError() && mConflicts.contains(reply.uri)) {
+            // The incidence stays in the purge list: either the deletion
+            // is sent again, or the server copy is downloaded over it,
+            // as in calculateDelta().
+            qCDebug(lcCalDav) << "Deletion of" << reply.uri << "conflicts with a modified server copy.";
+        } else if (reply.hasError()) {
             mFailingUploads.insert(reply.uri, reply.errorData);
+            if (isPermanentUploadError(statusCode)) {
+                mPermanentUploadFailures.insert(reply.uri);
+            }
             // Don't purge yet the locally deleted incidence.
             KCalendarCore::Incidence::List::Iterator it = mPurgeList.begin();
             while (it != mPurgeList.end()) {
@@ -856,46 +1981,205 @@ bool NotebookSyncAgent::applyRemoteChanges()
         return mNotebookNeedsDeletion;
     }
 
-    // If current notebook is not already in storage, we add it.
-    if (!notebook) {
-        if (!mStorage->addNotebook(mNotebook)) {
-            qCDebug(lcCalDav) << "Unable to (re)create notebook" << mNotebook->name()
-                              << "for account" << mNotebook->account() << ":" << mRemoteCalendarPath;
-            return false;
-        }
-        notebook = mNotebook;
+    if (!ensureNotebook()) {
+        return false;
     }
 
-    bool success = true;
-    if ((mEnableDownsync || mSyncMode == SlowSync)
-        && !updateIncidences(mReceivedCalendarResources)) {
-        success = false;
+    bool success = !mChunkCommitFailed;
+    if (mEnableDownsync || mSyncMode == SlowSync) {
+        mRemoteAdditions.clear();
+        mRemoteModifications.clear();
+        if (!updateIncidences(mReceivedCalendarResources)) {
+            success = false;
+        }
+        if (!applyStagedResources()) {
+            success = false;
+        }
+        qCDebug(lcCalDav) << "Time zone definitions cached:" << mIcsParser->timeZoneCount()
+                          << ", skipped while parsing:" << mIcsParser->skippedTimeZoneCount();
     }
     if (mEnableDownsync && !deleteIncidences(mRemoteDeletions)) {
         success = false;
     }
+    // Purged with the other deletions, without being seen as
+    // local deletions by the next sync.
+    if (!deleteIncidences(mEvictions)) {
+        success = false;
+    }
+    if (mCommitStrategy == CommitPerAccount) {
+        // Storage will be saved by the caller, with the changes
+        // of the other notebooks, before calling storeNotebook().
+        return success;
+    }
     // Update storage, before possibly changing readOnly flag for this notebook.
-    if (!mStorage->save(mKCal::ExtendedStorage::PurgeDeleted)) {
+    if (!saveChanges()) {
         success = false;
     }
+    if (!storeNotebook()) {
+        success = false;
+    }
+
+    return success;
+}
+
+// If current notebook is not already in storage, we add it.
+bool NotebookSyncAgent::ensureNotebook()
+{
+    if (!mStorage->notebook(mNotebook->uid())
+        && !mStorage->addNotebook(mNotebook)) {
+        qCDebug(lcCalDav) << "Unable to (re)create notebook" << mNotebook->name()
+                          << "for account" << mNotebook->account() << ":" << mRemoteCalendarPath;
+        return false;
+    }
+    return true;
+}
+
+bool NotebookSyncAgent::storeNotebook()
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    if (!mNotebook) {
+        qCDebug(lcCalDav) << "Missing notebook in store.";
+        return false;
+    }
+    mKCal::Notebook::Ptr notebook(mStorage->notebook(mNotebook->uid()));
+    if (!notebook) {
+        qCWarning(lcCalDav) << "Cannot find notebook" << mNotebook->name() << "in storage.";
+        return false;
+    }
+
     if (!mPurgeList.isEmpty() && !mStorage->purgeDeletedIncidences(mPurgeList,
                                                                    notebook->uid())) {
         // Silently ignore failed purge action in database.
         qCWarning(lcCalDav) << "Cannot purge from database the marked as deleted incidences.";
     }
 
+    // Only the slow and quick syncs list the server etags.
+    const bool listed = mSyncMode == SlowSync || mSyncMode == QuickSync;
+    // A sync that exchanged nothing keeps the previous sync date,
+    // which still delimits the local changes to look for.
+    const bool exchangedChanges = mSyncMode == SlowSync
+        || !mLocalAdditions.isEmpty() || !mLocalModifications.isEmpty() || !mLocalDeletions.isEmpty()
+        || !mRemoteChanges.isEmpty() || !mRemoteDeletions.isEmpty() || !mPurgeList.isEmpty();
+    // The synced window, see fetchWindowChanges().
+    const QDateTime syncedFrom = QDateTime::fromString(notebook->customProperty(WINDOW_FROM_PROPERTY),
+                                                       Qt::ISODate);
+    const QDateTime syncedTo = QDateTime::fromString(notebook->customProperty(WINDOW_TO_PROPERTY),
+                                                     Qt::ISODate);
+    const QDateTime windowFrom = mWindowFetched ? mWindowFrom
+        : mPastTierFrom.isValid() ? mPastTierFrom : mFromDateTime;
+    const QDateTime windowTo = mWindowFetched ? mWindowTo
+        : mFutureTierTo.isValid() ? mFutureTierTo : mToDateTime;
+    const bool windowMoved = listed
+        && (!syncedFrom.isValid() || !syncedTo.isValid()
+            || qAbs(syncedFrom.secsTo(windowFrom)) >= WINDOW_MOVE_THRESHOLD
+            || qAbs(syncedTo.secsTo(windowTo)) >= WINDOW_MOVE_THRESHOLD);
+    // Push syncs are allowed for some time after a sync listing the server etags.
+    const QString fullSyncDate = (mPushWindow > 0 && listed)
+        ? mNotebookSyncedDateTime.toString(Qt::ISODate)
+        : notebook->customProperty(FULL_SYNC_PROPERTY);
+    // The last listing of the tiers with a refresh interval, see fetchWindowChanges().
+    const QString pastRefreshDate = (mPastRefreshInterval > 0 && listed
+                                     && !mPastTierFrom.isValid())
+        ? mNotebookSyncedDateTime.toString(Qt::ISODate)
+        : notebook->customProperty(PAST_REFRESH_PROPERTY);
+    const QString futureRefreshDate = (mFutureRefreshInterval > 0 && listed
+                                       && !mFutureTierTo.isValid())
+        ? mNotebookSyncedDateTime.toString(Qt::ISODate)
+        : notebook->customProperty(FUTURE_REFRESH_PROPERTY);
+    // The change rate is measured by the syncs listing the etags.
+    QString changeRate = notebook->customProperty(CHANGE_RATE_PROPERTY);
+    QString listingDate = notebook->customProperty(LISTING_DATE_PROPERTY);
+    if (mMaxStaleness > 0 && listed) {
+        bool valid = false;
+        double rate = changeRate.toDouble(&valid);
+        if (mSyncMode == SlowSync || !valid) {
+            // Not skipped until some listings were done.
+            rate = LOW_CHANGE_RATE;
+        } else {
+            // Conflicts and partial uploads are downloaded, but they
+            // were not changed server side since the last listing.
+            rate = CHANGE_RATE_WEIGHT * mRemotelyChanged.count() + (1. - CHANGE_RATE_WEIGHT) * rate;
+        }
+        changeRate = QString::number(rate, 'g', 3);
+        listingDate = mNotebookSyncedDateTime.toString(Qt::ISODate);
+    }
+    // Updating the notebook notifies all the storage users, don't do it for nothing.
+    if (!mNotebookModified
+        && (!exchangedChanges || notebook->syncDate() == mNotebookSyncedDateTime)
+        && notebook->customProperty(FULL_SYNC_PROPERTY) == fullSyncDate
+        && notebook->customProperty(PAST_REFRESH_PROPERTY) == pastRefreshDate
+        && notebook->customProperty(FUTURE_REFRESH_PROPERTY) == futureRefreshDate
+        && notebook->customProperty(CHANGE_RATE_PROPERTY) == changeRate
+        && notebook->customProperty(LISTING_DATE_PROPERTY) == listingDate
+        && !windowMoved
+        && notebook->isReadOnly() == mReadOnlyFlag
+        && notebook->name() == mNotebook->name()
+        && notebook->description() == mNotebook->description()
+        && notebook->color() == mNotebook->color()
+        && notebook->syncProfile() == mNotebook->syncProfile()
+        && notebook->customProperty(PATH_PROPERTY) == mRemoteCalendarPath) {
+        qCDebug(lcCalDav) << "Notebook" << notebook->uid() << "is unchanged.";
+        return true;
+    }
+
     notebook->setIsReadOnly(mReadOnlyFlag);
-    notebook->setSyncDate(mNotebookSyncedDateTime);
+    if (exchangedChanges) {
+        notebook->setSyncDate(mNotebookSyncedDateTime);
+    }
     notebook->setName(mNotebook->name());
     notebook->setDescription(mNotebook->description());
     notebook->setColor(mNotebook->color());
     notebook->setSyncProfile(mNotebook->syncProfile());
     notebook->setCustomProperty(PATH_PROPERTY, mRemoteCalendarPath);
+    notebook->setCustomProperty(FULL_SYNC_PROPERTY, fullSyncDate);
+    notebook->setCustomProperty(PAST_REFRESH_PROPERTY, pastRefreshDate);
+    notebook->setCustomProperty(FUTURE_REFRESH_PROPERTY, futureRefreshDate);
+    notebook->setCustomProperty(CHANGE_RATE_PROPERTY, changeRate);
+    notebook->setCustomProperty(LISTING_DATE_PROPERTY, listingDate);
+    if (mSyncMode == SlowSync) {
+        notebook->setCustomProperty(CHECKPOINT_PROPERTY, QString());
+    }
+    if (listed) {
+        notebook->setCustomProperty(WINDOW_FROM_PROPERTY, windowFrom.toString(Qt::ISODate));
+        notebook->setCustomProperty(WINDOW_TO_PROPERTY, windowTo.toString(Qt::ISODate));
+    }
     if (!mStorage->updateNotebook(notebook)) {
         qCWarning(lcCalDav) << "Cannot update notebook" << notebook->name() << "in storage.";
-        success = false;
+        return false;
+    }
+    mNotebookModified = false;
+
+    return true;
+}
+
+bool NotebookSyncAgent::saveChanges()
+{
+    QElapsedTimer timer;
+    timer.start();
+    const bool success = mStorage->save(mKCal::ExtendedStorage::PurgeDeleted);
+    mCommitCount += 1;
+    mCommitDuration += timer.elapsed();
+    mUncommittedChanges = 0;
+    if (!success) {
+        qCWarning(lcCalDav) << "Cannot save changes of notebook" << mNotebook->name() << "in storage.";
+        mCommitFailed = true;
     }
+    return success;
+}
 
+// In batch mode, save storage before writing the given number
+// of incidences would exceed the batch size.
+bool NotebookSyncAgent::commitBatch(int changes)
+{
+    if (mCommitStrategy != CommitPerBatch || mCommitBatchSize <= 0) {
+        return true;
+    }
+    bool success = true;
+    if (mUncommittedChanges > 0 && mUncommittedChanges + changes > mCommitBatchSize) {
+        success = saveChanges();
+    }
+    mUncommittedChanges += changes;
     return success;
 }
 
@@ -910,24 +2194,39 @@ Buteo::TargetResults NotebookSyncAgent::result() const
                 count += it->incidences.count();
             }
         }
+        // The committed chunks were saved before the failing commit.
+        count = mCommitFailed ? mChunkIncidenceCount
+            : count + mStagedIncidenceCount + mChunkIncidenceCount;
         return Buteo::TargetResults(mNotebook->name().toHtmlEscaped(),
                                     Buteo::ItemCounts(count, 0, 0),
                                     Buteo::ItemCounts());
     } else {
         Buteo::TargetResults results(mNotebook->name().toHtmlEscaped());
 
+        QHash<QString, QByteArray> failingUpdates = mFailingUpdates;
+        if (mCommitFailed) {
+            const KCalendarCore::Incidence::List updates = mRemoteAdditions + mRemoteDeletions + mRemoteModifications;
+            for (const KCalendarCore::Incidence::Ptr &incidence : updates) {
+                failingUpdates.insert(storedIncidenceHrefUri(incidence), QByteArray("Cannot save changes in storage."));
+            }
+        }
         summarizeResults(&results, LOCAL, Buteo::TargetResults::ITEM_ADDED,
-                         mFailingUpdates, mRemoteAdditions);
+                         failingUpdates, mRemoteAdditions);
         summarizeResults(&results, LOCAL, Buteo::TargetResults::ITEM_DELETED,
-                         mFailingUpdates, mRemoteDeletions);
+                         failingUpdates, mRemoteDeletions);
         summarizeResults(&results, LOCAL, Buteo::TargetResults::ITEM_MODIFIED,
-                         mFailingUpdates, mRemoteModifications);
+                         failingUpdates, mRemoteModifications);
         summarizeResults(&results, REMOTE, Buteo::TargetResults::ITEM_ADDED,
-                         mFailingUploads, mLocalAdditions, mRemoteCalendarPath);
+                         mFailingUploads, withoutHrefs(mLocalAdditions, mSkippedUploads,
+                                                       mRemoteCalendarPath),
+                         mRemoteCalendarPath);
         summarizeResults(&results, REMOTE, Buteo::TargetResults::ITEM_DELETED,
-                         mFailingUploads, mLocalDeletions);
+                         mFailingUploads, withoutHrefs(mLocalDeletions, mSkippedUploads,
+                                                       mRemoteCalendarPath));
+        // Unchanged content or dropped conflicts were not sent.
         summarizeResults(&results, REMOTE, Buteo::TargetResults::ITEM_MODIFIED,
-                         mFailingUploads, mLocalModifications);
+                         mFailingUploads, withoutHrefs(mLocalModifications, mSkippedUploads,
+                                                       mRemoteCalendarPath));
 
         return results;
     }
@@ -941,13 +2240,35 @@ void NotebookSyncAgent::requestFinished()
 
     if (!mPendingActions && !mSentUids.isEmpty()) {
         // Request for etags.
-        sendReportRequest(mSentUids.keys());
+        if (mFetchSentResources) {
+            mSentResourcesRequest = mSentUids.keys();
+            sendReportRequest(mSentResourcesRequest);
+        } else {
+            // The content is known already, don't download it again.
+            requestETags(mSentUids.keys(), SentETags);
+        }
+    }
+    if (!mPendingActions && mPushFallback) {
+        fallBackToQuickSync();
+    }
+    if (!mPendingActions && !mConflicts.isEmpty()) {
+        resolveConflicts();
+    }
+    if (!mPendingActions && !mSlowSyncChunks.isEmpty() && !mNotebookNeedsDeletion) {
+        commitChunk();
+        sendNextChunk();
+    }
+
+    if (!mPendingActions && mSyncMode == SlowSync && !mCheckpointETags.isEmpty()) {
+        findCheckpointDeletions();
     }
 
     if (!mPendingActions) {
         // Flag (or remove flag) for all failing (or not) local changes.
-        flagUploadFailure(mFailingUploads, loadAll(mStorage, mCalendar, mLocalAdditions), mRemoteCalendarPath);
-        flagUploadFailure(mFailingUploads, loadAll(mStorage, mCalendar, mLocalModifications));
+        flagUploadFailure(mFailingUploads, mPermanentUploadFailures,
+                          loadAll(mStorage, mCalendar, mLocalAdditions), mRemoteCalendarPath);
+        flagUploadFailure(mFailingUploads, mPermanentUploadFailures,
+                          loadAll(mStorage, mCalendar, mLocalModifications));
 
         emit finished();
     }
@@ -990,6 +2311,43 @@ bool NotebookSyncAgent::hasUploadErrors() const
     return !mFailingUploads.isEmpty();
 }
 
+int NotebookSyncAgent::commitCount() const
+{
+    return mCommitCount;
+}
+
+qint64 NotebookSyncAgent::commitDuration() const
+{
+    return mCommitDuration;
+}
+
+int NotebookSyncAgent::skippedUploadCount() const
+{
+    return mSkippedUploadCount;
+}
+
+bool NotebookSyncAgent::isListingSkipped() const
+{
+    return mListingSkipped;
+}
+
+// Resources of the past tier whose etags were not listed, or -1 when
+// the past was listed, see setRefreshIntervals().
+int NotebookSyncAgent::pastUnlistedCount() const
+{
+    return mPastUnlisted;
+}
+
+int NotebookSyncAgent::futureUnlistedCount() const
+{
+    return mFutureUnlisted;
+}
+
+qint64 NotebookSyncAgent::memoryHighWaterMark() const
+{
+    return mStaging.highWaterMark();
+}
+
 const QString& NotebookSyncAgent::path() const
 {
     return mRemoteCalendarPath;
@@ -1015,21 +2373,24 @@ bool NotebookSyncAgent::calculateDelta(
     // the inequality for all possible local modifications detectable since the last sync.
     QDateTime syncDateTime = mNotebook->syncDate().addSecs(1); // deleted after, created before...
 
-    // load all local incidences
-    KCalendarCore::Incidence::List localIncidences;
-    if (!mStorage->allIncidences(&localIncidences, mNotebook->uid())) {
-        qCWarning(lcCalDav) << "Unable to load notebook incidences, aborting sync of notebook:" << mRemoteCalendarPath
-                            << ":" << mNotebook->uid();
+    // the local incidences are usually loaded already,
+    // while the etags were requested, see fetchRemoteChanges().
+    if ((!mLocalState.loaded || !mLocalState.withDeletions) && !loadLocalState(true)) {
         return false;
     }
+    const LocalState localState = mLocalState;
+    mLocalState = LocalState();
+    findEvictions(localState, remoteUriEtags);
+    countUnlisted(localState);
 
     // separate them into buckets.
     // note that each remote URI can be associated with multiple local incidences (due recurrenceId incidences)
     // Here we can determine local additions, modifications and remote modifications, deletions.
     QSet<QString> localUris;
-    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(localIncidences)) {
+    for (const LocalIncidence &local : localState.incidences) {
+        KCalendarCore::Incidence::Ptr incidence = local.incidence;
         bool modified = (incidence->created() < syncDateTime && incidence->lastModified() >= syncDateTime);
-        QString remoteUri = storedIncidenceHrefUri(incidence);
+        QString remoteUri = local.href;
         if (remoteUri.isEmpty()) {
             remoteUri = createIncidenceHrefUri(incidence, mRemoteCalendarPath);
             // Imported exceptions don't have URI and etag inherited from parent.
@@ -1049,7 +2410,7 @@ bool NotebookSyncAgent::calculateDelta(
                     setIncidenceETag(incidence, remoteUriEtags.value(remoteUri));
                     localModifications->append(incidence);
                 }
-            } else if (!isFlagged(incidence) || retryUploadFailure(incidence)) {
+            } else if (!isFlagged(incidence) || modified || retryUploadFailure(incidence)) {
                 // it doesn't exist on remote side... new local addition.
                 qCDebug(lcCalDav) << "have new local addition:" << incidence->uid() << incidence->recurrenceId().toString();
                 localAdditions->append(incidence);
@@ -1058,7 +2419,24 @@ bool NotebookSyncAgent::calculateDelta(
             // this is a previously-synced incidence with a remote uri,
             // OR a newly-added persistent occurrence to a previously-synced recurring series.
             if (!remoteUriEtags.contains(remoteUri)) {
-                if (!incidenceWithin(incidence, mFromDateTime, mToDateTime)) {
+                if (!incidenceWithin(incidence, mFromDateTime, mToDateTime) && inSkippedTier(incidence)) {
+                    if (modified && !local.etag.isEmpty()) {
+                        // sent conditionally on the stored etag, a remote
+                        // modification is detected as a conflict.
+                        qCDebug(lcCalDav) << "have local modification to unlisted incidence:" << incidence->uid()
+                                          << incidence->recurrenceId().toString();
+                        localModifications->append(incidence);
+                    }
+                } else if (!incidenceWithin(incidence, mFromDateTime, mToDateTime) && inExposedSlice(incidence)) {
+                    if (modified && !local.etag.isEmpty()) {
+                        // sent conditionally on the stored etag, and not
+                        // overwritten by the download of the slice.
+                        qCDebug(lcCalDav) << "have local modification in newly exposed window slice:"
+                                          << incidence->uid() << incidence->recurrenceId().toString();
+                        localModifications->append(incidence);
+                        mExposedLocalChanges.insert(remoteUri);
+                    }
+                } else if (!incidenceWithin(incidence, mFromDateTime, mToDateTime)) {
                     qCDebug(lcCalDav) << "ignoring out-of-range missing remote incidence:" << incidence->uid()
                                       << incidence->recurrenceId().toString();
                 } else if (!isFlagged(incidence) || retryDeleteFailure(incidence)) {
@@ -1066,12 +2444,13 @@ bool NotebookSyncAgent::calculateDelta(
                                       << incidence->recurrenceId().toString();
                     // Ignoring local modifications if any.
                     remoteDeletions->append(incidence);
+                    mRemotelyChanged.insert(remoteUri);
                 } else if (resetDeleteFailure(incidence)) {
                     qCDebug(lcCalDav) << "reset remote deletion:" << incidence->uid() << incidence->recurrenceId().toString();
                     localAdditions->append(incidence);
                 }
             } else if (isCopiedDetachedIncidence(incidence)) {
-                if (incidenceETag(incidence) == remoteUriEtags.value(remoteUri)) {
+                if (local.etag == remoteUriEtags.value(remoteUri)) {
                     qCDebug(lcCalDav) << "Found new locally-added persistent exception:" << incidence->uid()
                                       << incidence->recurrenceId().toString() << ":" << remoteUri;
                     localAdditions->append(incidence);
@@ -1080,11 +2459,13 @@ bool NotebookSyncAgent::calculateDelta(
                                       << incidence->uid() << incidence->recurrenceId().toString() << ":" << remoteUri;
                     mUpdatingList.append(incidence);
                     remoteChanges->insert(remoteUri);
+                    mRemotelyChanged.insert(remoteUri);
                 }
-            } else if (incidenceETag(incidence) != remoteUriEtags.value(remoteUri)) {
+            } else if (local.etag != remoteUriEtags.value(remoteUri)) {
                 qCDebug(lcCalDav) << "have remote modification to previously synced incidence at:" << remoteUri;
+                mRemotelyChanged.insert(remoteUri);
                 if (!isFlagged(incidence) || retryUpdateFailure(incidence)) {
-                    qCDebug(lcCalDav) << "device etag:" << incidenceETag(incidence)
+                    qCDebug(lcCalDav) << "device etag:" << local.etag
                                       << "server etag:" << remoteUriEtags.value(remoteUri);
                     mUpdatingList.append(incidence);
                     // Ignoring local modifications if any.
@@ -1119,12 +2500,7 @@ bool NotebookSyncAgent::calculateDelta(
     }
 
     // List all local deletions reported by mkcal.
-    KCalendarCore::Incidence::List deleted;
-    if (!mStorage->deletedIncidences(&deleted, QDateTime(), mNotebook->uid())) {
-        qCWarning(lcCalDav) << "mKCal::ExtendedStorage::deletedIncidences() failed";
-        return false;
-    }
-    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(deleted)) {
+    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(localState.deletions)) {
         QString remoteUri = storedIncidenceHrefUri(incidence);
         if (remoteUri.isEmpty()) {
             remoteUri = createIncidenceHrefUri(incidence, mRemoteCalendarPath);
@@ -1153,8 +2529,24 @@ bool NotebookSyncAgent::calculateDelta(
                                   << incidence->uid() << incidence->recurrenceId().toString();
                 mPurgeList.append(incidence);
                 remoteChanges->insert(remoteUri);
+                mRemotelyChanged.insert(remoteUri);
             }
             localUris.insert(remoteUri);
+        } else if (!incidenceETag(incidence).isEmpty()
+                   && !incidenceWithin(incidence, mFromDateTime, mToDateTime)
+                   && inSkippedTier(incidence)) {
+            qCDebug(lcCalDav) << "have local deletion for unlisted incidence:"
+                              << incidence->uid() << incidence->recurrenceId().toString();
+            localDeletions->append(incidence);
+            localUris.insert(remoteUri);
+        } else if (!incidenceETag(incidence).isEmpty()
+                   && !incidenceWithin(incidence, mFromDateTime, mToDateTime)
+                   && inExposedSlice(incidence)) {
+            qCDebug(lcCalDav) << "have local deletion in newly exposed window slice:"
+                              << incidence->uid() << incidence->recurrenceId().toString();
+            localDeletions->append(incidence);
+            localUris.insert(remoteUri);
+            mExposedLocalChanges.insert(remoteUri);
         } else {
             // it was either already deleted remotely, or was never upsynced from the local prior to deletion.
             qCDebug(lcCalDav) << "ignoring local deletion of non-existent remote incidence:"
@@ -1169,6 +2561,7 @@ bool NotebookSyncAgent::calculateDelta(
         if (!localUris.contains(remoteUri)) {
             qCDebug(lcCalDav) << "have new remote addition:" << remoteUri;
             remoteChanges->insert(remoteUri);
+            mRemotelyChanged.insert(remoteUri);
         }
     }
 
@@ -1180,6 +2573,182 @@ bool NotebookSyncAgent::calculateDelta(
     return true;
 }
 
+// Synced incidences that ended up well outside the sync window, see
+// setEvictionMargin(), are purged from the local database. A series is
+// only purged as a whole, when none of its incidences was modified
+// locally or failed to sync. They are downloaded again with the slices
+// of the window newly exposed if the window grows back, see
+// fetchWindowChanges().
+void NotebookSyncAgent::findEvictions(const LocalState &localState,
+                                      const QHash<QString, QString> &remoteUriEtags)
+{
+    mEvictions.clear();
+    if (mEvictionMargin <= 0) {
+        return;
+    }
+    const QDateTime syncDateTime = mNotebook->syncDate().addSecs(1);
+    const QDateTime keptFrom = mWindowFrom.addDays(-mEvictionMargin);
+    const QDateTime keptTo = mWindowTo.addDays(mEvictionMargin);
+    QHash<QString, KCalendarCore::Incidence::List> candidates;
+    QSet<QString> kept;
+    for (const LocalIncidence &local : localState.incidences) {
+        const QString uid = local.incidence->uid();
+        if (!kept.contains(uid)
+            && !local.href.isEmpty() && !local.etag.isEmpty()
+            && !remoteUriEtags.contains(local.href)
+            && !isFlagged(local.incidence)
+            && local.incidence->lastModified() < syncDateTime
+            && !incidenceWithin(local.incidence, keptFrom, keptTo)) {
+            candidates[uid].append(local.incidence);
+        } else {
+            kept.insert(uid);
+            candidates.remove(uid);
+        }
+    }
+    for (QHash<QString, KCalendarCore::Incidence::List>::ConstIterator it = candidates.constBegin();
+         it != candidates.constEnd(); ++it) {
+        mEvictions += it.value();
+    }
+    if (!mEvictions.isEmpty()) {
+        qCDebug(lcCalDav) << "Evicting" << mEvictions.count() << "incidences outside"
+                          << keptFrom << "-" << keptTo << "of" << mRemoteCalendarPath;
+    }
+}
+
+// The synced resources of the tiers whose etags were not listed, see
+// fetchWindowChanges(), are as many entries saved in the etag REPORT.
+void NotebookSyncAgent::countUnlisted(const LocalState &localState)
+{
+    if (!mPastTierFrom.isValid() && !mFutureTierTo.isValid()) {
+        return;
+    }
+    QSet<QString> past, future;
+    for (const LocalIncidence &local : localState.incidences) {
+        if (!local.href.isEmpty()
+            && !incidenceWithin(local.incidence, mFromDateTime, mToDateTime)
+            && inSkippedTier(local.incidence)) {
+            if (local.incidence->dtStart() < mFromDateTime) {
+                past.insert(local.href);
+            } else {
+                future.insert(local.href);
+            }
+        }
+    }
+    if (mPastTierFrom.isValid()) {
+        mPastUnlisted = past.count();
+    }
+    if (mFutureTierTo.isValid()) {
+        mFutureUnlisted = future.count();
+    }
+    qCDebug(lcCalDav) << "Etags not listed for" << mRemoteCalendarPath << ": past"
+                      << mPastUnlisted << ", future" << mFutureUnlisted;
+}
+
+// Download-only delta, for read-only calendars or profiles synced from
+// the server only. Local changes would not be sent anyway, so the stored
+// hrefs and etags are only compared with the remote ones, without
+// looking for local modifications and deletions.
+bool NotebookSyncAgent::calculateRemoteDelta(const QHash<QString, QString> &remoteUriEtags,
+                                             QSet<QString> *remoteChanges,
+                                             KCalendarCore::Incidence::List *remoteDeletions)
+{
+    if (!mLocalState.loaded && !loadLocalState(false)) {
+        return false;
+    }
+    const LocalState localState = mLocalState;
+    mLocalState = LocalState();
+    findEvictions(localState, remoteUriEtags);
+    countUnlisted(localState);
+
+    QSet<QString> localUris;
+    for (const LocalIncidence &local : localState.incidences) {
+        KCalendarCore::Incidence::Ptr incidence = local.incidence;
+        QString remoteUri = local.href;
+        if (remoteUri.isEmpty()) {
+            remoteUri = createIncidenceHrefUri(incidence, mRemoteCalendarPath);
+            if (!incidence->hasRecurrenceId() && remoteUriEtags.contains(remoteUri)) {
+                // previously upsynced, but the etag was not set, get it again.
+                mUpdatingList.append(incidence);
+                remoteChanges->insert(remoteUri);
+                localUris.insert(remoteUri);
+            }
+            continue;
+        }
+        localUris.insert(remoteUri);
+        if (isCopiedDetachedIncidence(incidence)) {
+            continue;
+        } else if (!remoteUriEtags.contains(remoteUri)) {
+            if (incidenceWithin(incidence, mFromDateTime, mToDateTime)
+                && (!isFlagged(incidence) || retryDeleteFailure(incidence))) {
+                remoteDeletions->append(incidence);
+                mRemotelyChanged.insert(remoteUri);
+            }
+        } else if (local.etag != remoteUriEtags.value(remoteUri)
+                   && (!isFlagged(incidence) || retryUpdateFailure(incidence))) {
+            mUpdatingList.append(incidence);
+            remoteChanges->insert(remoteUri);
+            mRemotelyChanged.insert(remoteUri);
+        }
+    }
+
+    const int nRemoteModifications = remoteChanges->size();
+    for (QHash<QString, QString>::ConstIterator it = remoteUriEtags.constBegin();
+         it != remoteUriEtags.constEnd(); ++it) {
+        if (!localUris.contains(it.key())) {
+            remoteChanges->insert(it.key());
+            mRemotelyChanged.insert(it.key());
+        }
+    }
+
+    qCDebug(lcCalDav) << "Calculated remote A/M/R:" << (remoteChanges->size() - nRemoteModifications)
+                      << "/" << nRemoteModifications << "/" << remoteDeletions->size();
+
+    return true;
+}
+
+// Lists the local changes since the last sync from mKCal, without
+// comparing them with the server etags. Returns false when some change
+// cannot be sent conditionally on a stored etag.
+bool NotebookSyncAgent::calculatePushDelta(KCalendarCore::Incidence::List *localAdditions,
+                                           KCalendarCore::Incidence::List *localModifications,
+                                           KCalendarCore::Incidence::List *localDeletions)
+{
+    const QDateTime syncDateTime = mNotebook->syncDate().addSecs(1);
+    KCalendarCore::Incidence::List inserted, modified, deleted;
+    if (!mStorage->insertedIncidences(&inserted, syncDateTime, mNotebook->uid())
+        || !mStorage->modifiedIncidences(&modified, syncDateTime, mNotebook->uid())
+        || !mStorage->deletedIncidences(&deleted, QDateTime(), mNotebook->uid())) {
+        qCWarning(lcCalDav) << "Unable to list the local changes of notebook:" << mNotebook->uid();
+        return false;
+    }
+
+    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(inserted)) {
+        if (isFlagged(incidence)) {
+            return false;
+        } else if (storedIncidenceHrefUri(incidence).isEmpty() || isCopiedDetachedIncidence(incidence)) {
+            localAdditions->append(incidence);
+        }
+        // Otherwise, it was received during the previous sync.
+    }
+    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(modified)) {
+        if (isFlagged(incidence) || incidenceETag(incidence).isEmpty()) {
+            return false;
+        }
+        localModifications->append(incidence);
+    }
+    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(deleted)) {
+        if (incidenceETag(incidence).isEmpty()) {
+            return false;
+        }
+        localDeletions->append(incidence);
+    }
+
+    qCDebug(lcCalDav) << "Calculated local  A/M/R:" << localAdditions->size() << "/" << localModifications->size()
+                      << "/" << localDeletions->size();
+
+    return true;
+}
+
 static QString nbUid(const QString &notebookId, const QString &uid)
 {
     return QStringLiteral("NBUID:%1:%2").arg(notebookId).arg(uid);
@@ -1227,6 +2796,37 @@ void NotebookSyncAgent::updateIncidence(KCalendarCore::Incidence::Ptr incidence,
     }
 }
 
+// Some servers change the etag of resources without changing their
+// content. When the received content is the one already stored, only
+// the href and etag are updated, to avoid rewriting the whole series.
+bool NotebookSyncAgent::updateUnchangedResource(const CalendarResource &resource,
+                                                KCalendarCore::Incidence::Ptr localBaseIncidence)
+{
+    if (resource.hash.isEmpty() || incidenceContentHash(localBaseIncidence) != resource.hash) {
+        return false;
+    }
+    // The stored hash is the one of the last exchanged content,
+    // ensure that the local series was not modified since.
+    const KCalendarCore::Incidence::List instances = mCalendar->instances(localBaseIncidence);
+    if (IncidenceHandler::contentHash(IncidenceHandler::toIcs(localBaseIncidence, instances)) != resource.hash) {
+        return false;
+    }
+
+    qCDebug(lcCalDav) << "Content unchanged, updating etag only for:" << resource.href;
+    const KCalendarCore::Incidence::List incidences = KCalendarCore::Incidence::List() << localBaseIncidence << instances;
+    for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+        const QDateTime lastModified = incidence->lastModified();
+        incidence->startUpdates();
+        updateIncidenceHrefEtag(incidence, resource.href, resource.etag, resource.hash);
+        flagUpdateSuccess(incidence);
+        incidence->endUpdates();
+        if (incidence->lastModified() != lastModified) {
+            incidence->setLastModified(lastModified);
+        }
+    }
+    return true;
+}
+
 bool NotebookSyncAgent::addIncidence(KCalendarCore::Incidence::Ptr incidence)
 {
     qCDebug(lcCalDav) << "Adding new incidence:" << incidence->uid() << incidence->recurrenceId().toString();
@@ -1276,38 +2876,41 @@ bool NotebookSyncAgent::updateIncidences(const QList<CalendarResource> &resource
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
-    mRemoteAdditions.clear();
-    mRemoteModifications.clear();
-
     // We need to coalesce any resources which have the same UID.
     // This can be the case if there is addition of both a recurring event,
     // and a modified occurrence of that event, in the same sync cycle.
     // To ensure that we deal with the original recurring event first,
     // we find the resource which includes that change and promote it
     // in the list (so that we deal with it before the other).
-    QList<CalendarResource> orderedResources;
-    for (int i = resources.count() - 1; i >= 0; --i) {
-        bool prependedResource = false;
-        for (int j = 0; j < resources[i].incidences.count(); ++j) {
-            if (!resources[i].incidences[j]->hasRecurrenceId()) {
-                // we have a non-occurrence event which needs promotion.
-                orderedResources.prepend(resources[i]);
-                prependedResource = true;
-                break;
-            }
+    // Resources are ordered by pointers, to avoid copying them around.
+    QVector<const CalendarResource *> orderedResources;
+    orderedResources.reserve(resources.count());
+    for (const CalendarResource &resource : resources) {
+        if (hasBaseIncidence(resource.incidences)) {
+            // we have a non-occurrence event which needs promotion.
+            orderedResources.append(&resource);
         }
-        if (!prependedResource) {
+    }
+    for (int i = resources.count() - 1; i >= 0; --i) {
+        if (!hasBaseIncidence(resources[i].incidences)) {
             // this resource needs to be appended.
-            orderedResources.append(resources[i]);
+            orderedResources.append(&resources[i]);
         }
     }
 
     bool success = true;
+    int unchangedResources = 0;
     for (int i = 0; i < orderedResources.count(); ++i) {
-        const CalendarResource &resource = orderedResources.at(i);
+        const CalendarResource &resource = *orderedResources.at(i);
         if (!resource.incidences.size()) {
             continue;
         }
+        if (mExposedLocalChanges.contains(resource.href) && !mRemoteChanges.contains(resource.href)) {
+            // Downloaded with a newly exposed window slice, while
+            // the local change was sent, see calculateDelta().
+            qCDebug(lcCalDav) << "Keeping the local change of" << resource.href << "over the downloaded copy.";
+            continue;
+        }
 
         // Each resource is either a single event series (or non-recurring event) OR
         // a list of updated/added persistent exceptions to an existing series.
@@ -1329,12 +2932,20 @@ bool NotebookSyncAgent::updateIncidences(const QList<CalendarResource> &resource
             if (!resource.incidences[i]->hasRecurrenceId()) {
                 parentIndex = i;
             }
-            updateIncidenceHrefEtag(resource.incidences[i], resource.href, resource.etag);
+            updateIncidenceHrefEtag(resource.incidences[i], resource.href, resource.etag, resource.hash);
         }
 
         qCDebug(lcCalDav) << "Saving the added/updated base incidence before saving persistent exceptions:" << uid;
         KCalendarCore::Incidence::Ptr localBaseIncidence =
             loadIncidence(mStorage, mCalendar, mNotebook->uid(), uid);
+        if (localBaseIncidence && updateUnchangedResource(resource, localBaseIncidence)) {
+            unchangedResources += 1;
+            continue;
+        }
+        // Only the incidences actually rewritten count in the batch.
+        if (!commitBatch(resource.incidences.size())) {
+            success = false;
+        }
         if (localBaseIncidence) {
             if (parentIndex >= 0) {
                 resource.incidences[parentIndex]->setUid(localBaseIncidence->uid());
@@ -1362,21 +2973,39 @@ bool NotebookSyncAgent::updateIncidences(const QList<CalendarResource> &resource
             continue; // don't return false and block the entire sync cycle, just ignore this event.
         }
 
+        // Look up the local persistent exceptions once for the whole series,
+        // instead of searching the calendar for each remote exception.
+        QHash<QDateTime, KCalendarCore::Incidence::Ptr> localInstances;
+        const KCalendarCore::Incidence::List instances = mCalendar->instances(localBaseIncidence);
+        for (const KCalendarCore::Incidence::Ptr &instance : instances) {
+            localInstances.insert(instance->recurrenceId(), instance);
+        }
+
+        // Adding RDATEs to the parent of orphan exceptions notifies the calendar
+        // once for the whole series, and doesn't count as a local modification.
+        const bool ensureRDates = (parentIndex == -1);
+        const QDateTime baseLastModified = localBaseIncidence->lastModified();
+        if (ensureRDates) {
+            localBaseIncidence->startUpdates();
+        }
+
         // update persistent exceptions which are in the remote list.
-        QList<QDateTime> remoteRecurrenceIds;
+        QSet<QDateTime> remoteRecurrenceIds;
         for (int i = 0; i < resource.incidences.size(); ++i) {
             KCalendarCore::Incidence::Ptr remoteInstance = resource.incidences[i];
             if (!remoteInstance->hasRecurrenceId()) {
                 continue; // already handled this one.
             }
-            remoteRecurrenceIds.append(remoteInstance->recurrenceId());
+            remoteRecurrenceIds.insert(remoteInstance->recurrenceId());
 
             qCDebug(lcCalDav) << "Now saving a persistent exception:" << remoteInstance->recurrenceId().toString();
             remoteInstance->setUid(localBaseIncidence->uid());
-            KCalendarCore::Incidence::Ptr localInstance = mCalendar->incidence(remoteInstance->uid(), remoteInstance->recurrenceId());
+            KCalendarCore::Incidence::Ptr localInstance = localInstances.value(remoteInstance->recurrenceId());
             if (localInstance) {
                 updateIncidence(remoteInstance, localInstance);
-            } else if (!addException(remoteInstance, localBaseIncidence, parentIndex == -1)) {
+            } else if (addException(remoteInstance, localBaseIncidence, ensureRDates)) {
+                localInstances.insert(remoteInstance->recurrenceId(), remoteInstance);
+            } else {
                 qCWarning(lcCalDav) << "Error saving updated persistent occurrence of resource" << resource.href
                                     << ":" << remoteInstance->recurrenceId().toString();
                 mFailingUpdates.insert(resource.href, QByteArray("Cannot create exception."));
@@ -1385,20 +3014,29 @@ bool NotebookSyncAgent::updateIncidences(const QList<CalendarResource> &resource
             }
         }
 
+        if (ensureRDates) {
+            localBaseIncidence->endUpdates();
+            if (localBaseIncidence->lastModified() != baseLastModified) {
+                localBaseIncidence->setLastModified(baseLastModified);
+            }
+        }
+
         // remove persistent exceptions which are not in the remote list.
-        KCalendarCore::Incidence::List localInstances;
-        if (localBaseIncidence->recurs())
-            localInstances = mCalendar->instances(localBaseIncidence);
-        for (int i = 0; i < localInstances.size(); ++i) {
-            KCalendarCore::Incidence::Ptr localInstance = localInstances[i];
-            if (!remoteRecurrenceIds.contains(localInstance->recurrenceId())) {
-                qCDebug(lcCalDav) << "Schedule for removal persistent occurrence:" << localInstance->recurrenceId().toString();
-                // Will be deleted in the call to deleteIncidences
-                mRemoteDeletions.append(localInstance);
+        if (localBaseIncidence->recurs()) {
+            for (const KCalendarCore::Incidence::Ptr &localInstance : instances) {
+                if (!remoteRecurrenceIds.contains(localInstance->recurrenceId())) {
+                    qCDebug(lcCalDav) << "Schedule for removal persistent occurrence:" << localInstance->recurrenceId().toString();
+                    // Will be deleted in the call to deleteIncidences
+                    mRemoteDeletions.append(localInstance);
+                }
             }
         }
     }
 
+    if (unchangedResources) {
+        qCDebug(lcCalDav) << "Only updated the etag of" << unchangedResources << "resources with unchanged content.";
+    }
+
     if (!mFailingUpdates.isEmpty()) {
         for (int i = 0; i < mUpdatingList.size(); i++){
             if (mFailingUpdates.contains(storedIncidenceHrefUri(mUpdatingList[i]))) {
@@ -1418,11 +3056,44 @@ bool NotebookSyncAgent::updateIncidences(const QList<CalendarResource> &resource
     return success;
 }
 
+// Stream back the resources that were staged on disk during
+// reception and apply them by chunks.
+bool NotebookSyncAgent::applyStagedResources()
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    qCInfo(lcCalDav) << "Received resources memory high-water mark:" << mStaging.highWaterMark()
+                     << "bytes, staged on disk:" << mStaging.stagedCount()
+                     << "resources," << mStaging.stagedSize() << "bytes.";
+
+    bool success = true;
+    QList<Buteo::Dav::Resource> staged = mStaging.takeStaged(STAGING_CHUNK_SIZE);
+    while (!staged.isEmpty()) {
+        const QList<CalendarResource> resources
+            = QtConcurrent::blockingMapped<QList<CalendarResource> >(staged, ResourceParser(mIcsParser));
+        if (!updateIncidences(resources)) {
+            success = false;
+        }
+        for (const CalendarResource &resource : const_cast<const QList<CalendarResource>&>(resources)) {
+            if (!mFailingUpdates.contains(resource.href)) {
+                mStagedIncidenceCount += resource.incidences.count();
+            }
+        }
+        staged = mStaging.takeStaged(STAGING_CHUNK_SIZE);
+    }
+    mStaging.clear();
+
+    return success;
+}
+
 bool NotebookSyncAgent::deleteIncidences(const KCalendarCore::Incidence::List deletedIncidences)
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
     bool success = true;
     for (KCalendarCore::Incidence::Ptr incidence : deletedIncidences) {
+        if (!commitBatch(1)) {
+            success = false;
+        }
         KCalendarCore::Incidence::Ptr doomed = mCalendar->incidence(incidence->uid(), incidence->recurrenceId());
         if (!doomed) {
             mStorage->load(incidence->uid());
@@ -1440,7 +3111,8 @@ bool NotebookSyncAgent::deleteIncidences(const KCalendarCore::Incidence::List de
     return success;
 }
 
-void NotebookSyncAgent::updateHrefETag(const QString &uid, const QString &href, const QString &etag) const
+void NotebookSyncAgent::updateHrefETag(const QString &uid, const QString &href, const QString &etag,
+                                       const QString &hash) const
 {
     if (!mStorage->load(uid)) {
         qCWarning(lcCalDav) << "Unable to load incidence from database:" << uid;
@@ -1450,13 +3122,13 @@ void NotebookSyncAgent::updateHrefETag(const QString &uid, const QString &href,
     KCalendarCore::Incidence::Ptr localBaseIncidence = mCalendar->incidence(uid);
     if (localBaseIncidence) {
         localBaseIncidence->startUpdates();
-        updateIncidenceHrefEtag(localBaseIncidence, href, etag);
+        updateIncidenceHrefEtag(localBaseIncidence, href, etag, hash);
         localBaseIncidence->endUpdates();
         if (localBaseIncidence->recurs()) {
             const KCalendarCore::Incidence::List instances = mCalendar->instances(localBaseIncidence);
             for (const KCalendarCore::Incidence::Ptr &instance : instances) {
                 instance->startUpdates();
-                updateIncidenceHrefEtag(instance, href, etag);
+                updateIncidenceHrefEtag(instance, href, etag, hash);
                 instance->endUpdates();
             }
         }
@@ -23,6 +23,9 @@
 #ifndef NOTEBOOKSYNCAGENT_P_H
 #define NOTEBOOKSYNCAGENT_P_H
 
+#include "resourcestaging.h"
+#include "icsparser.h"
+
 #include <davclient.h>
 #include <davtypes.h>
 
@@ -30,8 +33,13 @@
 #include <extendedstorage.h>
 
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QSharedPointer>
+#include <QVector>
 
 #include <SyncResults.h>
+#include <SyncProfile.h>
 
 class NotebookSyncAgent : public QObject
 {
@@ -40,7 +48,21 @@ public:
     enum SyncMode {
         NoSyncMode,
         SlowSync,   // download everything
-        QuickSync   // updates only
+        QuickSync,  // updates only
+        PushSync,   // local changes only, without listing the server etags
+        SkippedSync // nothing to push, the listing of a low-churn calendar is skipped
+    };
+
+    enum CommitStrategy {
+        CommitPerNotebook, // save storage once, after applying the notebook changes
+        CommitPerAccount,  // don't save storage, the caller saves once for all notebooks
+        CommitPerBatch     // save storage every given number of incidences
+    };
+
+    enum CleanSyncPreparation {
+        CleanSyncPrepared,  // the next sync is a slow sync, reconciled with the local incidences
+        CleanSyncDeferred,  // local changes are pending, the sync state is kept for now
+        CleanSyncUnmatched  // no server calendar to match, the notebook should be deleted
     };
 
     NotebookSyncAgent(mKCal::ExtendedCalendar::Ptr calendar,
@@ -61,8 +83,24 @@ public:
                    const QDateTime &toDateTime,
                    bool withUpsync, bool withDownsync);
 
+    void setCommitStrategy(CommitStrategy strategy, int batchSize = 0);
+    void setStagingThreshold(qint64 bytes);
+    void setUploadWindow(int window);
+    void setConflictResolutionPolicy(Buteo::SyncProfile::ConflictResolutionPolicy policy);
+    void setPushWindow(int seconds);
+    void setRefreshIntervals(int futureSeconds, int pastSeconds);
+    void setProgressiveSlowSync(bool enabled);
+    void setTwoPhaseSlowSync(bool enabled);
+    void setEvictionMargin(int days);
+    void setMaxStaleness(int seconds);
+    void setCommitFailed();
+    bool checkpoint();
+    bool commitCheckpoint();
+    static CleanSyncPreparation prepareCleanSync(mKCal::ExtendedStorage::Ptr storage, mKCal::Notebook::Ptr notebook);
+
     void abort();
     bool applyRemoteChanges();
+    bool storeNotebook();
     Buteo::TargetResults result() const;
     void finalize();
 
@@ -71,48 +109,137 @@ public:
     bool isDeleted() const;
     bool hasDownloadErrors() const;
     bool hasUploadErrors() const;
+    int commitCount() const;
+    qint64 commitDuration() const;
+    int skippedUploadCount() const;
+    bool isListingSkipped() const;
+    int pastUnlistedCount() const;
+    int futureUnlistedCount() const;
+    qint64 memoryHighWaterMark() const;
 
     const QString& path() const;
 
 signals:
     void finished();
+    void chunkCommitted(int incidenceCount, int remainingChunks);
 
 private:
+    // A multiget REPORT of a two-phase slow sync.
+    struct Multiget {
+        QStringList hrefs;
+        int attempts;
+    };
+    // A PUT or DELETE waiting in the upload queue.
+    struct Upload {
+        QString href;
+        QByteArray data; // empty for a DELETE
+        QString etag;
+        bool deletion;
+        int attempts;
+    };
+
+    // A PUT or DELETE rejected because the server copy changed since the last sync.
+    struct Conflict {
+        QString uid; // empty for a DELETE
+        Upload upload;
+    };
+
+    // Purpose of an etag request for given resources, the replies
+    // are told apart by their hrefs, see requestETags().
+    enum ETagRequest {
+        SentETags,    // new etags of uploaded resources.
+        ConflictETags // current etags of conflicting resources.
+    };
+
+    // A local incidence with its stored sync data.
+    struct LocalIncidence {
+        KCalendarCore::Incidence::Ptr incidence;
+        QString href;
+        QString etag;
+    };
+
+    // The local incidences of the notebook, loaded while the
+    // server etags are fetched, see fetchRemoteChanges().
+    struct LocalState {
+        bool requested = false;
+        bool loaded = false;
+        bool withDeletions = false;
+        QVector<LocalIncidence> incidences;
+        KCalendarCore::Incidence::List deletions;
+    };
+
     struct CalendarResource {
         QString href;
         QString etag;
+        QString hash; // see IncidenceHandler::contentHash()
         KCalendarCore::Incidence::List incidences;
 
-        CalendarResource(const Buteo::Dav::Resource &dav);
+        CalendarResource() {}
+        CalendarResource(const Buteo::Dav::Resource &dav, IcsParser *parser = 0);
         CalendarResource(const QString &uri, const QString &tag,
                          const KCalendarCore::Incidence::List &list)
             : href(uri), etag(tag), incidences(list) {}
     };
-    
-    void reportRequestFinished(const Buteo::Dav::Client::Reply &reply,
-                               const QList<Buteo::Dav::Resource> &resources);
-    void resourceSent(const Buteo::Dav::Client::Reply &reply, const QString &etag);
-    void resourceDeleted(const Buteo::Dav::Client::Reply &reply);
-    void processETags(const Buteo::Dav::Client::Reply &reply,
-                      const QHash<QString, QString> &etags);
+
+    // Parses resources in worker threads, sharing the parser state.
+    struct ResourceParser {
+        typedef CalendarResource result_type;
+        QSharedPointer<IcsParser> parser;
+
+        ResourceParser(const QSharedPointer<IcsParser> &icsParser) : parser(icsParser) {}
+        CalendarResource operator()(const Buteo::Dav::Resource &resource) const
+        {
+            return CalendarResource(resource, parser.data());
+        }
+    };
+
+    void reportRequestFinished(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                               const QStringList &hrefs, const QList<Buteo::Dav::Resource> &resources);
+    void resourceSent(const Buteo::Dav::Client::Reply &reply, int statusCode, const QString &etag);
+    void resourceDeleted(const Buteo::Dav::Client::Reply &reply, int statusCode);
+    void processETags(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                      const QStringList &hrefs, const QHash<QString, QString> &etags);
+    void sentETagsReceived(const Buteo::Dav::Client::Reply &reply, const QStringList &hrefs,
+                           const QHash<QString, QString> &etags);
+    void conflictETagsReceived(const Buteo::Dav::Client::Reply &reply, const QStringList &hrefs,
+                               const QHash<QString, QString> &etags);
+
+    void parseResources(const QList<Buteo::Dav::Resource> &resources);
+    void parsingFinished();
 
     void sendReportRequest(const QStringList &remoteUris = QStringList());
+    void sendReportRequest(const QDateTime &fromDateTime, const QDateTime &toDateTime);
     void requestFinished();
     void setFatal(const QString &uri, const QByteArray &errorData);
 
     void fetchRemoteChanges();
+    void fetchWindowChanges();
+    void prefetchLocalState();
+    bool loadLocalState(bool withDeletions);
     bool updateIncidences(const QList<CalendarResource> &resources);
+    bool applyStagedResources();
     bool deleteIncidences(const KCalendarCore::Incidence::List deletedIncidences);
     void updateIncidence(KCalendarCore::Incidence::Ptr incidence,
                          KCalendarCore::Incidence::Ptr storedIncidence);
+    bool updateUnchangedResource(const CalendarResource &resource,
+                                 KCalendarCore::Incidence::Ptr localBaseIncidence);
     bool addIncidence(KCalendarCore::Incidence::Ptr incidence);
     bool addException(KCalendarCore::Incidence::Ptr incidence,
                       KCalendarCore::Incidence::Ptr recurringIncidence,
                       bool ensureRDate = false);
-    void updateHrefETag(const QString &uid, const QString &href, const QString &etag) const;
+    void updateHrefETag(const QString &uid, const QString &href, const QString &etag,
+                        const QString &hash = QString()) const;
+    bool saveChanges();
+    bool commitBatch(int changes);
 
     void sendLocalChanges();
     QString constructLocalChangeIcs(KCalendarCore::Incidence::Ptr updatedIncidence);
+    void queueUpload(const QString &href, const QByteArray &data, const QString &etag);
+    void queueDeletion(const QString &href, const QString &etag);
+    void sendUploads();
+    bool uploadFinished(const Buteo::Dav::Client::Reply &reply, int statusCode);
+    void resolveConflicts();
+    void requestETags(const QStringList &hrefs, ETagRequest purpose);
 
     bool calculateDelta(const QHash<QString, QString> &remoteUriEtags,
                         KCalendarCore::Incidence::List *localAdditions,
@@ -120,6 +247,37 @@ private:
                         KCalendarCore::Incidence::List *localDeletions,
                         QSet<QString> *remoteChanges,
                         KCalendarCore::Incidence::List *remoteDeletions);
+    bool calculateRemoteDelta(const QHash<QString, QString> &remoteUriEtags,
+                              QSet<QString> *remoteChanges,
+                              KCalendarCore::Incidence::List *remoteDeletions);
+    bool canPush() const;
+    bool canSkipListing() const;
+    bool refreshDue(const QByteArray &property, int interval) const;
+    bool inSkippedTier(KCalendarCore::Incidence::Ptr incidence) const;
+    bool inExposedSlice(KCalendarCore::Incidence::Ptr incidence) const;
+    bool calculatePushDelta(KCalendarCore::Incidence::List *localAdditions,
+                            KCalendarCore::Incidence::List *localModifications,
+                            KCalendarCore::Incidence::List *localDeletions);
+    void fallBackToQuickSync();
+    void findEvictions(const LocalState &localState, const QHash<QString, QString> &remoteUriEtags);
+    void countUnlisted(const LocalState &localState);
+    void planSlowSyncChunks();
+    void sendNextChunk();
+    void fetchSlowSyncRange();
+    void fetchInTwoPhases(const QDateTime &fromDateTime, const QDateTime &toDateTime);
+    void listNextSlice();
+    void slowSyncETagsReceived(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                               const QHash<QString, QString> &etags);
+    void queueMultigets(const QStringList &hrefs);
+    void sendMultigets();
+    void multigetFinished(const Buteo::Dav::Client::Reply &reply, int statusCode,
+                          const QStringList &hrefs, const QList<Buteo::Dav::Resource> &resources);
+    void receiveResources(const QList<Buteo::Dav::Resource> &resources);
+    bool commitChunk();
+    bool ensureNotebook();
+    bool storeCheckpoint();
+    void loadCheckpoint();
+    void findCheckpointDeletions();
 
     
 
@@ -128,15 +286,56 @@ private:
     mKCal::ExtendedCalendar::Ptr mCalendar;
     mKCal::ExtendedStorage::Ptr mStorage;
     mKCal::Notebook::Ptr mNotebook;
-    QDateTime mFromDateTime;
-    QDateTime mToDateTime;
+    QDateTime mFromDateTime;     // range of the etag listing in quick sync mode,
+    QDateTime mToDateTime;       // the part of the window that was already synced.
+    QDateTime mWindowFrom;       // the sync window requested for this sync.
+    QDateTime mWindowTo;
+    bool mWindowFetched;         // if the parts of the window not synced before were received.
+    QDateTime mPastTierFrom;     // start of the past tier when its etags are not listed.
+    QDateTime mFutureTierTo;     // end of the future tier when its etags are not listed.
+    int mPastUnlisted;           // resources of the past tier whose etags were not listed, -1 when listed.
+    int mFutureUnlisted;         // same for the future tier.
+    QList<QPair<QDateTime, QDateTime> > mExposedSlices; // parts of the window downloaded without listing.
+    QSet<QString> mExposedLocalChanges; // local changes in these parts, not overwritten by their download.
     QDateTime mNotebookSyncedDateTime;
     QString mRemoteCalendarPath; // contains calendar path.  resource prefix.  doesn't include host, percent decoded.
     SyncMode mSyncMode;          // quick (etag-based delta detection) or slow (full report) sync
     bool mRetriedReport;         // some servers will fail the first request but succeed on second
     bool mNotebookNeedsDeletion; // if the calendar was deleted remotely, we will need to delete it locally.
+    bool mNotebookModified;      // if the notebook values differ from the ones in storage.
+    bool mFetchSentResources;    // if the server modifies the uploaded data.
+    bool mPushFallback;          // if a push sync must be completed by a quick sync.
+    QStringList mSentResourcesRequest; // hrefs of the pending REPORT for the uploaded resources.
+    QList<QPair<QStringList, ETagRequest> > mETagRequests; // pending etag requests for given resources.
+    int mPushWindow;             // time in s after a full sync during which local changes are only pushed.
+    int mFutureRefreshInterval;  // time in s between listings of the etags beyond the near future.
+    int mPastRefreshInterval;    // time in s between listings of the past etags.
+    bool mProgressiveSlowSync;   // if a slow sync commits the window chunk by chunk.
+    QList<QPair<QDateTime, QDateTime> > mSlowSyncChunks; // parts of the window still to download.
+    bool mChunkCommitFailed;     // if a chunk could not be written to storage.
+    bool mTwoPhaseSlowSync;      // if a slow sync lists the etags before downloading the data.
+    QList<QPair<QDateTime, QDateTime> > mETagSlices; // time slices whose etags are still to list.
+    QPair<QDateTime, QDateTime> mListedSlice; // the slice of the pending etag listing.
+    QSet<QString> mListedHrefs;  // resources already queued for download.
+    QList<Multiget> mMultigetQueue;
+    QList<Multiget> mSendingMultigets;
+    int mMultigetSize;           // hrefs per multiget, halved when the server is overloaded.
+    LocalState mCheckpointState; // incidences stored by an interrupted slow sync, see checkpoint().
+    QHash<QString, QString> mCheckpointETags; // their etags, by href.
+    int mEvictionMargin;         // days around the window beyond which synced incidences are purged, 0 to keep them.
+    int mMaxStaleness;           // time in s a low-churn calendar can go without listing its etags, 0 to always list.
+    bool mListingSkipped;        // if the server etags are not listed, the calendar rarely changing.
     bool mEnableUpsync, mEnableDownsync;
     bool mReadOnlyFlag;
+    CommitStrategy mCommitStrategy;
+    Buteo::SyncProfile::ConflictResolutionPolicy mConflictPolicy;
+    int mCommitBatchSize;
+    int mUncommittedChanges; // incidences written in memory since last save, in batch mode.
+    int mCommitCount;
+    qint64 mCommitDuration;  // total time spent in saving storage, in ms.
+    bool mCommitFailed;      // if the changes could not be saved in storage.
+    int mSkippedUploadCount; // local modifications not uploaded since their content didn't change.
+    QSet<QString> mSkippedUploads; // hrefs of these modifications, or of dropped conflicts, not reported as uploaded.
 
     // these are used only in quick-sync mode.
     // delta detection and change data
@@ -144,19 +343,39 @@ private:
     KCalendarCore::Incidence::List mLocalModifications;
     KCalendarCore::Incidence::List mLocalDeletions;
     QSet<QString> mRemoteChanges; // Set of URLs to be downloaded
+    QSet<QString> mRemotelyChanged; // URLs added, modified or deleted server side, for the change rate.
     KCalendarCore::Incidence::List mRemoteDeletions;
     KCalendarCore::Incidence::List mRemoteAdditions;
     KCalendarCore::Incidence::List mRemoteModifications;
     KCalendarCore::Incidence::List mPurgeList;
+    KCalendarCore::Incidence::List mEvictions; // Synced incidences well outside the window, to purge.
     KCalendarCore::Incidence::List mUpdatingList; // Incidences corresponding to mRemoteModifications
     QHash<QString, QString> mSentUids; // Dictionnary of sent (href, uid) made from
                                        // local additions, modifications.
+    QHash<QString, QString> mSentHashes; // Content hashes of the sent hrefs.
+    QList<Upload> mUploadQueue; // PUTs and DELETEs not sent yet, in sending order.
+    QHash<QString, Upload> mSendingUploads; // Sent uploads by href, waiting for their reply.
+    int mUploadWindow; // Maximum number of uploads waiting for their reply.
+    int mRetryingUploads; // Uploads waiting for their retry delay.
+    int mUploadedCount;
+    qint64 mUploadedBytes;
+    QElapsedTimer mUploadTimer;
     QHash<QString, QByteArray> mFailingUploads; // List of hrefs with upload errors, with the server response.
+    QSet<QString> mPermanentUploadFailures; // Hrefs from mFailingUploads unlikely to succeed on retry.
+    QHash<QString, Conflict> mConflicts; // Uploads rejected with 412, by href, waiting for resolution.
+    QSet<QString> mResolvedConflicts; // Hrefs already resolved once, a new 412 on them is a failure.
     QHash<QString, QByteArray> mFailingUpdates; // List of hrefs from which incidences failed to update.
     QString mFatalUri; // A key from mFailingUpdates that prevents the sync to complete.
 
+    LocalState mLocalState;
+
     // received remote incidence resource data
     QList<CalendarResource> mReceivedCalendarResources;
+    QList<QFutureWatcher<CalendarResource> *> mParsingJobs; // in the order of the received replies
+    QSharedPointer<IcsParser> mIcsParser; // shared with the running parsing jobs
+    ResourceStaging mStaging; // received resources not kept in memory
+    int mStagedIncidenceCount; // incidences successfully applied from mStaging
+    int mChunkIncidenceCount; // incidences successfully applied from committed chunks
 
     friend class tst_NotebookSyncAgent;
     friend class tst_Reader;
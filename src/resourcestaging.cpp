@@ -0,0 +1,163 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "resourcestaging.h"
+
+#include "logging.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+namespace {
+    // Received calendar data are staged next to the calendar database,
+    // in privileged storage and on disk, /tmp being held in memory.
+    QString stagingDirectory()
+    {
+        const QByteArray database = qgetenv("SQLITESTORAGEDB");
+        if (!database.isEmpty()) {
+            return QFileInfo(QString::fromLocal8Bit(database)).absolutePath();
+        }
+        return QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+            + QStringLiteral("/system/privileged/Calendar/mkcal");
+    }
+}
+
+ResourceStaging::ResourceStaging()
+    : mThreshold(0)
+    , mMemorySize(0)
+    , mHighWaterMark(0)
+    , mStagedSize(0)
+    , mStagedCount(0)
+    , mReadCount(0)
+{
+}
+
+ResourceStaging::~ResourceStaging()
+{
+}
+
+void ResourceStaging::setThreshold(qint64 bytes)
+{
+    mThreshold = bytes;
+}
+
+qint64 ResourceStaging::threshold() const
+{
+    return mThreshold;
+}
+
+qint64 ResourceStaging::resourceSize(const Buteo::Dav::Resource &resource)
+{
+    // Rough estimate, parsed incidences are usually bigger than their ICS data.
+    return (resource.href.size() + resource.etag.size() + resource.data.size()) * qint64(sizeof(QChar));
+}
+
+bool ResourceStaging::keepInMemory(const Buteo::Dav::Resource &resource)
+{
+    const qint64 size = resourceSize(resource);
+    // Once staging has started, keep on staging to preserve the
+    // order of the resources when streaming them back.
+    if (mThreshold > 0 && (mStagedCount > 0 || mMemorySize + size > mThreshold)) {
+        return false;
+    }
+    mMemorySize += size;
+    mHighWaterMark = qMax(mHighWaterMark, mMemorySize);
+    return true;
+}
+
+bool ResourceStaging::stage(const Buteo::Dav::Resource &resource)
+{
+    if (!mFile) {
+        const QString directory = stagingDirectory();
+        if (!QDir().mkpath(directory)) {
+            qCWarning(lcCalDav) << "Cannot create staging directory" << directory;
+            return false;
+        }
+        mFile.reset(new QTemporaryFile(directory + QStringLiteral("/caldav-staging-XXXXXX")));
+        if (!mFile->open()) {
+            qCWarning(lcCalDav) << "Cannot open staging file" << mFile->fileName();
+            mFile.reset();
+            return false;
+        }
+        mStream.setDevice(mFile.data());
+        qCDebug(lcCalDav) << "Staging received resources in" << mFile->fileName()
+                          << "after" << mMemorySize << "bytes in memory.";
+    }
+    mStream << resource.href << resource.etag << resource.data;
+    if (mStream.status() != QDataStream::Ok) {
+        qCWarning(lcCalDav) << "Cannot write resource" << resource.href << "to staging file.";
+        return false;
+    }
+    mStagedCount += 1;
+    mStagedSize += resourceSize(resource);
+    return true;
+}
+
+QList<Buteo::Dav::Resource> ResourceStaging::takeStaged(int max)
+{
+    QList<Buteo::Dav::Resource> resources;
+    if (!mFile || mReadCount >= mStagedCount) {
+        return resources;
+    }
+    if (mReadCount == 0) {
+        mFile->flush();
+        mFile->seek(0);
+    }
+    while (mReadCount < mStagedCount && resources.count() < max) {
+        Buteo::Dav::Resource resource;
+        mStream >> resource.href >> resource.etag >> resource.data;
+        if (mStream.status() != QDataStream::Ok) {
+            qCWarning(lcCalDav) << "Cannot read back staged resources, dropping"
+                                << mStagedCount - mReadCount << "resources.";
+            mReadCount = mStagedCount;
+            break;
+        }
+        resources.append(resource);
+        mReadCount += 1;
+    }
+    return resources;
+}
+
+int ResourceStaging::stagedCount() const
+{
+    return mStagedCount;
+}
+
+qint64 ResourceStaging::stagedSize() const
+{
+    return mStagedSize;
+}
+
+qint64 ResourceStaging::highWaterMark() const
+{
+    return mHighWaterMark;
+}
+
+void ResourceStaging::clear()
+{
+    mStream.setDevice(nullptr);
+    mFile.reset();
+    mMemorySize = 0;
+    mStagedSize = 0;
+    mStagedCount = 0;
+    mReadCount = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#ifndef RESOURCESTAGING_H
+#define RESOURCESTAGING_H
+
+#include <davtypes.h>
+
+#include <QList>
+#include <QDataStream>
+#include <QScopedPointer>
+#include <QTemporaryFile>
+
+// Keeps track of the memory used by the received resources of a
+// notebook. Once the threshold is crossed, the raw resources are
+// written to a temporary file next to the calendar database instead
+// of being kept in memory, and they are streamed back when the
+// changes are applied.
+class ResourceStaging
+{
+public:
+    ResourceStaging();
+    ~ResourceStaging();
+
+    void setThreshold(qint64 bytes);
+    qint64 threshold() const;
+
+    // Returns true if the resource can be kept in memory and accounts
+    // for it, returns false if it should be staged on disk instead.
+    bool keepInMemory(const Buteo::Dav::Resource &resource);
+    bool stage(const Buteo::Dav::Resource &resource);
+
+    // Streams back at most max staged resources, in staging order.
+    QList<Buteo::Dav::Resource> takeStaged(int max);
+
+    int stagedCount() const;
+    qint64 stagedSize() const;
+    qint64 highWaterMark() const;
+
+    void clear();
+
+private:
+    static qint64 resourceSize(const Buteo::Dav::Resource &resource);
+
+    qint64 mThreshold;       // in bytes, 0 for no staging.
+    qint64 mMemorySize;      // estimated size of resources kept in memory.
+    qint64 mHighWaterMark;   // maximum of mMemorySize.
+    qint64 mStagedSize;      // size of resources written on disk.
+    int mStagedCount;
+    int mReadCount;
+    QScopedPointer<QTemporaryFile> mFile;
+    QDataStream mStream;
+};
+
+#endif // RESOURCESTAGING_H
@@ -1,5 +1,5 @@
 QT -= gui
-QT += network dbus
+QT += network dbus concurrent
 
 CONFIG += link_pkgconfig console
 
@@ -9,11 +9,15 @@ PKGCONFIG += signon-oauth2plugin KF5CalendarCore libmkcal-qt5
 INCLUDEPATH += $$PWD $$PWD/../lib
 LIBS += -L$$PWD/../lib -lbuteodav
 
+include($$PWD/../common/icsscanner.pri)
+
 SOURCES += \
         $$PWD/caldavclient.cpp \
         $$PWD/authhandler.cpp \
         $$PWD/incidencehandler.cpp \
         $$PWD/notebooksyncagent.cpp \
+        $$PWD/resourcestaging.cpp \
+        $$PWD/icsparser.cpp \
         $$PWD/logging.cpp
 
 HEADERS += \
@@ -22,6 +26,8 @@ HEADERS += \
         $$PWD/authhandler.h \
         $$PWD/incidencehandler.h \
         $$PWD/notebooksyncagent.h \
+        $$PWD/resourcestaging.h \
+        $$PWD/icsparser.h \
         $$PWD/logging.h
 
 OTHER_FILES += \
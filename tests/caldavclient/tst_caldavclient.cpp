@@ -23,6 +23,11 @@
 
 #include "caldavclient.h"
 
+#include <sailfishkeyprovider_iniparser.h>
+
+#include <extendedcalendar.h>
+#include <extendedstorage.h>
+
 #include <ProfileEngineDefs.h>
 #include <Accounts/AccountService>
 
@@ -47,6 +52,7 @@ private slots:
     void loadAccountCalendars();
     void mergeAccountCalendars();
     void removeAccountCalendar();
+    void cleanSyncMarker();
 
 private:
     Accounts::Manager* mManager;
@@ -69,6 +75,11 @@ static const QString SERVER_ADDRESS = QLatin1String("https://example.org");
 static const QString WEBDAV_PATH = QLatin1String("/dav/calendar");
 void tst_CalDavClient::initTestCase()
 {
+    if (qgetenv("SQLITESTORAGEDB").isEmpty()) {
+        qputenv("SQLITESTORAGEDB", "./db");
+        QFile::remove("./db");
+    }
+
     // Create a fake account
     mManager = new Accounts::Manager;
     QVERIFY(mManager->provider(QLatin1String("onlinesync")).isValid());
@@ -230,5 +241,57 @@ void tst_CalDavClient::removeAccountCalendar()
     QVERIFY(!names.contains(QLatin1String("Bar")));
 }
 
+static bool setCleanSyncMarker(int accountId, const char *value)
+{
+    const QByteArray iniFileDir = (QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+                                   + QStringLiteral("/system/privileged/Sync")).toUtf8();
+    const QByteArray iniFile = iniFileDir + "/caldav.ini";
+    return SailfishKeyProvider_ini_write(iniFileDir.constData(), iniFile.constData(), "General",
+                                         QStringLiteral("%1-cleaned").arg(accountId).toLatin1(),
+                                         value) == 0;
+}
+
+void tst_CalDavClient::cleanSyncMarker()
+{
+    CalDavClient client(QLatin1String("caldav"), mProfile, nullptr);
+    client.mManager = mManager; // So we can share the same Account pointers.
+    QVERIFY(client.init());
+    client.mCalendar = mKCal::ExtendedCalendar::Ptr(new mKCal::ExtendedCalendar(QTimeZone::utc()));
+    client.mStorage = mKCal::ExtendedCalendar::defaultStorage(client.mCalendar);
+    QVERIFY(client.mStorage->open());
+    QVERIFY(setCleanSyncMarker(mAccount->id(), "false"));
+
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    mKCal::Notebook::Ptr notebook(new mKCal::Notebook(QLatin1String("Cleaned"), QString()));
+    notebook->setAccount(QString::number(mAccount->id()));
+    notebook->setPluginName(QLatin1String("caldav"));
+    notebook->setCustomProperty("remoteCalendarPath", QLatin1String("/cleaned/"));
+    notebook->setSyncDate(now.addDays(-1));
+    QVERIFY(client.mStorage->addNotebook(notebook));
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setDtStart(now);
+    QVERIFY(client.mCalendar->addEvent(event, notebook->uid()));
+    QVERIFY(client.mStorage->save());
+
+    // A notebook with local changes not sent yet is left unreconciled,
+    // and the account is not marked as cleaned.
+    QVERIFY(client.cleanSyncRequired());
+    QVERIFY(client.mStorage->notebook(notebook->uid()));
+    QVERIFY(notebook->syncDate().isValid());
+    QVERIFY(client.cleanSyncRequired());
+
+    // Once the changes are sent, the notebook is reconciled.
+    notebook->setSyncDate(now.addSecs(60));
+    QVERIFY(client.mStorage->updateNotebook(notebook));
+    QVERIFY(client.cleanSyncRequired());
+    QVERIFY(client.mStorage->notebook(notebook->uid()));
+    QVERIFY(notebook->syncDate().isNull());
+    QVERIFY(!client.cleanSyncRequired());
+
+    QVERIFY(client.mStorage->deleteNotebook(notebook));
+    QVERIFY(setCleanSyncMarker(mAccount->id(), "false"));
+    client.mStorage->close();
+}
+
 #include "tst_caldavclient.moc"
 QTEST_MAIN(tst_CalDavClient)
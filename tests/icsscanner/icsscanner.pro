@@ -0,0 +1,15 @@
+TEMPLATE = app
+TARGET = tst_icsscanner
+
+QT += testlib
+QT -= gui
+
+CONFIG += debug
+
+include($$PWD/../../common/icsscanner.pri)
+
+SOURCES += tst_icsscanner.cpp
+
+target.path = /opt/tests/buteo/plugins/caldav/
+
+INSTALLS += target
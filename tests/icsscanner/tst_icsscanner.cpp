@@ -0,0 +1,359 @@
+/* -*- c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <QtTest>
+#include <QObject>
+
+#include <icsscanner.h>
+
+// Former string based implementations, used as reference
+// for the output and the performances of the scanner.
+namespace Legacy {
+    QString ensureUidInVEvent(const QString &data) {
+        // Ensure UID is in VEVENT section for single-event VCALENDAR blobs.
+        int eventCount = 0; // a value of 1 specifies that we should use the fixed data.
+        QStringList fixed;
+        QString storedUidLine;
+        const char separator = '\n';
+        QStringList original = data.split(separator);
+        bool inVEventSection = false;
+        for (QStringList::const_iterator it = original.constBegin(); it != original.constEnd(); it++) {
+            const QString &line(*it);
+            if (line.startsWith("END:VEVENT")) {
+                inVEventSection = false;
+            } else if (line.startsWith("BEGIN:VEVENT")) {
+                ++eventCount;
+                inVEventSection = true;
+                fixed.append(line);
+                if (!storedUidLine.isEmpty()) {
+                    fixed.append(storedUidLine);
+                    continue; // BEGIN:VEVENT line already appended
+                }
+                eventCount = -1;
+                break; // use original iCalData if got to VEVENT without finding UID
+            } else if (line.startsWith("UID")) {
+                if (!inVEventSection) {
+                    storedUidLine = line;
+                    continue; // do not append UID line yet
+                }
+            }
+            fixed.append(line);
+        }
+        // if we found exactly one event and were able to set its UID, return the fixed data.
+        // otherwise, return the original data.
+        return eventCount == 1 ? fixed.join(separator) : data;
+    }
+
+    QString ensureICalVersion(const QString &data) {
+        // Add VERSION:2.0 after the VCALENDAR tag to force iCal parsing.
+        const char separator = '\n';
+        QStringList original = data.split(separator);
+        QStringList fixed;
+    
+        for (QStringList::const_iterator it = original.constBegin(); it != original.constEnd(); it++) {
+            const QString &line(*it);
+        
+            fixed.append(line);
+            if (line.startsWith("BEGIN:VCALENDAR")) {
+                fixed.append(QStringLiteral("VERSION:2.0\r"));
+            }
+        }
+        return fixed.join(separator);
+    }
+
+    QString preprocessIcsData(const QString &data) {
+        QString temp = data;
+        temp.replace(QStringLiteral("\r\n"), QStringLiteral("\n"));
+        temp.replace(QStringLiteral("\n"), QStringLiteral("\r\n"));
+        temp = temp.append(QStringLiteral("\r\n\r\n"));
+        temp = ensureUidInVEvent(temp);
+        return temp;
+    }
+
+    QByteArray xmlSanitiseIcsData(const QByteArray &data) {
+        QList<QByteArray> lines = data.split('\n');
+        int depth = 0;
+        bool inCData = false;
+        QByteArray retn;
+        retn.reserve(data.size());
+        for (QList<QByteArray>::const_iterator it = lines.constBegin(); it != lines.constEnd(); it++) {
+            QByteArray line = *it;
+            if (line.contains("BEGIN:VCALENDAR")) {
+                depth += 1;
+                inCData = line.contains("<![CDATA[");
+            } else if (line.contains("END:VCALENDAR")) {
+                depth -= 1;
+                inCData = false;
+            } else if (depth > 0 && !inCData) {
+                // We're inside a VCALENDAR/ics block.
+                // First, hack to turn sanitised input into malformed input:
+                line.replace("&amp;",  "&");
+                line.replace("&quot;", "\"");
+                line.replace("&apos;", "'");
+                line.replace("&lt;",   "<");
+                line.replace("&gt;",   ">");
+                // Then, fix for malformed input:
+                QString lineStr(line);
+                // RegExp should avoid escaping & when this character is starting
+                // a valid numeric character reference (decimal or hexadecimal).
+                // Other HTLML entities like &nbsp; seems to make iCal parser
+                // fails, so we're encoding them.
+                lineStr.replace(QRegExp("&(?!#[0-9]+;|#x[0-9A-Fa-f]+;)"), "&amp;");
+                line = lineStr.toUtf8();
+                line.replace('"',  "&quot;");
+                line.replace('\'', "&apos;");
+                line.replace('<',  "&lt;");
+                line.replace('>',  "&gt;");
+            }
+            retn.append(line);
+            retn.append('\n');
+        }
+        return retn;
+    }
+}
+
+class tst_IcsScanner : public QObject
+{
+    Q_OBJECT
+
+public:
+    tst_IcsScanner();
+    virtual ~tst_IcsScanner();
+
+private slots:
+    void findByte();
+    void findXmlSpecial();
+
+    void normalise_data();
+    void normalise();
+    void insertICalVersion_data();
+    void insertICalVersion();
+    void xmlSanitise_data();
+    void xmlSanitise();
+
+    void benchmarkNormalise_data();
+    void benchmarkNormalise();
+    void benchmarkXmlSanitise_data();
+    void benchmarkXmlSanitise();
+};
+
+static QString icsData(int i, const QString &separator = QStringLiteral("\r\n"))
+{
+    const QStringList lines = QStringList()
+        << QStringLiteral("BEGIN:VCALENDAR")
+        << QStringLiteral("VERSION:2.0")
+        << QStringLiteral("PRODID:-//Test//EN")
+        << QStringLiteral("BEGIN:VEVENT")
+        << QStringLiteral("UID:event-%1").arg(i)
+        << QStringLiteral("DTSTAMP:20210101T000000Z")
+        << QStringLiteral("DTSTART:20210601T100000Z")
+        << QStringLiteral("DTEND:20210601T110000Z")
+        << QStringLiteral("SUMMARY:Meeting number %1 about the quarterly planning").arg(i)
+        << QStringLiteral("DESCRIPTION:A rather long description of the meeting\\, to make")
+        << QStringLiteral(" the data look like what servers actually send. Agenda follows.")
+        << QStringLiteral("LOCATION:Meeting room %1").arg(i % 10)
+        << QStringLiteral("END:VEVENT")
+        << QStringLiteral("END:VCALENDAR");
+    return lines.join(separator) + separator;
+}
+
+static QByteArray multiStatus(int count, bool escaped)
+{
+    QByteArray data("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<d:multistatus xmlns:d=\"DAV:\">\n");
+    for (int i = 0; i < count; i++) {
+        data += "<d:response><d:href>/calendar/event-" + QByteArray::number(i) + ".ics</d:href>\n";
+        data += "<d:propstat><d:prop><cal:calendar-data>";
+        QByteArray ics = icsData(i, QStringLiteral("\n")).toUtf8();
+        if (escaped) {
+            ics.replace("SUMMARY:", "SUMMARY:R&amp;D ");
+        } else {
+            ics.replace("SUMMARY:", "SUMMARY:R&D <team> ");
+        }
+        data += ics;
+        data += "</cal:calendar-data></d:prop></d:propstat></d:response>\n";
+    }
+    data += "</d:multistatus>\n";
+    return data;
+}
+
+tst_IcsScanner::tst_IcsScanner()
+{
+}
+
+tst_IcsScanner::~tst_IcsScanner()
+{
+}
+
+void tst_IcsScanner::findByte()
+{
+    const QByteArray data("0123456789abcdef0123456789abcdef\n0123");
+    const char *end = data.constData() + data.size();
+    for (int from = 0; from < data.size(); from++) {
+        const char *at = IcsScanner::findByte(data.constData() + from, end, '\n');
+        QCOMPARE(int(at - data.constData()), from <= 32 ? 32 : data.size());
+    }
+    QCOMPARE(IcsScanner::findByte(end, end, '\n'), end);
+}
+
+void tst_IcsScanner::findXmlSpecial()
+{
+    const QByteArray clean("SUMMARY:nothing special in this line at all");
+    for (const char special : QByteArray("\n&\"'<>\xc3")) {
+        for (int at = 0; at < clean.size(); at++) {
+            QByteArray data(clean);
+            data[at] = special;
+            QCOMPARE(int(IcsScanner::findXmlSpecial(data.constData(), data.constData() + data.size())
+                         - data.constData()), at);
+        }
+    }
+    QCOMPARE(IcsScanner::findXmlSpecial(clean.constData(), clean.constData() + clean.size()),
+             clean.constData() + clean.size());
+}
+
+void tst_IcsScanner::normalise_data()
+{
+    QTest::addColumn<QString>("data");
+    QTest::addColumn<bool>("uidRelocated");
+
+    QTest::newRow("CRLF") << icsData(0) << false;
+    QTest::newRow("LF") << icsData(0, QStringLiteral("\n")) << false;
+    QTest::newRow("mixed") << (icsData(0, QStringLiteral("\n")) + icsData(1, QStringLiteral("\r\n"))) << false;
+    QTest::newRow("no final line break") << icsData(0).left(icsData(0).length() - 2) << false;
+    QTest::newRow("empty") << QString() << false;
+    QTest::newRow("early UID")
+        << QStringLiteral("BEGIN:VCALENDAR\nVERSION:2.0\nUID:early\nBEGIN:VEVENT\n"
+                          "SUMMARY:test\nEND:VEVENT\nEND:VCALENDAR\n") << true;
+    QTest::newRow("early UID, two events")
+        << QStringLiteral("BEGIN:VCALENDAR\nUID:early\nBEGIN:VEVENT\nEND:VEVENT\n"
+                          "BEGIN:VEVENT\nEND:VEVENT\nEND:VCALENDAR\n") << false;
+    QTest::newRow("early UID, no event")
+        << QStringLiteral("BEGIN:VCALENDAR\nUID:early\nBEGIN:VTODO\nEND:VTODO\nEND:VCALENDAR\n") << false;
+    QTest::newRow("early UID, last line")
+        << QStringLiteral("BEGIN:VCALENDAR\r\nUID:early\r\nBEGIN:VEVENT") << true;
+    QTest::newRow("UTF-8") << QStringLiteral("BEGIN:VCALENDAR\nSUMMARY:\u00e9t\u00e9\r\nEND:VCALENDAR") << false;
+}
+
+void tst_IcsScanner::normalise()
+{
+    QFETCH(QString, data);
+    QFETCH(bool, uidRelocated);
+
+    bool relocated = !uidRelocated;
+    QCOMPARE(IcsScanner::normalise(data.toUtf8(), &relocated), Legacy::preprocessIcsData(data).toUtf8());
+    QCOMPARE(relocated, uidRelocated);
+}
+
+void tst_IcsScanner::insertICalVersion_data()
+{
+    QTest::addColumn<QString>("data");
+
+    QTest::newRow("event") << Legacy::preprocessIcsData(icsData(0));
+    QTest::newRow("two calendars") << Legacy::preprocessIcsData(icsData(0) + icsData(1));
+    QTest::newRow("last line") << QStringLiteral("SUMMARY:x\r\nBEGIN:VCALENDAR");
+    QTest::newRow("not at line start") << QStringLiteral("X-BEGIN:VCALENDAR\r\n");
+}
+
+void tst_IcsScanner::insertICalVersion()
+{
+    QFETCH(QString, data);
+
+    QCOMPARE(IcsScanner::insertICalVersion(data.toUtf8()), Legacy::ensureICalVersion(data).toUtf8());
+}
+
+void tst_IcsScanner::xmlSanitise_data()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    QTest::newRow("escaped") << multiStatus(3, true);
+    QTest::newRow("not escaped") << multiStatus(3, false);
+    QTest::newRow("entities")
+        << QByteArray("<a>\nBEGIN:VCALENDAR\nX:&#233; &#xE9; &nbsp; &amp;quot; &lt;b&gt;\n"
+                      "X:\xc3\xa9t\xc3\xa9 'quoted' \"twice\"\nEND:VCALENDAR\n</a>");
+    QTest::newRow("CDATA")
+        << QByteArray("<a><![CDATA[BEGIN:VCALENDAR\nX:a<b>&c\nEND:VCALENDAR]]></a>\n");
+    QTest::newRow("outside calendar") << QByteArray("<a>\n<b>'x' & \"y\"</b>\n</a>");
+    QTest::newRow("empty") << QByteArray();
+}
+
+void tst_IcsScanner::xmlSanitise()
+{
+    QFETCH(QByteArray, data);
+
+    QCOMPARE(IcsScanner::xmlSanitise(data), Legacy::xmlSanitiseIcsData(data));
+}
+
+void tst_IcsScanner::benchmarkNormalise_data()
+{
+    QTest::addColumn<bool>("legacy");
+
+    QTest::newRow("legacy") << true;
+    QTest::newRow("scanner") << false;
+}
+
+void tst_IcsScanner::benchmarkNormalise()
+{
+    QFETCH(bool, legacy);
+
+    QStringList resources;
+    for (int i = 0; i < 1000; i++) {
+        resources << icsData(i, (i % 2) ? QStringLiteral("\n") : QStringLiteral("\r\n"));
+    }
+
+    // Include the UTF-8 conversion, the scanner works on the
+    // bytes given to the iCal parser while the former functions
+    // were working on strings.
+    QBENCHMARK {
+        for (const QString &resource : const_cast<const QStringList&>(resources)) {
+            if (legacy) {
+                QVERIFY(!Legacy::preprocessIcsData(resource).toUtf8().isEmpty());
+            } else {
+                QVERIFY(!IcsScanner::normalise(resource.toUtf8()).isEmpty());
+            }
+        }
+    }
+}
+
+void tst_IcsScanner::benchmarkXmlSanitise_data()
+{
+    QTest::addColumn<bool>("legacy");
+    QTest::addColumn<bool>("escaped");
+
+    QTest::newRow("legacy, escaped") << true << true;
+    QTest::newRow("scanner, escaped") << false << true;
+    QTest::newRow("legacy, not escaped") << true << false;
+    QTest::newRow("scanner, not escaped") << false << false;
+}
+
+void tst_IcsScanner::benchmarkXmlSanitise()
+{
+    QFETCH(bool, legacy);
+    QFETCH(bool, escaped);
+
+    const QByteArray data = multiStatus(1000, escaped);
+    QBENCHMARK {
+        if (legacy) {
+            QVERIFY(!Legacy::xmlSanitiseIcsData(data).isEmpty());
+        } else {
+            QVERIFY(!IcsScanner::xmlSanitise(data).isEmpty());
+        }
+    }
+}
+
+#include "tst_icsscanner.moc"
+QTEST_MAIN(tst_IcsScanner)
@@ -71,6 +71,36 @@ private slots:
 
     void result();
 
+    void commitStrategy();
+    void stagedResources();
+    void parallelParsing();
+    void exportIcs();
+    void exportIcsTimeZoneOrder();
+    void skipUnchangedUpload();
+    void unchangedResource();
+    void sentETags();
+    void uploadWindow();
+    void uploadFailureBackoff();
+    void uploadConflict();
+    void deletionConflict();
+    void pushSync();
+    void downloadOnlyDelta();
+    void prefetchLocalState();
+    void windowSlices();
+    void windowSliceLocalChange();
+    void refreshTiers();
+    void progressiveSlowSync();
+    void twoPhaseSlowSync();
+    void checkpointResume();
+    void prepareCleanSync();
+    void evictOutOfWindow();
+    void adaptivePolling();
+
+    void benchmarkExceptions_data();
+    void benchmarkExceptions();
+    void benchmarkUpload();
+    void benchmarkInitialUpsync();
+
 private:
     Buteo::Dav::Client *m_dav = nullptr;
     NotebookSyncAgent *m_agent;
@@ -274,6 +304,31 @@ static QString fetchETag(KCalendarCore::Incidence::Ptr incidence)
     return QString();
 }
 
+static Buteo::Dav::Resource eventResource(const QString &uid, const QDateTime &dtStart,
+                                          const QString &etag,
+                                          const QString &summary = QString())
+{
+    KCalendarCore::MemoryCalendar::Ptr memoryCalendar(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+    KCalendarCore::Event::Ptr ev(new KCalendarCore::Event);
+    ev->setUid(uid);
+    if (!summary.isEmpty()) {
+        ev->setSummary(summary);
+    }
+    ev->setDtStart(dtStart);
+    memoryCalendar->addEvent(ev);
+    KCalendarCore::ICalFormat icalFormat;
+    Buteo::Dav::Resource resource;
+    resource.href = QStringLiteral("/testCal/%1.ics").arg(uid);
+    resource.etag = etag;
+    resource.data = icalFormat.toString(memoryCalendar, QString(), false);
+    return resource;
+}
+
+static Buteo::Dav::Client::Reply noErrorReply(const QString &uri = QLatin1String("/testCal/"))
+{
+    return Buteo::Dav::Client::Reply(uri, QNetworkReply::NoError, QString(), QByteArray());
+}
+
 void tst_NotebookSyncAgent::updateEvent()
 {
     // Populate the database.
@@ -962,5 +1017,1151 @@ void tst_NotebookSyncAgent::result()
 
 }
 
+void tst_NotebookSyncAgent::commitStrategy()
+{
+    QList<NotebookSyncAgent::CalendarResource> resources;
+    for (int i = 0; i < 5; i++) {
+        KCalendarCore::Incidence::Ptr ev = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+        ev->setUid(QStringLiteral("commitStrategy-%1").arg(i));
+        ev->setSummary(QStringLiteral("Batched event %1").arg(i));
+        ev->setDtStart(QDateTime::currentDateTimeUtc());
+        resources << NotebookSyncAgent::CalendarResource(QStringLiteral("/testCal/commit-%1.ics").arg(i),
+                                                         QStringLiteral("etag"),
+                                                         KCalendarCore::Incidence::List() << ev);
+    }
+
+    // Default strategy doesn't save while updating.
+    QVERIFY(m_agent->updateIncidences(resources.mid(0, 1)));
+    QCOMPARE(m_agent->commitCount(), 0);
+
+    // In batch mode, storage is saved every two incidences.
+    m_agent->setCommitStrategy(NotebookSyncAgent::CommitPerBatch, 2);
+    QVERIFY(m_agent->updateIncidences(resources.mid(1)));
+    QCOMPARE(m_agent->commitCount(), 1);
+    QVERIFY(m_agent->deleteIncidences(KCalendarCore::Incidence::List()
+                                      << resources[1].incidences.first()));
+    QCOMPARE(m_agent->commitCount(), 2);
+
+    // Changes of the whole account are saved by the caller.
+    m_agent->setCommitStrategy(NotebookSyncAgent::CommitPerAccount);
+    m_agent->mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
+    QVERIFY(m_agent->applyRemoteChanges());
+    QCOMPARE(m_agent->commitCount(), 2);
+    QVERIFY(m_agent->mStorage->save());
+    QVERIFY(m_agent->storeNotebook());
+    QCOMPARE(m_agent->mStorage->notebook(m_agent->mNotebook->uid())->syncDate(),
+             m_agent->mNotebookSyncedDateTime);
+    QCOMPARE(m_agent->result().localItems().added, unsigned(5));
+
+    // Changes not saved by the caller are reported as failed.
+    m_agent->setCommitFailed();
+    QCOMPARE(m_agent->result().localItems().added, unsigned(0));
+}
+
+void tst_NotebookSyncAgent::stagedResources()
+{
+    QList<Buteo::Dav::Resource> resources;
+    for (int i = 0; i < 3; i++) {
+        resources << eventResource(QStringLiteral("staged-%1").arg(i),
+                                   QDateTime::currentDateTimeUtc(),
+                                   QStringLiteral("\"etag-%1\"").arg(i),
+                                   QStringLiteral("Staged event %1").arg(i));
+    }
+
+    // Keep only the first resource in memory.
+    m_agent->setStagingThreshold((resources[0].href.size() + resources[0].etag.size()
+                                  + resources[0].data.size()) * qint64(sizeof(QChar)));
+    m_agent->mSyncMode = NotebookSyncAgent::SlowSync;
+    m_agent->mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
+    m_agent->mPendingActions = 1;
+    m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(), resources);
+    QTRY_VERIFY(m_agent->isFinished());
+    QCOMPARE(m_agent->mReceivedCalendarResources.count(), 1);
+    QCOMPARE(m_agent->mStaging.stagedCount(), 2);
+    QVERIFY(m_agent->memoryHighWaterMark() > 0);
+
+    QVERIFY(m_agent->applyRemoteChanges());
+    for (int i = 0; i < 3; i++) {
+        KCalendarCore::Event::Ptr ev = m_agent->mCalendar->event(QStringLiteral("NBUID:123456789:staged-%1").arg(i));
+        QVERIFY(ev);
+        QCOMPARE(ev->summary(), QStringLiteral("Staged event %1").arg(i));
+    }
+    QCOMPARE(m_agent->result().localItems().added, unsigned(3));
+}
+
+void tst_NotebookSyncAgent::parallelParsing()
+{
+    // Parsing of several replies is done concurrently, but resources
+    // are received in the order of the replies.
+    QList<Buteo::Dav::Resource> first, second;
+    for (int i = 0; i < 40; i++) {
+        const Buteo::Dav::Resource resource
+            = eventResource(QStringLiteral("parsed-%1").arg(i),
+                            QDateTime::currentDateTimeUtc(),
+                            QStringLiteral("\"etag-%1\"").arg(i));
+        if (i < 30) {
+            first << resource;
+        } else {
+            second << resource;
+        }
+    }
+
+    QSignalSpy finished(m_agent, &NotebookSyncAgent::finished);
+    m_agent->mSyncMode = NotebookSyncAgent::SlowSync;
+    m_agent->mPendingActions = 2;
+    m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(), first);
+    m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(), second);
+    QVERIFY(!m_agent->isFinished());
+    QTRY_COMPARE(finished.count(), 1);
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(m_agent->mParsingJobs.isEmpty());
+    QCOMPARE(m_agent->mReceivedCalendarResources.count(), 40);
+    for (int i = 0; i < 40; i++) {
+        const NotebookSyncAgent::CalendarResource &resource = m_agent->mReceivedCalendarResources[i];
+        QCOMPARE(resource.href, QStringLiteral("/testCal/parsed-%1.ics").arg(i));
+        QCOMPARE(resource.incidences.count(), 1);
+        QCOMPARE(resource.incidences.first()->uid(), QStringLiteral("parsed-%1").arg(i));
+    }
+}
+
+void tst_NotebookSyncAgent::exportIcs()
+{
+    const QTimeZone helsinki("Europe/Helsinki");
+    KCalendarCore::Event::Ptr parent(new KCalendarCore::Event);
+    parent->setUid(QStringLiteral("NBUID:123456789:export-series"));
+    parent->setSummary(QStringLiteral("Weekly meeting"));
+    parent->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), helsinki));
+    parent->setDtEnd(QDateTime(QDate(2021, 3, 1), QTime(11, 0), helsinki));
+    parent->recurrence()->setWeekly(1);
+    parent->recurrence()->addExDateTime(QDateTime(QDate(2021, 3, 8), QTime(10, 0), helsinki));
+    parent->recurrence()->addExDateTime(QDateTime(QDate(2021, 3, 15), QTime(10, 0), helsinki));
+    parent->addComment(QStringLiteral("buteo:caldav:uri:/testCal/export-series.ics"));
+    parent->addComment(QStringLiteral("buteo:caldav:etag:\"etag\""));
+    parent->addComment(QStringLiteral("A genuine comment"));
+    parent->setCustomProperty("buteo", "uri", QStringLiteral("/testCal/export-series.ics"));
+
+    KCalendarCore::Event::Ptr exception(new KCalendarCore::Event);
+    exception->setUid(parent->uid());
+    exception->setRecurrenceId(QDateTime(QDate(2021, 3, 8), QTime(10, 0), helsinki));
+    exception->setSummary(QStringLiteral("Moved meeting"));
+    exception->setDtStart(QDateTime(QDate(2021, 3, 8), QTime(14, 0), helsinki));
+    exception->setDtEnd(QDateTime(QDate(2021, 3, 8), QTime(15, 0), helsinki));
+    exception->addComment(QStringLiteral("buteo:caldav:detached-and-synced"));
+
+    const QByteArray ics = IncidenceHandler::toIcs(parent, KCalendarCore::Incidence::List() << exception);
+    QVERIFY(!ics.contains("buteo"));
+    QVERIFY(!ics.contains("NBUID"));
+    QCOMPARE(ics.count("BEGIN:VTIMEZONE"), 1);
+    // The incidences are left untouched.
+    QCOMPARE(parent->uid(), QStringLiteral("NBUID:123456789:export-series"));
+    QCOMPARE(parent->comments().count(), 3);
+    QCOMPARE(parent->recurrence()->exDateTimes().count(), 2);
+
+    KCalendarCore::MemoryCalendar::Ptr calendar(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+    KCalendarCore::ICalFormat icalFormat;
+    QVERIFY(icalFormat.fromRawString(calendar, ics));
+    KCalendarCore::Incidence::Ptr exported = calendar->incidence(QStringLiteral("export-series"));
+    QVERIFY(exported);
+    QCOMPARE(exported->comments(), QStringList() << QStringLiteral("A genuine comment"));
+    QVERIFY(exported->customProperty("buteo", "uri").isEmpty());
+    QCOMPARE(exported->recurrence()->exDateTimes(),
+             KCalendarCore::DateTimeList() << QDateTime(QDate(2021, 3, 15), QTime(10, 0), helsinki));
+    QCOMPARE(exported->dtStart(), parent->dtStart());
+    QCOMPARE(exported->dtStart().timeZone(), helsinki);
+    QCOMPARE(calendar->instances(exported).count(), 1);
+}
+
+void tst_NotebookSyncAgent::exportIcsTimeZoneOrder()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:two-zones"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), QTimeZone("Europe/Helsinki")));
+    event->setDtEnd(QDateTime(QDate(2021, 3, 1), QTime(9, 0), QTimeZone("America/New_York")));
+
+    // Zones are written sorted by TZID, whatever the order they are used in.
+    const QByteArray ics = IncidenceHandler::toIcs(event);
+    QCOMPARE(ics.count("BEGIN:VTIMEZONE"), 2);
+    const int newYork = ics.indexOf("TZID:America/New_York\r\n");
+    const int helsinki = ics.indexOf("TZID:Europe/Helsinki\r\n");
+    QVERIFY(newYork > 0);
+    QVERIFY(helsinki > newYork);
+    for (int i = 0; i < 10; i++) {
+        QCOMPARE(IncidenceHandler::contentHash(IncidenceHandler::toIcs(event)),
+                 IncidenceHandler::contentHash(ics));
+    }
+}
+
+void tst_NotebookSyncAgent::skipUnchangedUpload()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:unchanged"));
+    event->setSummary(QStringLiteral("Unchanged event"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    event->setDtEnd(QDateTime(QDate(2021, 3, 1), QTime(11, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    m_agent->mStorage->save();
+
+    const QString uri = QStringLiteral("/testCal/unchanged.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""),
+                            IncidenceHandler::contentHash(IncidenceHandler::toIcs(event)));
+
+    // Only the modification date changed, nothing is uploaded.
+    event->setLastModified(QDateTime::currentDateTimeUtc().addDays(1));
+    m_agent->mLocalModifications << event;
+    m_agent->sendLocalChanges();
+    QVERIFY(m_agent->mSentUids.isEmpty());
+    QCOMPARE(m_agent->skippedUploadCount(), 1);
+    QCOMPARE(m_agent->result().remoteItems().modified, unsigned(0));
+
+    // A real modification is uploaded.
+    event->setSummary(QStringLiteral("Modified event"));
+    m_agent->sendLocalChanges();
+    QCOMPARE(m_agent->mSentUids.value(uri), event->uid());
+    QCOMPARE(m_agent->skippedUploadCount(), 1);
+    QCOMPARE(m_agent->result().remoteItems().modified, unsigned(1));
+    QCOMPARE(m_agent->mSentHashes.value(uri),
+             IncidenceHandler::contentHash(IncidenceHandler::toIcs(event)));
+}
+
+void tst_NotebookSyncAgent::unchangedResource()
+{
+    const QDateTime dtStart(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC);
+    Buteo::Dav::Resource resource
+        = eventResource(QStringLiteral("unchanged-resource"), dtStart,
+                        QStringLiteral("\"etag-1\""),
+                        QStringLiteral("Unchanged resource"));
+
+    m_agent->mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
+    m_agent->mRemoteChanges.insert(resource.href);
+    QVERIFY(m_agent->updateIncidences(QList<NotebookSyncAgent::CalendarResource>()
+                                      << NotebookSyncAgent::CalendarResource(resource)));
+    QCOMPARE(m_agent->mRemoteAdditions.count(), 1);
+    KCalendarCore::Incidence::Ptr stored = m_agent->mCalendar->incidence(QStringLiteral("NBUID:123456789:unchanged-resource"));
+    QVERIFY(stored);
+    const QDateTime lastModified = stored->lastModified();
+
+    // Same content with a new etag, only the etag is updated,
+    // without counting in the batch of changes to save.
+    m_agent->setCommitStrategy(NotebookSyncAgent::CommitPerBatch, 1);
+    resource.etag = QStringLiteral("\"etag-2\"");
+    QVERIFY(m_agent->updateIncidences(QList<NotebookSyncAgent::CalendarResource>()
+                                      << NotebookSyncAgent::CalendarResource(resource)));
+    QCOMPARE(m_agent->mRemoteModifications.count(), 0);
+    QCOMPARE(m_agent->mUncommittedChanges, 0);
+    QCOMPARE(fetchETag(stored), QStringLiteral("\"etag-2\""));
+    QCOMPARE(stored->lastModified(), lastModified);
+
+    // New content is applied.
+    resource = eventResource(QStringLiteral("unchanged-resource"), dtStart,
+                             QStringLiteral("\"etag-3\""),
+                             QStringLiteral("Changed resource"));
+    QVERIFY(m_agent->updateIncidences(QList<NotebookSyncAgent::CalendarResource>()
+                                      << NotebookSyncAgent::CalendarResource(resource)));
+    QCOMPARE(m_agent->mRemoteModifications.count(), 1);
+    QCOMPARE(stored->summary(), QStringLiteral("Changed resource"));
+    QCOMPARE(fetchETag(stored), QStringLiteral("\"etag-3\""));
+}
+
+void tst_NotebookSyncAgent::sentETags()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:sent"));
+    event->setSummary(QStringLiteral("Sent event"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    m_agent->mStorage->save();
+
+    // The PUT replies didn't provide the new etags.
+    const QString uri = QStringLiteral("/testCal/sent.ics");
+    const QString missing = QStringLiteral("/testCal/missing.ics");
+    m_agent->mSentUids.insert(uri, event->uid());
+    m_agent->mSentHashes.insert(uri, QStringLiteral("hash"));
+    m_agent->mSentUids.insert(missing, QStringLiteral("NBUID:123456789:missing"));
+    m_agent->mPendingActions = 1;
+    m_agent->requestFinished();
+    QCOMPARE(m_agent->mETagRequests.count(), 1);
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // Etags asked for other resources are not taken for these.
+    QHash<QString, QString> etags;
+    etags.insert(uri, QStringLiteral("\"etag\""));
+    m_agent->processETags(noErrorReply(), 0, QStringList() << QStringLiteral("/testCal/other.ics"),
+                          etags);
+    QCOMPARE(m_agent->mETagRequests.count(), 1);
+    QCOMPARE(m_agent->mSentUids.count(), 2);
+
+    m_agent->processETags(noErrorReply(), 0, m_agent->mETagRequests.first().first, etags);
+    QVERIFY(m_agent->mETagRequests.isEmpty());
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(m_agent->mSentUids.isEmpty());
+    QCOMPARE(fetchUri(event), uri);
+    QCOMPARE(fetchETag(event), QStringLiteral("\"etag\""));
+    QVERIFY(event->comments().contains(QStringLiteral("buteo:caldav:hash:hash")));
+    QVERIFY(m_agent->mFailingUploads.contains(missing));
+    QVERIFY(!m_agent->mFailingUploads.contains(uri));
+}
+
+void tst_NotebookSyncAgent::uploadWindow()
+{
+    for (int i = 0; i < 10; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("NBUID:123456789:window-%1").arg(i));
+        event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+        m_agent->mLocalAdditions << event;
+    }
+    m_agent->setUploadWindow(3);
+    m_agent->sendLocalChanges();
+    QCOMPARE(m_agent->mSendingUploads.count(), 3);
+    QCOMPARE(m_agent->mUploadQueue.count(), 7);
+    QCOMPARE(m_agent->mPendingActions, 10);
+    QVERIFY(m_agent->mSendingUploads.contains(QStringLiteral("/testCal/window-0.ics")));
+
+    // A reply lets the next upload go.
+    m_agent->resourceSent(noErrorReply(QStringLiteral("/testCal/window-0.ics")), 0,
+                          QStringLiteral("\"etag\""));
+    QCOMPARE(m_agent->mSendingUploads.count(), 3);
+    QCOMPARE(m_agent->mUploadQueue.count(), 6);
+    QCOMPARE(m_agent->mPendingActions, 9);
+    QVERIFY(m_agent->mSendingUploads.contains(QStringLiteral("/testCal/window-3.ics")));
+
+    // A transient failure is queued again after a delay.
+    const QString href = QStringLiteral("/testCal/window-1.ics");
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(href, QNetworkReply::TimeoutError,
+                                                    QString(), QByteArray()), 0,
+                          QString());
+    QVERIFY(!m_agent->mFailingUploads.contains(href));
+    QCOMPARE(m_agent->mPendingActions, 9);
+    QCOMPARE(m_agent->mSendingUploads.count(), 3);
+    QCOMPARE(m_agent->mUploadQueue.count(), 5);
+    QTRY_COMPARE(m_agent->mRetryingUploads, 0);
+    QCOMPARE(m_agent->mUploadQueue.first().href, href);
+    QCOMPARE(m_agent->mUploadQueue.first().attempts, 1);
+
+    // Other failures are final.
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(QStringLiteral("/testCal/window-2.ics"),
+                                                    QNetworkReply::ContentConflictError,
+                                                    QString(), QByteArray()), 0,
+                          QString());
+    QVERIFY(m_agent->mFailingUploads.contains(QStringLiteral("/testCal/window-2.ics")));
+    QCOMPARE(m_agent->mPendingActions, 8);
+    QVERIFY(m_agent->mSendingUploads.contains(href));
+}
+
+void tst_NotebookSyncAgent::uploadFailureBackoff()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:failing"));
+    event->setSummary(QStringLiteral("Failing event"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/failing.ics");
+    const QString etag = QStringLiteral("\"etag\"");
+    m_agent->updateHrefETag(event->uid(), uri, etag);
+    m_agent->mStorage->save();
+
+    // The server rejects the upload for its size.
+    m_agent->mLocalModifications << event;
+    m_agent->mSentUids.insert(uri, event->uid());
+    m_agent->mPendingActions = 1;
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(uri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 413,
+                          QString());
+    QVERIFY(m_agent->isFinished());
+    QCOMPARE(event->customProperty("VOLATILE", "SYNC-FAILURE"), QStringLiteral("upload"));
+    QCOMPARE(event->customProperty("VOLATILE", "SYNC-FAILURE-ATTEMPTS"), QStringLiteral("1"));
+    QCOMPARE(event->customProperty("VOLATILE", "SYNC-FAILURE-KIND"), QStringLiteral("permanent"));
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc().addSecs(60));
+
+    // Not retried before the backoff delay expires.
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(uri, etag);
+    m_agent->mLocalModifications.clear();
+    QVERIFY(m_agent->calculateDelta(remoteUriEtags,
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    QCOMPARE(m_agent->mLocalModifications.count(), 0);
+
+    // Retried once it has expired.
+    event->setCustomProperty("VOLATILE", "SYNC-FAILURE-LAST-ATTEMPT",
+                             QDateTime::currentDateTimeUtc().addSecs(-7 * 3600).toString(Qt::ISODate));
+    m_agent->mStorage->save();
+    QVERIFY(m_agent->calculateDelta(remoteUriEtags,
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    QCOMPARE(m_agent->mLocalModifications.count(), 1);
+
+    // Success clears the failure record.
+    m_agent->mSentUids.insert(uri, event->uid());
+    m_agent->mPendingActions = 1;
+    m_agent->resourceSent(noErrorReply(uri), 0, QStringLiteral("\"etag-2\""));
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(event->customProperty("VOLATILE", "SYNC-FAILURE").isEmpty());
+    QVERIFY(event->customProperty("VOLATILE", "SYNC-FAILURE-ATTEMPTS").isEmpty());
+}
+
+void tst_NotebookSyncAgent::uploadConflict()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:conflict"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    KCalendarCore::Event::Ptr other(new KCalendarCore::Event);
+    other->setUid(QStringLiteral("NBUID:123456789:other"));
+    other->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    QVERIFY(m_agent->mCalendar->addEvent(other, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/conflict.ics");
+    const QString otherUri = QStringLiteral("/testCal/other.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""));
+    m_agent->updateHrefETag(other->uid(), otherUri, QStringLiteral("\"etag\""));
+    m_agent->mStorage->save();
+
+    // By default, the server copy is downloaded.
+    m_agent->mLocalModifications << event;
+    m_agent->sendLocalChanges();
+    QCOMPARE(m_agent->mPendingActions, 1);
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(uri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 412,
+                          QString());
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QVERIFY(m_agent->mSentUids.isEmpty());
+    QVERIFY(m_agent->mRemoteChanges.contains(uri));
+    QVERIFY(!m_agent->mFailingUploads.contains(uri));
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // When preferring local changes, the upload is sent again
+    // over the current server copy.
+    m_agent->mPendingActions = 0;
+    m_agent->mLocalModifications.clear();
+    m_agent->mLocalModifications << other;
+    m_agent->setConflictResolutionPolicy(Buteo::SyncProfile::CR_PREFER_LOCAL_CHANGES);
+    m_agent->sendLocalChanges();
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(otherUri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 412,
+                          QString());
+    QCOMPARE(m_agent->mConflicts.count(), 1);
+    QCOMPARE(m_agent->mPendingActions, 1);
+    QHash<QString, QString> etags;
+    etags.insert(otherUri, QStringLiteral("\"etag-server\""));
+    m_agent->processETags(noErrorReply(), 0, QStringList() << otherUri, etags);
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QCOMPARE(m_agent->mSentUids.value(otherUri), other->uid());
+    QCOMPARE(m_agent->mSendingUploads.value(otherUri).etag, QStringLiteral("\"etag-server\""));
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // A new conflict is not resolved again.
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(otherUri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 412,
+                          QString());
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(m_agent->mFailingUploads.contains(otherUri));
+
+    // Without down sync, the server copy is kept when preferred,
+    // the local change is dropped.
+    KCalendarCore::Event::Ptr uploadOnly(new KCalendarCore::Event);
+    uploadOnly->setUid(QStringLiteral("NBUID:123456789:upload-only"));
+    uploadOnly->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(uploadOnly, m_agent->mNotebook->uid()));
+    const QString uploadOnlyUri = QStringLiteral("/testCal/upload-only.ics");
+    m_agent->updateHrefETag(uploadOnly->uid(), uploadOnlyUri, QStringLiteral("\"etag\""));
+    m_agent->mEnableDownsync = false;
+    m_agent->setConflictResolutionPolicy(Buteo::SyncProfile::CR_PREFER_REMOTE_CHANGES);
+    m_agent->mLocalModifications.clear();
+    m_agent->mLocalModifications << uploadOnly;
+    m_agent->sendLocalChanges();
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(uploadOnlyUri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 412,
+                          QString());
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QVERIFY(!m_agent->mRemoteChanges.contains(uploadOnlyUri));
+    QVERIFY(!m_agent->mFailingUploads.contains(uploadOnlyUri));
+    QCOMPARE(m_agent->result().remoteItems().modified, unsigned(0));
+}
+
+void tst_NotebookSyncAgent::deletionConflict()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:deleted"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    KCalendarCore::Event::Ptr other(new KCalendarCore::Event);
+    other->setUid(QStringLiteral("NBUID:123456789:other-deleted"));
+    other->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    QVERIFY(m_agent->mCalendar->addEvent(other, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/deleted.ics");
+    const QString otherUri = QStringLiteral("/testCal/other-deleted.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""));
+    m_agent->updateHrefETag(other->uid(), otherUri, QStringLiteral("\"etag\""));
+    m_agent->mStorage->save();
+
+    // By default, the server copy is downloaded over the local deletion.
+    m_agent->mLocalDeletions << event;
+    m_agent->sendLocalChanges();
+    QVERIFY(m_agent->mSendingUploads.value(uri).deletion);
+    QCOMPARE(m_agent->mPendingActions, 1);
+    m_agent->resourceDeleted(Buteo::Dav::Client::Reply(uri, QNetworkReply::UnknownContentError,
+                                                       QString(), QByteArray()), 412);
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QVERIFY(m_agent->mRemoteChanges.contains(uri));
+    QVERIFY(!m_agent->mFailingUploads.contains(uri));
+    QVERIFY(incidenceListContains(m_agent->mPurgeList, event));
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // When preferring local changes, the deletion is sent again
+    // over the current server copy.
+    m_agent->mPendingActions = 0;
+    m_agent->mLocalDeletions.clear();
+    m_agent->mPurgeList.clear();
+    m_agent->mLocalDeletions << other;
+    m_agent->setConflictResolutionPolicy(Buteo::SyncProfile::CR_PREFER_LOCAL_CHANGES);
+    m_agent->sendLocalChanges();
+    m_agent->resourceDeleted(Buteo::Dav::Client::Reply(otherUri, QNetworkReply::UnknownContentError,
+                                                       QString(), QByteArray()), 412);
+    QCOMPARE(m_agent->mConflicts.count(), 1);
+    QCOMPARE(m_agent->mPendingActions, 1);
+    QHash<QString, QString> etags;
+    etags.insert(otherUri, QStringLiteral("\"etag-server\""));
+    m_agent->processETags(noErrorReply(), 0, QStringList() << otherUri, etags);
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QVERIFY(m_agent->mSendingUploads.value(otherUri).deletion);
+    QCOMPARE(m_agent->mSendingUploads.value(otherUri).etag, QStringLiteral("\"etag-server\""));
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    m_agent->resourceDeleted(noErrorReply(otherUri), 0);
+    QVERIFY(m_agent->isFinished());
+    QVERIFY(!m_agent->mFailingUploads.contains(otherUri));
+    QVERIFY(incidenceListContains(m_agent->mPurgeList, other));
+}
+
+void tst_NotebookSyncAgent::pushSync()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:push"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    event->setCreated(now.addSecs(-3600));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/push.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""));
+    m_agent->mNotebook->setSyncDate(now.addSecs(-1800));
+    m_agent->mNotebook->setCustomProperty("lastFullSyncDate", now.addSecs(-1800).toString(Qt::ISODate));
+    event->setSummary(QStringLiteral("Pushed event"));
+    event->setLastModified(now);
+    m_agent->mStorage->save();
+
+    // Outside of the push window, a quick sync is done.
+    m_agent->setPushWindow(60);
+    QVERIFY(!m_agent->canPush());
+
+    // The local modification is sent directly, conditionally on the stored etag.
+    m_agent->setPushWindow(3600);
+    m_agent->startSync(now.addDays(-30), now.addDays(30), true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::PushSync);
+    QCOMPARE(m_agent->mLocalModifications.count(), 1);
+    QCOMPARE(m_agent->mSendingUploads.value(uri).etag, QStringLiteral("\"etag\""));
+    QTRY_COMPARE(m_agent->mPendingActions, 1);
+
+    // The server copy was modified, falls back to a quick sync.
+    m_agent->resourceSent(Buteo::Dav::Client::Reply(uri, QNetworkReply::UnknownContentError,
+                                                    QString(), QByteArray()), 412,
+                          QString());
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QVERIFY(m_agent->mLocalModifications.isEmpty());
+    QVERIFY(m_agent->mConflicts.isEmpty());
+    QCOMPARE(m_agent->mPendingActions, 1);
+}
+
+void tst_NotebookSyncAgent::downloadOnlyDelta()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QStringList names = QStringList() << "same" << "changed" << "deleted" << "local";
+    for (const QString &name : names) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("NBUID:123456789:") + name);
+        event->setDtStart(now);
+        QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+        if (name != QStringLiteral("local")) {
+            m_agent->updateHrefETag(event->uid(), QStringLiteral("/testCal/%1.ics").arg(name),
+                                    QStringLiteral("\"etag\""));
+        }
+    }
+    m_agent->mStorage->save();
+    m_agent->mFromDateTime = now.addDays(-1);
+    m_agent->mToDateTime = now.addDays(1);
+
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(QStringLiteral("/testCal/same.ics"), QStringLiteral("\"etag\""));
+    remoteUriEtags.insert(QStringLiteral("/testCal/changed.ics"), QStringLiteral("\"etag-2\""));
+    remoteUriEtags.insert(QStringLiteral("/testCal/new.ics"), QStringLiteral("\"etag\""));
+    QVERIFY(m_agent->calculateRemoteDelta(remoteUriEtags,
+                                          &m_agent->mRemoteChanges,
+                                          &m_agent->mRemoteDeletions));
+    QCOMPARE(m_agent->mRemoteChanges, QSet<QString>() << QStringLiteral("/testCal/changed.ics")
+             << QStringLiteral("/testCal/new.ics"));
+    QCOMPARE(m_agent->mRemoteDeletions.count(), 1);
+    QCOMPARE(m_agent->mRemoteDeletions.first()->uid(), QStringLiteral("NBUID:123456789:deleted"));
+    QVERIFY(m_agent->mLocalAdditions.isEmpty());
+}
+
+void tst_NotebookSyncAgent::prefetchLocalState()
+{
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:prefetch"));
+    event->setDtStart(QDateTime(QDate(2021, 3, 1), QTime(10, 0), Qt::UTC));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/prefetch.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""));
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc());
+
+    // The local state is loaded while the etags are fetched.
+    m_agent->fetchRemoteChanges();
+    QVERIFY(!m_agent->mLocalState.loaded);
+    QTRY_VERIFY(m_agent->mLocalState.loaded);
+    QCOMPARE(m_agent->mLocalState.incidences.count(), 1);
+    QCOMPARE(m_agent->mLocalState.incidences.first().href, uri);
+    QCOMPARE(m_agent->mLocalState.incidences.first().etag, QStringLiteral("\"etag\""));
+
+    // And consumed by the delta computation.
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(uri, QStringLiteral("\"etag-2\""));
+    QVERIFY(m_agent->calculateDelta(remoteUriEtags,
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    QVERIFY(!m_agent->mLocalState.loaded);
+    QCOMPARE(m_agent->mRemoteChanges, QSet<QString>() << uri);
+}
+
+void tst_NotebookSyncAgent::windowSlices()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+    m_agent->mNotebook->setSyncDate(now.addDays(-10));
+    m_agent->mNotebook->setCustomProperty("syncWindowFrom", from.addMonths(-1).toString(Qt::ISODate));
+    m_agent->mNotebook->setCustomProperty("syncWindowTo", to.addDays(-10).toString(Qt::ISODate));
+
+    // Etags are listed over the previous window, the new future slice is downloaded.
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QCOMPARE(m_agent->mFromDateTime, from);
+    QCOMPARE(m_agent->mToDateTime.toString(Qt::ISODate), to.addDays(-10).toString(Qt::ISODate));
+    QCOMPARE(m_agent->mPendingActions, 2);
+
+    // The whole window is stored once received.
+    QVERIFY(m_agent->mWindowFetched);
+    m_agent->mNotebookSyncedDateTime = now;
+    QVERIFY(m_agent->storeNotebook());
+    QCOMPARE(m_agent->mNotebook->customProperty("syncWindowTo"), to.toString(Qt::ISODate));
+}
+
+void tst_NotebookSyncAgent::windowSliceLocalChange()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+    m_agent->mNotebook->setSyncDate(now.addDays(-10));
+    m_agent->mNotebook->setCustomProperty("syncWindowFrom", from.toString(Qt::ISODate));
+    m_agent->mNotebook->setCustomProperty("syncWindowTo", to.addDays(-10).toString(Qt::ISODate));
+
+    // A synced incidence, edited locally, in the newly exposed slice.
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:slice-edit"));
+    event->setSummary(QStringLiteral("Local summary"));
+    event->setDtStart(to.addDays(-5));
+    event->setCreated(now.addDays(-20));
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    const QString uri = QStringLiteral("/testCal/slice-edit.ics");
+    m_agent->updateHrefETag(event->uid(), uri, QStringLiteral("\"etag\""));
+    event->setLastModified(now);
+    m_agent->mStorage->save();
+
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QCOMPARE(m_agent->mExposedSlices.count(), 1);
+    m_agent->processETags(noErrorReply(), 0, QStringList(), QHash<QString, QString>());
+
+    // The local change is sent, conditionally on the stored etag.
+    QVERIFY(incidenceListContains(m_agent->mLocalModifications, event));
+    QCOMPARE(m_agent->mSendingUploads.value(uri).etag, QStringLiteral("\"etag\""));
+    QVERIFY(!m_agent->mRemoteChanges.contains(uri));
+
+    // And not overwritten by the download of the slice.
+    const Buteo::Dav::Resource resource
+        = eventResource(QStringLiteral("slice-edit"), to.addDays(-5),
+                        QStringLiteral("\"etag-server\""),
+                        QStringLiteral("Server summary"));
+    QVERIFY(m_agent->updateIncidences(QList<NotebookSyncAgent::CalendarResource>()
+                                      << NotebookSyncAgent::CalendarResource(resource)));
+    QCOMPARE(event->summary(), QStringLiteral("Local summary"));
+    QCOMPARE(fetchETag(event), QStringLiteral("\"etag\""));
+    QVERIFY(m_agent->mRemoteModifications.isEmpty());
+}
+
+void tst_NotebookSyncAgent::refreshTiers()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+    const QString pastRefresh = now.addSecs(-3600).toString(Qt::ISODate);
+    KCalendarCore::Event::Ptr synced(new KCalendarCore::Event);
+    synced->setUid(QStringLiteral("NBUID:123456789:past-synced"));
+    synced->setDtStart(now.addDays(-30));
+    synced->setDtEnd(now.addDays(-30).addSecs(3600));
+    QVERIFY(m_agent->mCalendar->addEvent(synced, m_agent->mNotebook->uid()));
+    m_agent->updateHrefETag(synced->uid(), QStringLiteral("/testCal/past-synced.ics"),
+                            QStringLiteral("\"etag\""));
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(now.addDays(-1));
+    m_agent->mNotebook->setCustomProperty("syncWindowFrom", from.toString(Qt::ISODate));
+    m_agent->mNotebook->setCustomProperty("syncWindowTo", to.toString(Qt::ISODate));
+    m_agent->mNotebook->setCustomProperty("pastRefreshDate", pastRefresh);
+    m_agent->setRefreshIntervals(24 * 3600, 24 * 3600);
+
+    // The past was listed recently, the future was never listed.
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QCOMPARE(m_agent->mPastTierFrom, from);
+    QCOMPARE(m_agent->mFromDateTime, m_agent->mNotebookSyncedDateTime);
+    QVERIFY(!m_agent->mFutureTierTo.isValid());
+    QCOMPARE(m_agent->mToDateTime, to);
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    KCalendarCore::Event::Ptr past(new KCalendarCore::Event);
+    past->setDtStart(now.addDays(-30));
+    past->setDtEnd(now.addDays(-30).addSecs(3600));
+    QVERIFY(m_agent->inSkippedTier(past));
+    KCalendarCore::Event::Ptr future(new KCalendarCore::Event);
+    future->setDtStart(now.addDays(30));
+    future->setDtEnd(now.addDays(30).addSecs(3600));
+    QVERIFY(!m_agent->inSkippedTier(future));
+
+    // The synced resources of the unlisted tier are reported.
+    QVERIFY(m_agent->calculateDelta(QHash<QString, QString>(),
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    QVERIFY(m_agent->mRemoteDeletions.isEmpty());
+    QCOMPARE(m_agent->pastUnlistedCount(), 1);
+    QCOMPARE(m_agent->futureUnlistedCount(), -1);
+
+    // Only the listed tier gets a new refresh date.
+    QVERIFY(m_agent->storeNotebook());
+    QCOMPARE(m_agent->mNotebook->customProperty("pastRefreshDate"), pastRefresh);
+    QCOMPARE(m_agent->mNotebook->customProperty("futureRefreshDate"),
+             m_agent->mNotebookSyncedDateTime.toString(Qt::ISODate));
+}
+
+void tst_NotebookSyncAgent::progressiveSlowSync()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+    m_agent->setProgressiveSlowSync(true);
+    QSignalSpy committed(m_agent, &NotebookSyncAgent::chunkCommitted);
+    QSignalSpy finished(m_agent, &NotebookSyncAgent::finished);
+
+    // The next two weeks are downloaded first.
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SlowSync);
+    QCOMPARE(m_agent->mFromDateTime, m_agent->mNotebookSyncedDateTime);
+    QCOMPARE(m_agent->mToDateTime, m_agent->mNotebookSyncedDateTime.addDays(14));
+    QCOMPARE(m_agent->mPendingActions, 1);
+    // Then the rest of the future, and the past.
+    QDateTime end = m_agent->mToDateTime;
+    int future = 0;
+    while (future < m_agent->mSlowSyncChunks.count()
+           && m_agent->mSlowSyncChunks[future].first == end) {
+        end = m_agent->mSlowSyncChunks[future++].second;
+    }
+    QCOMPARE(end, to);
+    QDateTime start = m_agent->mFromDateTime;
+    for (int i = future; i < m_agent->mSlowSyncChunks.count(); i++) {
+        QCOMPARE(m_agent->mSlowSyncChunks[i].second, start);
+        start = m_agent->mSlowSyncChunks[i].first;
+    }
+    QCOMPARE(start, from);
+    const int chunks = m_agent->mSlowSyncChunks.count() + 1;
+
+    // Each chunk is committed before asking for the next one.
+    const Buteo::Dav::Resource resource
+        = eventResource(QStringLiteral("progressive"), now.addDays(1),
+                        QStringLiteral("\"etag\""));
+    m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(),
+                                   QList<Buteo::Dav::Resource>() << resource);
+    QTRY_COMPARE(committed.count(), 1);
+    QCOMPARE(committed.first().at(0).toInt(), 1);
+    QCOMPARE(committed.first().at(1).toInt(), chunks - 2);
+    QVERIFY(m_agent->mReceivedCalendarResources.isEmpty());
+    QVERIFY(m_agent->mStorage->notebook("123456789"));
+    QVERIFY(m_agent->mStorage->load(QStringLiteral("progressive")));
+    QVERIFY(m_agent->mCalendar->event(QStringLiteral("progressive")));
+    QVERIFY(m_agent->mNotebook->syncDate().isNull());
+
+    for (int i = 1; i < chunks; i++) {
+        QCOMPARE(finished.count(), 0);
+        m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(), QList<Buteo::Dav::Resource>());
+    }
+    QCOMPARE(committed.count(), chunks - 1);
+    QCOMPARE(finished.count(), 1);
+    QCOMPARE(m_agent->result().localItems().added, unsigned(1));
+}
+
+void tst_NotebookSyncAgent::twoPhaseSlowSync()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+    m_agent->setTwoPhaseSlowSync(true);
+
+    // The etags are listed first.
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SlowSync);
+    QCOMPARE(m_agent->mListedSlice.first, from);
+    QCOMPARE(m_agent->mListedSlice.second, to);
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // A listing too large for the server is split in two.
+    m_agent->processETags(Buteo::Dav::Client::Reply(QLatin1String("/testCal/"),
+                                                    QNetworkReply::UnknownServerError,
+                                                    QStringLiteral("Insufficient Storage"),
+                                                    QByteArray()), 507,
+                          QStringList(), QHash<QString, QString>());
+    QCOMPARE(m_agent->mListedSlice.first, from);
+    QVERIFY(m_agent->mListedSlice.second < to);
+    QCOMPARE(m_agent->mETagSlices.count(), 1);
+    QCOMPARE(m_agent->mETagSlices.first().first, m_agent->mListedSlice.second);
+    QCOMPARE(m_agent->mETagSlices.first().second, to);
+    QCOMPARE(m_agent->mPendingActions, 1);
+
+    // The listed resources are downloaded by bounded multigets,
+    // while the next slice is listed.
+    m_agent->mMultigetSize = 2;
+    QHash<QString, QString> etags;
+    for (int i = 0; i < 5; i++) {
+        etags.insert(QStringLiteral("/testCal/%1.ics").arg(i), QStringLiteral("\"%1\"").arg(i));
+    }
+    m_agent->processETags(noErrorReply(), 0, QStringList(), etags);
+    QVERIFY(m_agent->mETagSlices.isEmpty());
+    QCOMPARE(m_agent->mListedSlice.second, to);
+    QCOMPARE(m_agent->mSendingMultigets.count(), 3);
+    QVERIFY(m_agent->mMultigetQueue.isEmpty());
+    QCOMPARE(m_agent->mPendingActions, 4);
+
+    // An overloaded server gets smaller multigets.
+    Buteo::Dav::Client::Reply overloaded(QLatin1String("/testCal/"),
+                                         QNetworkReply::ServiceUnavailableError,
+                                         QStringLiteral("Service Unavailable"),
+                                         QByteArray());
+    const QStringList overloadedHrefs = m_agent->mSendingMultigets.first().hrefs;
+    QCOMPARE(overloadedHrefs.count(), 2);
+    m_agent->reportRequestFinished(overloaded, 503, overloadedHrefs, QList<Buteo::Dav::Resource>());
+    QCOMPARE(m_agent->mMultigetSize, 1);
+    QCOMPARE(m_agent->mSendingMultigets.count(), 3);
+    QCOMPARE(m_agent->mMultigetQueue.count(), 1);
+    QCOMPARE(m_agent->mPendingActions, 4);
+
+    // Other failures are retried on their own.
+    Buteo::Dav::Client::Reply failed(QLatin1String("/testCal/"),
+                                     QNetworkReply::InternalServerError,
+                                     QStringLiteral("Internal Server Error"),
+                                     QByteArray());
+    const QStringList failedHrefs = m_agent->mSendingMultigets.first().hrefs;
+    m_agent->reportRequestFinished(failed, 500, failedHrefs, QList<Buteo::Dav::Resource>());
+    QCOMPARE(m_agent->mSendingMultigets.count(), 3);
+    QCOMPARE(m_agent->mMultigetQueue.count(), 1);
+    QCOMPARE(m_agent->mMultigetQueue.first().hrefs, failedHrefs);
+    QCOMPARE(m_agent->mMultigetQueue.first().attempts, 1);
+    QCOMPARE(m_agent->mPendingActions, 4);
+    QVERIFY(m_agent->isCompleted());
+}
+
+void tst_NotebookSyncAgent::checkpointResume()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SlowSync);
+    const Buteo::Dav::Resource resource
+        = eventResource(QStringLiteral("checkpoint"), now.addDays(1),
+                        QStringLiteral("\"1\""));
+    m_agent->mPendingActions += 1;
+    m_agent->reportRequestFinished(noErrorReply(), 0, QStringList(),
+                                   QList<Buteo::Dav::Resource>() << resource);
+
+    // Connectivity is lost, what was received and parsed is kept,
+    // the storage being saved by the caller.
+    QTRY_VERIFY(m_agent->mParsingJobs.isEmpty());
+    QVERIFY(m_agent->checkpoint());
+    QVERIFY(m_agent->mStorage->save());
+    QVERIFY(m_agent->commitCheckpoint());
+    m_agent->abort();
+    QVERIFY(m_agent->mNotebook->syncDate().isNull());
+    QVERIFY(!m_agent->mNotebook->customProperty("slowSyncCheckpoint").isEmpty());
+    QVERIFY(m_agent->mStorage->load(QStringLiteral("checkpoint")));
+    KCalendarCore::Event::Ptr stored = m_agent->mCalendar->event(QStringLiteral("checkpoint"));
+    QVERIFY(stored);
+    QCOMPARE(fetchETag(stored), resource.etag);
+
+    // The next slow sync lists the etags first and only downloads
+    // what is not stored yet.
+    m_agent->startSync(from, to, true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SlowSync);
+    QCOMPARE(m_agent->mListedSlice.first, from);
+    QCOMPARE(m_agent->mCheckpointETags.value(resource.href), resource.etag);
+    QHash<QString, QString> etags;
+    etags.insert(resource.href, resource.etag);
+    etags.insert(QStringLiteral("/testCal/other.ics"), QStringLiteral("\"2\""));
+    m_agent->processETags(noErrorReply(), 0, QStringList(), etags);
+    QCOMPARE(m_agent->mSendingMultigets.count(), 1);
+    QCOMPARE(m_agent->mSendingMultigets.first().hrefs,
+             QStringList() << QStringLiteral("/testCal/other.ics"));
+}
+
+void tst_NotebookSyncAgent::prepareCleanSync()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    m_agent->mNotebook->setSyncDate(now.addDays(-1));
+    m_agent->mNotebook->setCustomProperty("lastFullSyncDate", now.addDays(-1).toString(Qt::ISODate));
+
+    // Notebooks that cannot be matched to a server calendar are not reconciled.
+    QCOMPARE(NotebookSyncAgent::prepareCleanSync(m_agent->mStorage, m_agent->mNotebook),
+             NotebookSyncAgent::CleanSyncUnmatched);
+    QVERIFY(!m_agent->mNotebook->syncDate().isNull());
+
+    m_agent->mNotebook->setCustomProperty("remoteCalendarPath", QStringLiteral("/testCal/"));
+
+    // Notebooks with local changes not sent yet keep their sync state.
+    KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("NBUID:123456789:pending"));
+    event->setDtStart(now);
+    QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+    QVERIFY(m_agent->mStorage->save());
+    QCOMPARE(NotebookSyncAgent::prepareCleanSync(m_agent->mStorage, m_agent->mNotebook),
+             NotebookSyncAgent::CleanSyncDeferred);
+    QCOMPARE(m_agent->mNotebook->syncDate(), now.addDays(-1));
+    QVERIFY(m_agent->mNotebook->customProperty("slowSyncCheckpoint").isEmpty());
+
+    m_agent->mNotebook->setSyncDate(now.addSecs(60));
+    QCOMPARE(NotebookSyncAgent::prepareCleanSync(m_agent->mStorage, m_agent->mNotebook),
+             NotebookSyncAgent::CleanSyncPrepared);
+    QVERIFY(m_agent->mNotebook->syncDate().isNull());
+    QVERIFY(!m_agent->mNotebook->customProperty("slowSyncCheckpoint").isEmpty());
+    QVERIFY(m_agent->mNotebook->customProperty("lastFullSyncDate").isEmpty());
+
+    // The next sync is a slow sync, reconciled with the local incidences.
+    m_agent->startSync(now.addMonths(-6), now.addMonths(12), true, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SlowSync);
+    QVERIFY(m_agent->mTwoPhaseSlowSync);
+    QVERIFY(m_agent->mListedSlice.first.isValid());
+}
+
+void tst_NotebookSyncAgent::evictOutOfWindow()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    const QStringList names = QStringList() << "old" << "margin" << "local";
+    for (const QString &name : names) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("NBUID:123456789:") + name);
+        event->setDtStart(name == QStringLiteral("margin") ? now.addMonths(-7) : now.addYears(-2));
+        QVERIFY(m_agent->mCalendar->addEvent(event, m_agent->mNotebook->uid()));
+        if (name != QStringLiteral("local")) {
+            m_agent->updateHrefETag(event->uid(), QStringLiteral("/testCal/%1.ics").arg(name),
+                                    QStringLiteral("\"etag\""));
+        }
+    }
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(now.addDays(1));
+    m_agent->mWindowFrom = m_agent->mFromDateTime = now.addMonths(-6);
+    m_agent->mWindowTo = m_agent->mToDateTime = now.addMonths(12);
+    m_agent->setEvictionMargin(60);
+
+    // Only synced incidences beyond the margin are evicted.
+    QVERIFY(m_agent->calculateRemoteDelta(QHash<QString, QString>(),
+                                          &m_agent->mRemoteChanges,
+                                          &m_agent->mRemoteDeletions));
+    QVERIFY(m_agent->mRemoteDeletions.isEmpty());
+    QCOMPARE(m_agent->mEvictions.count(), 1);
+    QCOMPARE(m_agent->mEvictions.first()->uid(), QStringLiteral("NBUID:123456789:old"));
+
+    // And purged, not marked as deleted.
+    QVERIFY(m_agent->applyRemoteChanges());
+    QVERIFY(!m_agent->mCalendar->incidence(QStringLiteral("NBUID:123456789:old")));
+    KCalendarCore::Incidence::List deleted;
+    QVERIFY(m_agent->mStorage->deletedIncidences(&deleted, QDateTime(), m_agent->mNotebook->uid()));
+    QVERIFY(deleted.isEmpty());
+    QVERIFY(m_agent->mStorage->load(QStringLiteral("NBUID:123456789:margin")));
+    QVERIFY(m_agent->mCalendar->incidence(QStringLiteral("NBUID:123456789:margin")));
+}
+
+void tst_NotebookSyncAgent::adaptivePolling()
+{
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    KCalendarCore::Event::Ptr changed(new KCalendarCore::Event);
+    changed->setUid(QStringLiteral("NBUID:123456789:changed"));
+    changed->setDtStart(now);
+    QVERIFY(m_agent->mCalendar->addEvent(changed, m_agent->mNotebook->uid()));
+    m_agent->updateHrefETag(changed->uid(), QStringLiteral("/testCal/changed.ics"),
+                            QStringLiteral("\"etag\""));
+    // Uploaded, but the href and etag were not stored.
+    KCalendarCore::Event::Ptr partial(new KCalendarCore::Event);
+    partial->setUid(QStringLiteral("NBUID:123456789:partial"));
+    partial->setDtStart(now);
+    QVERIFY(m_agent->mCalendar->addEvent(partial, m_agent->mNotebook->uid()));
+    m_agent->mStorage->save();
+
+    const QDateTime syncDate = now.addSecs(-600);
+    m_agent->mNotebook->setSyncDate(syncDate);
+    m_agent->mNotebook->setCustomProperty("remoteChangeRate", QStringLiteral("0.01"));
+    m_agent->mNotebook->setCustomProperty("lastListingDate", now.addSecs(-3600).toString(Qt::ISODate));
+    m_agent->setMaxStaleness(2 * 3600);
+
+    // A calendar with a low change rate, listed recently, is skipped,
+    // keeping its sync date and change rate.
+    m_agent->startSync(now.addDays(-30), now.addDays(30), false, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::SkippedSync);
+    QVERIFY(m_agent->isListingSkipped());
+    QTRY_VERIFY(m_agent->isFinished());
+    QVERIFY(m_agent->storeNotebook());
+    QCOMPARE(m_agent->mNotebook->syncDate(), syncDate);
+    QCOMPARE(m_agent->mNotebook->customProperty("remoteChangeRate"), QStringLiteral("0.01"));
+    QCOMPARE(m_agent->mNotebook->customProperty("lastListingDate"),
+             now.addSecs(-3600).toString(Qt::ISODate));
+
+    // Otherwise, the etags are listed and the change rate updated,
+    // only counting the resources changed server side.
+    m_agent->mNotebook->setCustomProperty("remoteChangeRate", QStringLiteral("0.2"));
+    m_agent->startSync(now.addDays(-30), now.addDays(30), false, true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QVERIFY(!m_agent->isListingSkipped());
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(QStringLiteral("/testCal/changed.ics"), QStringLiteral("\"etag-2\""));
+    remoteUriEtags.insert(QStringLiteral("/testCal/partial.ics"), QStringLiteral("\"etag\""));
+    QVERIFY(m_agent->calculateRemoteDelta(remoteUriEtags,
+                                          &m_agent->mRemoteChanges,
+                                          &m_agent->mRemoteDeletions));
+    // A conflict, downloaded again, see resolveConflicts().
+    m_agent->mRemoteChanges.insert(QStringLiteral("/testCal/conflict.ics"));
+    QCOMPARE(m_agent->mRemoteChanges.count(), 3);
+    QVERIFY(m_agent->storeNotebook());
+    QCOMPARE(m_agent->mNotebook->customProperty("remoteChangeRate"), QStringLiteral("0.4"));
+    QCOMPARE(m_agent->mNotebook->customProperty("lastListingDate"),
+             m_agent->mNotebookSyncedDateTime.toString(Qt::ISODate));
+}
+
+void tst_NotebookSyncAgent::benchmarkExceptions_data()
+{
+    QTest::addColumn<int>("exceptionCount");
+    QTest::addColumn<bool>("withParent");
+
+    QTest::newRow("300 exceptions") << 300 << true;
+    QTest::newRow("1000 exceptions") << 1000 << true;
+    QTest::newRow("300 orphan exceptions") << 300 << false;
+}
+
+void tst_NotebookSyncAgent::benchmarkExceptions()
+{
+    QFETCH(int, exceptionCount);
+    QFETCH(bool, withParent);
+
+    const QDateTime start(QDate(2021, 1, 4), QTime(10, 0), Qt::UTC);
+    KCalendarCore::Incidence::List incidences;
+    if (withParent) {
+        KCalendarCore::Event::Ptr parent(new KCalendarCore::Event);
+        parent->setUid(QStringLiteral("benchmark-series"));
+        parent->setSummary(QStringLiteral("Daily meeting"));
+        parent->setDtStart(start);
+        parent->setDtEnd(start.addSecs(1800));
+        parent->recurrence()->setDaily(1);
+        parent->recurrence()->setDuration(2 * exceptionCount);
+        incidences << parent;
+    }
+    for (int i = 0; i < exceptionCount; i++) {
+        KCalendarCore::Event::Ptr exception(new KCalendarCore::Event);
+        exception->setUid(QStringLiteral("benchmark-series"));
+        exception->setRecurrenceId(start.addDays(2 * i));
+        exception->setSummary(QStringLiteral("Moved meeting %1").arg(i));
+        exception->setDtStart(start.addDays(2 * i).addSecs(3600));
+        exception->setDtEnd(start.addDays(2 * i).addSecs(5400));
+        incidences << exception;
+    }
+    const QList<NotebookSyncAgent::CalendarResource> resources
+        = QList<NotebookSyncAgent::CalendarResource>()
+        << NotebookSyncAgent::CalendarResource(QStringLiteral("/testCal/benchmark-series.ics"),
+                                               QStringLiteral("\"etag\""), incidences);
+
+    m_agent->mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
+    // First run adds the series, next ones update it.
+    QBENCHMARK {
+        QVERIFY(m_agent->updateIncidences(resources));
+    }
+
+    KCalendarCore::Incidence::Ptr parent = m_agent->mCalendar->incidence(QStringLiteral("NBUID:123456789:benchmark-series"));
+    QVERIFY(parent);
+    QVERIFY(parent->recurs());
+    QCOMPARE(m_agent->mCalendar->instances(parent).count(), exceptionCount);
+    QVERIFY(m_agent->mRemoteDeletions.isEmpty());
+}
+
+void tst_NotebookSyncAgent::benchmarkUpload()
+{
+    const QTimeZone helsinki("Europe/Helsinki");
+    KCalendarCore::Incidence::List incidences;
+    for (int i = 0; i < 1000; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("NBUID:123456789:upload-%1").arg(i));
+        event->setSummary(QStringLiteral("Modified event %1").arg(i));
+        event->setDescription(QStringLiteral("Some description for the modified event."));
+        event->setDtStart(QDateTime(QDate(2021, 1, 1).addDays(i), QTime(10, 0), helsinki));
+        event->setDtEnd(QDateTime(QDate(2021, 1, 1).addDays(i), QTime(11, 0), helsinki));
+        event->addComment(QStringLiteral("buteo:caldav:uri:/testCal/upload-%1.ics").arg(i));
+        event->addComment(QStringLiteral("buteo:caldav:etag:\"%1\"").arg(i));
+        incidences << event;
+    }
+
+    qint64 size = 0;
+    QBENCHMARK {
+        size = 0;
+        for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(incidences)) {
+            size += IncidenceHandler::toIcs(incidence).size();
+        }
+    }
+    QVERIFY(size > 0);
+}
+
+void tst_NotebookSyncAgent::benchmarkInitialUpsync()
+{
+    for (int i = 0; i < 5000; i++) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("NBUID:123456789:upsync-%1").arg(i));
+        event->setSummary(QStringLiteral("Imported event %1").arg(i));
+        event->setDtStart(QDateTime(QDate(2021, 1, 1), QTime(10, 0), Qt::UTC).addSecs(3600 * i));
+        event->setDtEnd(QDateTime(QDate(2021, 1, 1), QTime(11, 0), Qt::UTC).addSecs(3600 * i));
+        m_agent->mLocalAdditions << event;
+    }
+
+    QBENCHMARK_ONCE {
+        m_agent->sendLocalChanges();
+    }
+    QCOMPARE(m_agent->mSentUids.count(), 5000);
+    QCOMPARE(m_agent->mPendingActions, 5000);
+    QVERIFY(m_agent->mSendingUploads.count() < 5000);
+    QCOMPARE(m_agent->mSendingUploads.count() + m_agent->mUploadQueue.count(), 5000);
+}
+
 #include "tst_notebooksyncagent.moc"
 QTEST_MAIN(tst_NotebookSyncAgent)
@@ -24,6 +24,7 @@
 
 #include <davtypes.h>
 #include <notebooksyncagent.h>
+#include <icsparser.h>
 #include <KCalendarCore/Event>
 
 class tst_Reader : public QObject
@@ -49,8 +50,44 @@ private slots:
 
     void readAlarm_data();
     void readAlarm();
+
+    void sharedTimeZones();
+    void benchmarkTimeZones_data();
+    void benchmarkTimeZones();
 };
 
+static QString icsWithTimeZone(int i)
+{
+    return QStringLiteral("BEGIN:VCALENDAR\r\n"
+                          "VERSION:2.0\r\n"
+                          "PRODID:-//Test//EN\r\n"
+                          "BEGIN:VTIMEZONE\r\n"
+                          "TZID:Europe/Helsinki\r\n"
+                          "BEGIN:DAYLIGHT\r\n"
+                          "TZOFFSETFROM:+0200\r\n"
+                          "TZOFFSETTO:+0300\r\n"
+                          "TZNAME:EEST\r\n"
+                          "DTSTART:19700329T030000\r\n"
+                          "RRULE:FREQ=YEARLY;BYDAY=-1SU;BYMONTH=3\r\n"
+                          "END:DAYLIGHT\r\n"
+                          "BEGIN:STANDARD\r\n"
+                          "TZOFFSETFROM:+0300\r\n"
+                          "TZOFFSETTO:+0200\r\n"
+                          "TZNAME:EET\r\n"
+                          "DTSTART:19701025T040000\r\n"
+                          "RRULE:FREQ=YEARLY;BYDAY=-1SU;BYMONTH=10\r\n"
+                          "END:STANDARD\r\n"
+                          "END:VTIMEZONE\r\n"
+                          "BEGIN:VEVENT\r\n"
+                          "UID:tz-event-%1\r\n"
+                          "DTSTAMP:20210101T000000Z\r\n"
+                          "DTSTART;TZID=Europe/Helsinki:20210601T100000\r\n"
+                          "DTEND;TZID=Europe/Helsinki:20210601T110000\r\n"
+                          "SUMMARY:Event %1\r\n"
+                          "END:VEVENT\r\n"
+                          "END:VCALENDAR\r\n").arg(i);
+}
+
 tst_Reader::tst_Reader()
 {
 }
@@ -382,5 +419,51 @@ void tst_Reader::readAlarm()
     QCOMPARE(alarm->time(), QDateTime::fromString(expectedTime, Qt::ISODate));
 }
 
+void tst_Reader::sharedTimeZones()
+{
+    IcsParser parser;
+    const KCalendarCore::Incidence::List first = parser.parse(icsWithTimeZone(0));
+    QCOMPARE(parser.timeZoneCount(), 1);
+    const KCalendarCore::Incidence::List second = parser.parse(icsWithTimeZone(1));
+    QCOMPARE(parser.timeZoneCount(), 1);
+    QCOMPARE(parser.skippedTimeZoneCount(), 2);
+
+    QCOMPARE(first.count(), 1);
+    QCOMPARE(second.count(), 1);
+    QCOMPARE(second.first()->uid(), QStringLiteral("tz-event-1"));
+    QCOMPARE(second.first()->dtStart().timeZone(), first.first()->dtStart().timeZone());
+    QCOMPARE(second.first()->dtStart(),
+             QDateTime(QDate(2021, 6, 1), QTime(10, 0), QTimeZone("Europe/Helsinki")));
+}
+
+void tst_Reader::benchmarkTimeZones_data()
+{
+    QTest::addColumn<bool>("sharedParser");
+
+    QTest::newRow("parser per resource") << false;
+    QTest::newRow("shared parser") << true;
+}
+
+void tst_Reader::benchmarkTimeZones()
+{
+    QFETCH(bool, sharedParser);
+
+    QList<Buteo::Dav::Resource> resources;
+    for (int i = 0; i < 500; i++) {
+        Buteo::Dav::Resource resource;
+        resource.href = QStringLiteral("/calendar/tz-event-%1.ics").arg(i);
+        resource.data = icsWithTimeZone(i);
+        resources << resource;
+    }
+
+    QBENCHMARK {
+        IcsParser parser;
+        for (const Buteo::Dav::Resource &resource : const_cast<const QList<Buteo::Dav::Resource>&>(resources)) {
+            NotebookSyncAgent::CalendarResource parsed(resource, sharedParser ? &parser : 0);
+            QCOMPARE(parsed.incidences.count(), 1);
+        }
+    }
+}
+
 #include "tst_reader.moc"
 QTEST_MAIN(tst_Reader)
@@ -1,5 +1,5 @@
 TEMPLATE = subdirs
-SUBDIRS += notebooksyncagent reader propfind caldavclient
+SUBDIRS += notebooksyncagent reader propfind caldavclient icsscanner
 
 tests_xml.path = /opt/tests/buteo/plugins/caldav
 tests_xml.files = tests.xml